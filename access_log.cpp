@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "headers/access_log.h"
+#include "headers/trace_ring.h"
+
+access_logger access_log;
+
+// 每个线程正在写的段
+struct access_logger::segment
+{
+    int fd;
+    char *base;                 // 为空时不记录: 没有配置目录, 或者打开失败(等下一次configure再试)
+    size_t size;
+    size_t used;
+    double ticks_per_us;
+    uint32_t generation;
+    uint32_t thread;
+    uint32_t seq;
+};
+
+thread_local access_logger::segment *access_logger::m_local = NULL;
+
+access_logger::access_logger()
+    : m_segment_size(64 << 20), m_generation(0), m_enabled(false), m_threads(0), m_segments(0), m_failures(0)
+{
+}
+
+void access_logger::configure(const std::string &dir, int segment_mb)
+{
+    m_lock.lock();
+    if (dir != m_dir || (size_t)segment_mb << 20 != m_segment_size)
+    {
+        m_dir = dir;
+        m_segment_size = (size_t)segment_mb << 20;
+        m_generation.fetch_add(1, std::memory_order_release);
+    }
+    m_enabled.store(!dir.empty(), std::memory_order_relaxed);
+    m_lock.unlock();
+}
+
+void access_logger::close_segment(segment &seg)
+{
+    if (!seg.base)
+    {
+        return;
+    }
+    munmap(seg.base, seg.size);
+    // 去掉没有写到的部分, 解码时不用扫过一长串0
+    if (ftruncate(seg.fd, seg.used) < 0)
+    {
+        perror("access log ftruncate");
+    }
+    close(seg.fd);
+    seg.base = NULL;
+}
+
+bool access_logger::open_segment(segment &seg)
+{
+    m_lock.lock();
+    std::string dir = m_dir;
+    size_t size = m_segment_size;
+    seg.generation = m_generation.load(std::memory_order_relaxed);
+    m_lock.unlock();
+    if (dir.empty())
+    {
+        return false;
+    }
+
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/access-%d-%u-%u.log", dir.c_str(), (int)getpid(), seg.thread, seg.seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        m_failures.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        close(fd);
+        m_failures.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    seg.fd = fd;
+    seg.base = (char *)base;
+    seg.size = size;
+    seg.ticks_per_us = trace_ticks_per_us();
+
+    access_log_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ACCESS_LOG_MAGIC, sizeof(ACCESS_LOG_MAGIC));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_tsc = trace_clock();
+    header.start_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    header.ticks_per_us = seg.ticks_per_us;
+    header.record_size = sizeof(access_record);
+    header.pid = getpid();
+    header.thread = seg.thread;
+    header.seq = seg.seq++;
+    memcpy(seg.base, &header, sizeof(header));
+    seg.used = sizeof(header);
+    m_segments.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void access_logger::append(access_record &r, const char *path, uint64_t start_tsc)
+{
+    segment *seg = m_local;
+    if (!seg)
+    {
+        seg = m_local = new segment;
+        memset(seg, 0, sizeof(*seg));
+        seg->thread = m_threads.fetch_add(1, std::memory_order_relaxed);
+        seg->generation = m_generation.load(std::memory_order_relaxed) - 1;
+    }
+    if (seg->generation != m_generation.load(std::memory_order_acquire)
+        || (seg->base && seg->used + sizeof(r) > seg->size))
+    {
+        close_segment(*seg);
+        open_segment(*seg);
+    }
+    if (!seg->base)
+    {
+        return;
+    }
+    r.path_hash = path ? access_path_hash(path, strcspn(path, "?")) : 0;
+    r.latency_us = start_tsc && r.tsc > start_tsc ? (uint32_t)((r.tsc - start_tsc) / seg->ticks_per_us) : 0;
+    memcpy(seg->base + seg->used, &r, sizeof(r));
+    seg->used += sizeof(r);
+}
+
+void access_logger::print_stats() const
+{
+    if (enabled() || m_segments.load(std::memory_order_relaxed))
+    {
+        printf("access log: %llu segments opened, %llu failures\n",
+               (unsigned long long)m_segments.load(std::memory_order_relaxed),
+               (unsigned long long)m_failures.load(std::memory_order_relaxed));
+    }
+}
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include "headers/asset_pack.h"
+#include "headers/locker.h"
+
+std::shared_ptr<asset_pack> asset_pack::open(const char *path)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("cannot open pack %s\n", path);
+        return std::shared_ptr<asset_pack>();
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(pack_header))
+    {
+        close(fd);
+        printf("pack %s is too small\n", path);
+        return std::shared_ptr<asset_pack>();
+    }
+    // 替换包的时候是rename新文件, 旧文件的映射不受影响
+    char *base = (char *)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        printf("cannot mmap pack %s\n", path);
+        return std::shared_ptr<asset_pack>();
+    }
+    std::shared_ptr<asset_pack> pack(new asset_pack);
+    pack->m_base = base;
+    pack->m_size = st.st_size;
+    pack->m_header = (const pack_header *)base;
+    if (!pack->validate())
+    {
+        printf("pack %s is corrupt\n", path);
+        return std::shared_ptr<asset_pack>();
+    }
+    pack->m_entries = (const pack_entry *)(base + pack->m_header->entries_off);
+    pack->m_slots = (const uint32_t *)(base + pack->m_header->slots_off);
+    return pack;
+}
+
+asset_pack::~asset_pack()
+{
+    if (m_base)
+    {
+        munmap(m_base, m_size);
+    }
+}
+
+// 所有偏移都在启动时检查一遍, 之后查找和发送时不再做边界检查
+bool asset_pack::validate() const
+{
+    const pack_header &h = *m_header;
+    if (memcmp(h.magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 || h.version != PACK_VERSION || h.total_size != m_size)
+    {
+        return false;
+    }
+    if (h.slot_count == 0 || (h.slot_count & (h.slot_count - 1)) || h.slot_count <= h.count)
+    {
+        return false;
+    }
+    if (h.entries_off > m_size || (uint64_t)h.count * sizeof(pack_entry) > m_size - h.entries_off
+        || h.slots_off > m_size || (uint64_t)h.slot_count * sizeof(uint32_t) > m_size - h.slots_off)
+    {
+        return false;
+    }
+    const pack_entry *entries = (const pack_entry *)(m_base + h.entries_off);
+    const uint32_t *slots = (const uint32_t *)(m_base + h.slots_off);
+    for (uint32_t i = 0; i < h.slot_count; ++i)
+    {
+        if (slots[i] > h.count)
+        {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h.count; ++i)
+    {
+        const pack_entry &e = entries[i];
+        const uint64_t ranges[][2] = {
+            {e.body_off, e.body_len}, {e.gzip_off, e.gzip_len}, {e.path_off, e.path_len},
+            {e.headers_off, e.headers_len}, {e.gzip_headers_off, e.gzip_headers_len}, {e.etag_off, e.etag_len},
+        };
+        for (const uint64_t *r : ranges)
+        {
+            if (r[0] > m_size || r[1] > m_size - r[0])
+            {
+                return false;
+            }
+        }
+        if (e.hash != pack_hash(m_base + e.path_off, e.path_len))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+const pack_entry *asset_pack::find(const char *path, size_t len) const
+{
+    uint64_t h = pack_hash(path, len);
+    uint32_t mask = m_header->slot_count - 1;
+    // slot_count大于条目数, 一定能碰到空槽
+    for (uint32_t i = h & mask;; i = (i + 1) & mask)
+    {
+        uint32_t slot = m_slots[i];
+        if (slot == 0)
+        {
+            return NULL;
+        }
+        const pack_entry *e = &m_entries[slot - 1];
+        if (e->hash == h && e->path_len == len && memcmp(m_base + e->path_off, path, len) == 0)
+        {
+            return e;
+        }
+    }
+}
+
+// 当前的包. 每个线程缓存一份引用, 只有包被替换之后才加锁重新取, 平时只是一次原子读
+static locker pack_lock;
+static std::shared_ptr<asset_pack> installed_pack;
+static std::atomic<uint64_t> pack_generation(0);
+
+std::shared_ptr<asset_pack> asset_pack::current()
+{
+    static thread_local std::shared_ptr<asset_pack> cached;
+    static thread_local uint64_t cached_generation = 0;
+    uint64_t gen = pack_generation.load(std::memory_order_acquire);
+    if (gen != cached_generation)
+    {
+        pack_lock.lock();
+        cached = installed_pack;
+        cached_generation = pack_generation.load(std::memory_order_relaxed);
+        pack_lock.unlock();
+    }
+    return cached;
+}
+
+void asset_pack::install(std::shared_ptr<asset_pack> pack)
+{
+    pack_lock.lock();
+    installed_pack = pack;
+    pack_generation.fetch_add(1, std::memory_order_release);
+    pack_lock.unlock();
+}
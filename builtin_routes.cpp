@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "headers/router.h"
+#include "headers/http_conn.h"
+#include "headers/config.h"
+
+// POST/PUT /upload: 请求体交给discard_consumer, 响应里是收到的字节数和校验值
+static ROUTE_RESULT upload_handler(const request_view &req, handler_response &resp)
+{
+    resp.consumer = new discard_consumer;
+    return ROUTE_OK;
+}
+
+// GET /stream/<字节数>: 分块发送生成的文本
+static ROUTE_RESULT stream_handler(const request_view &req, handler_response &resp)
+{
+    std::string n(req.rest, req.rest_len);
+    char *end;
+    unsigned long long total = strtoull(n.c_str(), &end, 10);
+    if (n.empty() || *end != '\0')
+    {
+        return ROUTE_NOT_FOUND;
+    }
+    resp.stream = new pattern_producer(total);
+    return ROUTE_OK;
+}
+
+// GET /status: 当前的连接数, 以及累计的请求数、客户端socket上的epoll_ctl次数、完成队列唤醒主线程的次数;
+// 冷文件的预取次数; 打开了文件缓存时再加一行缓存的命中率和淘汰数, 有事件流频道时再加一行订阅者和丢弃的事件数
+static ROUTE_RESULT status_handler(const request_view &req, handler_response &resp)
+{
+    char buf[192];
+    int n = snprintf(buf, sizeof(buf), "users: %d\nrequests: %llu\nepoll_ctl: %llu\nwakeups: %llu\nprefetches: %llu\n",
+                     http_conn::m_user_count.load(), (unsigned long long)http_conn::m_requests.load(),
+                     (unsigned long long)http_conn::m_epoll_ctls.load(),
+                     (unsigned long long)(http_conn::m_ready ? http_conn::m_ready->wakeups() : 0),
+                     (unsigned long long)http_conn::m_prefetches.load());
+    resp.body.assign(buf, n);
+    if (content_cache.enabled())
+    {
+        resp.body += content_cache.stats();
+    }
+    resp.body += sse_events.stats();
+    return ROUTE_OK;
+}
+
+// 管理路由(/config, /trace)只对配置项admin_routes允许的客户端开放, 不允许时和没有这个路径一样回404.
+// local: 回环地址或者unix socket上的连接; 前面的代理替外部客户端转发过来的请求也算本机的, 这时要保持off
+static bool admin_allowed(const request_view &req)
+{
+    const std::string &mode = current_config()->admin_routes;
+    if (mode == "all")
+    {
+        return true;
+    }
+    return mode == "local" && (req.cred || (ntohl(req.peer->sin_addr.s_addr) >> 24) == 127);
+}
+
+// GET /config: 当前生效的配置
+static ROUTE_RESULT config_handler(const request_view &req, handler_response &resp)
+{
+    if (!admin_allowed(req))
+    {
+        return ROUTE_NOT_FOUND;
+    }
+    resp.body = current_config()->dump();
+    return ROUTE_OK;
+}
+
+// GET /trace: 各线程最近请求的阶段时间戳, Chrome trace-event JSON. 每次要把所有线程的环都转一遍, 和/config一样受admin_routes限制
+static ROUTE_RESULT trace_handler(const request_view &req, handler_response &resp)
+{
+    if (!admin_allowed(req))
+    {
+        return ROUTE_NOT_FOUND;
+    }
+    resp.body = trace_dump();
+    return ROUTE_OK;
+}
+
+// 把收到的每一段原样发回去, 大消息也不在服务器里攒成整条
+class echo_ws_handler : public ws_handler
+{
+public:
+    void on_data(ws_session &s, int opcode, const char *data, size_t len, bool first, bool last)
+    {
+        s.send_frame(first ? opcode : WS_CONTINUATION, data, len, last);
+    }
+};
+
+// GET /ws/echo: WebSocket回显
+static ROUTE_RESULT ws_echo_handler(const request_view &req, handler_response &resp)
+{
+    resp.websocket = new echo_ws_handler;
+    return ROUTE_OK;
+}
+
+// 发布: 请求体整个作为一个事件的数据, 响应里是收到它的订阅者数
+class sse_publish_consumer : public body_consumer
+{
+public:
+    sse_publish_consumer(const std::shared_ptr<sse_channel> &c) : m_channel(c) {}
+    bool on_data(const char *data, size_t len)
+    {
+        if (m_data.size() + len > sse_hub::MAX_EVENT)
+        {
+            return false;
+        }
+        m_data.append(data, len);
+        return true;
+    }
+    int on_end(char *out, int cap)
+    {
+        int n = m_channel ? m_channel->publish(m_data.data(), m_data.size()) : 0;
+        return snprintf(out, cap, "delivered to %d subscribers\n", n);
+    }
+
+private:
+    std::shared_ptr<sse_channel> m_channel;
+    std::string m_data;
+};
+
+// GET /events/<频道>: 订阅事件流; POST /events/<频道>: 发布一个事件, 没有订阅者的频道不创建
+static ROUTE_RESULT events_handler(const request_view &req, handler_response &resp)
+{
+    std::string name(req.rest, req.rest_len);
+    if (name.empty() || name.find('/') != std::string::npos)
+    {
+        return ROUTE_NOT_FOUND;
+    }
+    if (req.method == http_conn::POST)
+    {
+        resp.consumer = new sse_publish_consumer(sse_events.channel(name, false));
+        return ROUTE_OK;
+    }
+    resp.sse = sse_events.channel(name, true);
+    return resp.sse ? ROUTE_OK : ROUTE_FORBIDDEN;
+}
+
+void register_builtin_routes(router &r)
+{
+    r.add_exact("/upload", ROUTE_POST | ROUTE_PUT, upload_handler);
+    r.add_prefix("/stream/", ROUTE_GET, stream_handler);
+    r.add_exact("/status", ROUTE_GET, status_handler);
+    r.add_exact("/config", ROUTE_GET, config_handler);
+    r.add_exact("/trace", ROUTE_GET, trace_handler);
+    r.add_exact("/ws/echo", ROUTE_GET, ws_echo_handler);
+    r.add_prefix("/events/", ROUTE_GET | ROUTE_POST, events_handler);
+}
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "headers/config.h"
+#include "headers/locker.h"
+
+// 构建时通过 -DDOC_ROOT 指定
+#ifndef DOC_ROOT
+#define DOC_ROOT "/home/mal/Webserver/resources"
+#endif
+
+server_config::server_config()
+    : doc_root(DOC_ROOT), max_fd(65536), max_events(10000), backlog(5), threads(8), max_requests(10000),
+      read_buffer(2048), write_buffer(1024), model("reactor"), rate(0), burst(0), conns(0),
+      log_segment(64), cache_size(0), idle_timeout(0), io_threads(2),
+      sse_queue(256), sse_policy("drop"), admin_routes("off")
+{
+}
+
+// 每个键对应的成员和取值范围; int/double/string三种成员指针只有一个不为空
+struct config_key
+{
+    const char *name;
+    bool live;                              // SIGHUP时可以生效
+    int server_config::*int_field;
+    double server_config::*double_field;
+    std::string server_config::*string_field;
+    double min, max;
+};
+
+static const config_key config_keys[] = {
+    {"doc_root", false, NULL, NULL, &server_config::doc_root, 1, 4096},
+    {"max_fd", false, &server_config::max_fd, NULL, NULL, 64, 1 << 22},
+    {"max_events", true, &server_config::max_events, NULL, NULL, 1, 1 << 20},
+    {"backlog", true, &server_config::backlog, NULL, NULL, 1, 1 << 20},
+    {"threads", true, &server_config::threads, NULL, NULL, 1, 1024},
+    {"max_requests", true, &server_config::max_requests, NULL, NULL, 1, 1 << 24},
+    // 写缓冲区要放得下最长的响应头
+    {"read_buffer", false, &server_config::read_buffer, NULL, NULL, 1024, 1 << 20},
+    {"write_buffer", false, &server_config::write_buffer, NULL, NULL, 1024, 1 << 20},
+    {"model", false, NULL, NULL, &server_config::model, 0, 0},
+    {"pack", true, NULL, NULL, &server_config::pack, 0, 4096},
+    {"rate", true, NULL, &server_config::rate, NULL, 0, 1 << 20},
+    {"burst", true, NULL, &server_config::burst, NULL, 0, 1 << 14},
+    {"conns", true, &server_config::conns, NULL, NULL, 0, 1 << 22},
+    {"capture", true, NULL, NULL, &server_config::capture, 0, 4096},
+    {"access_log", true, NULL, NULL, &server_config::access_log, 0, 4096},
+    {"log_segment", true, &server_config::log_segment, NULL, NULL, 1, 4096},
+    {"cache_size", true, &server_config::cache_size, NULL, NULL, 0, 1 << 20},
+    {"idle_timeout", true, &server_config::idle_timeout, NULL, NULL, 0, 86400},
+    {"io_threads", false, &server_config::io_threads, NULL, NULL, 0, 256},
+    {"sse_queue", true, &server_config::sse_queue, NULL, NULL, 1, 1 << 16},
+    {"sse_policy", true, NULL, NULL, &server_config::sse_policy, 0, 0},
+    // sockaddr_un.sun_path是108字节, 路径要以'\0'结尾, 抽象地址的'@'换成'\0'
+    {"unix_socket", false, NULL, NULL, &server_config::unix_socket, 0, 107},
+    {"admin_routes", true, NULL, NULL, &server_config::admin_routes, 0, 0},
+};
+static const int KEY_COUNT = sizeof(config_keys) / sizeof(config_keys[0]);
+
+bool server_config::set(const std::string &key, const std::string &value, std::string &err)
+{
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        const config_key &k = config_keys[i];
+        if (key != k.name)
+        {
+            continue;
+        }
+        if (k.string_field)
+        {
+            bool bad;
+            if (key == "model")
+            {
+                bad = value != "reactor" && value != "rtc" && value != "single" && value != "coro";
+            }
+            else if (key == "sse_policy")
+            {
+                bad = value != "drop" && value != "disconnect";
+            }
+            else if (key == "admin_routes")
+            {
+                bad = value != "off" && value != "local" && value != "all";
+            }
+            else
+            {
+                bad = value.size() < k.min || value.size() > k.max;
+            }
+            if (bad)
+            {
+                err = key + ": bad value '" + value + "'";
+                return false;
+            }
+            this->*k.string_field = value;
+            return true;
+        }
+        char *end;
+        errno = 0;
+        double v = strtod(value.c_str(), &end);
+        if (value.empty() || *end != '\0' || errno != 0 || v < k.min || v > k.max
+            || (k.int_field && v != (int)v) || (key == "rate" && v > 0 && v < 1))
+        {
+            char range[64];
+            // 令牌桶按毫秒补充千分之一个令牌, 每秒不到一个令牌的速率表示不了
+            if (key == "rate")
+            {
+                snprintf(range, sizeof(range), " (expected 0 or 1..%g)", k.max);
+            }
+            else
+            {
+                snprintf(range, sizeof(range), " (expected %g..%g)", k.min, k.max);
+            }
+            err = key + ": bad value '" + value + "'" + range;
+            return false;
+        }
+        if (k.int_field)
+        {
+            this->*k.int_field = (int)v;
+        }
+        else
+        {
+            this->*k.double_field = v;
+        }
+        return true;
+    }
+    err = "unknown key '" + key + "'";
+    return false;
+}
+
+static std::string trim(const std::string &s)
+{
+    size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos)
+    {
+        return "";
+    }
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+bool server_config::set(const std::string &assignment, std::string &err)
+{
+    size_t eq = assignment.find('=');
+    if (eq == std::string::npos)
+    {
+        err = "expected key=value, got '" + assignment + "'";
+        return false;
+    }
+    return set(trim(assignment.substr(0, eq)), trim(assignment.substr(eq + 1)), err);
+}
+
+bool server_config::load(const char *path, std::string &err)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        err = std::string(path) + ": " + strerror(errno);
+        return false;
+    }
+    char line[4096];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f))
+    {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash)
+        {
+            *hash = '\0';
+        }
+        std::string text = trim(line);
+        if (text.empty())
+        {
+            continue;
+        }
+        std::string why;
+        if (!set(text, why))
+        {
+            char where[32];
+            snprintf(where, sizeof(where), ":%d: ", lineno);
+            err = path + std::string(where) + why;
+            ok = false;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+std::string server_config::dump() const
+{
+    std::string out;
+    char buf[64];
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        const config_key &k = config_keys[i];
+        out += k.name;
+        out += " = ";
+        if (k.string_field)
+        {
+            out += this->*k.string_field;
+        }
+        else
+        {
+            snprintf(buf, sizeof(buf), "%g", k.int_field ? (double)(this->*k.int_field) : this->*k.double_field);
+            out += buf;
+        }
+        out += k.live ? "\n" : " (restart)\n";
+    }
+    return out;
+}
+
+std::string server_config::keep_restart_only(const server_config &other)
+{
+    std::string kept;
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        const config_key &k = config_keys[i];
+        if (k.live)
+        {
+            continue;
+        }
+        bool same = k.string_field ? this->*k.string_field == other.*k.string_field
+                                   : this->*k.int_field == other.*k.int_field;
+        if (!same)
+        {
+            if (k.string_field)
+            {
+                this->*k.string_field = other.*k.string_field;
+            }
+            else
+            {
+                this->*k.int_field = other.*k.int_field;
+            }
+            kept += kept.empty() ? k.name : std::string(", ") + k.name;
+        }
+    }
+    return kept;
+}
+
+// 和资源包一样: 只在启动和SIGHUP时替换, 查看时加锁取一份引用
+static locker config_lock;
+static std::shared_ptr<const server_config> installed_config;
+
+std::shared_ptr<const server_config> current_config()
+{
+    config_lock.lock();
+    std::shared_ptr<const server_config> c = installed_config;
+    config_lock.unlock();
+    return c;
+}
+
+void install_config(std::shared_ptr<const server_config> config)
+{
+    config_lock.lock();
+    installed_config = config;
+    config_lock.unlock();
+}
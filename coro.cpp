@@ -0,0 +1,294 @@
+#include <time.h>
+#include <algorithm>
+#include <new>
+#include "headers/coro.h"
+#include "headers/http_conn.h"
+
+// 协程帧按64字节分档, 每档一个空闲链表; 连接的协程帧大小都一样, 实际上只用到一档
+static const size_t FRAME_ALIGN = 64;
+static const size_t FRAME_CLASSES = 64;
+
+struct free_frame
+{
+    free_frame *next;
+};
+
+static thread_local free_frame *free_frames[FRAME_CLASSES];
+
+void *coro_frame_alloc(size_t size)
+{
+    size_t c = (size + FRAME_ALIGN - 1) / FRAME_ALIGN;
+    if (c >= FRAME_CLASSES)
+    {
+        return ::operator new(size);
+    }
+    free_frame *f = free_frames[c];
+    if (f)
+    {
+        free_frames[c] = f->next;
+        return f;
+    }
+    return ::operator new(c * FRAME_ALIGN);
+}
+
+void coro_frame_free(void *p, size_t size)
+{
+    size_t c = (size + FRAME_ALIGN - 1) / FRAME_ALIGN;
+    if (c >= FRAME_CLASSES)
+    {
+        ::operator delete(p);
+        return;
+    }
+    free_frame *f = (free_frame *)p;
+    f->next = free_frames[c];
+    free_frames[c] = f;
+}
+
+uint64_t deadline_queue::now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool later(const deadline_queue::timer &a, const deadline_queue::timer &b)
+{
+    return a.deadline > b.deadline;
+}
+
+void deadline_queue::push(uint64_t deadline, int fd, uint32_t conn)
+{
+    timer t = {deadline, fd, conn};
+    m_heap.push_back(t);
+    std::push_heap(m_heap.begin(), m_heap.end(), later);
+}
+
+int deadline_queue::next_timeout(uint64_t now) const
+{
+    if (m_heap.empty())
+    {
+        return -1;
+    }
+    uint64_t d = m_heap.front().deadline;
+    return d > now ? (int)(d - now) : 0;
+}
+
+bool deadline_queue::pop_expired(uint64_t now, timer &t)
+{
+    if (m_heap.empty() || m_heap.front().deadline > now)
+    {
+        return false;
+    }
+    std::pop_heap(m_heap.begin(), m_heap.end(), later);
+    t = m_heap.back();
+    m_heap.pop_back();
+    return true;
+}
+
+int http_conn::m_idle_timeout = 0;
+deadline_queue http_conn::m_deadlines;
+
+void http_conn::start()
+{
+    m_timer_queued = false;
+    m_deadline = 0;
+    m_coro = serve().handle;
+    resume(EPOLLIN);
+}
+
+void http_conn::resume(int events)
+{
+    m_events = events;
+    // 协程里可能关闭连接(比如HTTP/2会话结束), 恢复期间先取下句柄, close_conn就不会销毁正在运行的协程
+    std::coroutine_handle<conn_task::promise_type> h = m_coro;
+    m_coro = nullptr;
+    h.resume();
+    if (!h.done())
+    {
+        m_coro = h;
+        return;
+    }
+    bool keep = h.promise().keep;
+    h.destroy();
+    if (!keep)
+    {
+        close_conn();
+    }
+}
+
+void http_conn::wait(int ev)
+{
+    if (ev)
+    {
+        rearm(ev);
+    }
+    if (m_idle_timeout <= 0)
+    {
+        m_deadline = 0;
+        return;
+    }
+    m_deadline = deadline_queue::now_ms() + (uint64_t)m_idle_timeout * 1000;
+    if (!m_timer_queued)
+    {
+        m_timer_queued = true;
+        m_deadlines.push(m_deadline, m_sockfd, m_conn_id);
+    }
+}
+
+int http_conn::next_timeout()
+{
+    return m_deadlines.empty() ? -1 : m_deadlines.next_timeout(deadline_queue::now_ms());
+}
+
+void http_conn::expire_waits(http_conn *users)
+{
+    if (m_deadlines.empty())
+    {
+        return;
+    }
+    uint64_t now = deadline_queue::now_ms();
+    deadline_queue::timer t;
+    while (m_deadlines.pop_expired(now, t))
+    {
+        http_conn &conn = users[t.fd];
+        // 连接已经关闭(fd可能被新连接复用), 或者已经交给状态机
+        if (!conn.m_coro || conn.m_conn_id != t.conn)
+        {
+            continue;
+        }
+        conn.m_timer_queued = false;
+        // 预取线程还在读这个连接的映射, 恢复之后下一次等待重新计时
+        if (m_idle_timeout <= 0 || conn.m_deadline == 0 || conn.m_prefetching)
+        {
+            continue;
+        }
+        // 入堆之后又开始过新的等待
+        if (conn.m_deadline > now)
+        {
+            conn.m_timer_queued = true;
+            m_deadlines.push(conn.m_deadline, t.fd, t.conn);
+            continue;
+        }
+        conn.resume(0);
+    }
+}
+
+// 一个明文HTTP/1.1连接从头到尾的处理, 和 read -> process -> write 状态机做的事情一样, 只是写成了顺序的代码
+// 返回false时由resume关闭连接; 返回前总是已经解除了文件映射
+conn_task http_conn::serve()
+{
+    while (co_await io(EPOLLIN) && read())
+    {
+        // 收到了h2c序言, 之后交给HTTP/2的状态机
+        if (m_h2)
+        {
+            process_h2();
+            co_return true;
+        }
+        // 序言还没收全时先不按HTTP/1.1解析
+        if (m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == 0 && m_read_idx < h2_session::PREFACE_LEN
+            && memcmp(m_read_buf, h2_session::PREFACE, m_read_idx) == 0)
+        {
+            continue;
+        }
+
+        HTTP_CODE ret;
+        if (over_limit())
+        {
+            m_linger = false;
+            ret = TOO_MANY_REQUESTS;
+        }
+        else
+        {
+            ret = process_read();
+            WS_PROBE2(process_read, m_sockfd, ret);
+            if (ret == NO_REQUEST)
+            {
+                continue;
+            }
+            trace(TRACE_PARSED);
+            if (m_upgrade_h2c && m_method == GET && m_content_length == 0 && !m_chunked && upgrade_h2c(ret))
+            {
+                co_return true;
+            }
+        }
+
+        bool ok = process_write(ret);
+        WS_PROBE3(process_write, m_sockfd, ret, ok ? bytes_to_send : -1);
+        if (!ok)
+        {
+            break;
+        }
+        m_requests.fetch_add(1, std::memory_order_relaxed);
+        trace(TRACE_READY);
+        trace(TRACE_FIRST_WRITE);
+
+        // 发送: socket写满就挂起等EPOLLOUT; 分块响应和代理响应一段发完再要下一段
+        while (ok)
+        {
+            if (bytes_to_send > 0)
+            {
+                // 冷文件: 挂起到预取完成, 由prefetched恢复
+                if (!body_resident())
+                {
+                    co_await io(0);
+                    continue;
+                }
+                int n = send_iv();
+                if (n >= 0)
+                {
+                    advance(n);
+                }
+                else if (errno != EAGAIN || !co_await io(EPOLLOUT))
+                {
+                    ok = false;
+                }
+            }
+            else if (m_stream && !m_stream->finished())
+            {
+                ok = next_chunk();
+            }
+            else if (m_proxy && !m_proxy->finished())
+            {
+                // 0: next_proxy已经注册了客户端的EPOLLOUT或者上游socket, 只需挂起
+                int r = next_proxy();
+                if (r < 0 || (r == 0 && !co_await io(0)))
+                {
+                    ok = false;
+                }
+                else if (r > 0 && bytes_to_send == 0)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                break;
+            }
+        }
+        if (!ok)
+        {
+            break;
+        }
+        request_done();
+        unmap();
+        // WebSocket握手完成, 之后交给ws_session的状态机
+        if (m_ws_handler)
+        {
+            start_ws();
+            co_return true;
+        }
+        // 事件流: 订阅之后由发布者唤醒, 在write()里发送
+        if (m_sse_channel)
+        {
+            co_return start_sse();
+        }
+        if (!m_linger)
+        {
+            break;
+        }
+        init();
+    }
+    unmap();
+    co_return false;
+}
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "headers/file_cache.h"
+#include "headers/asset_pack.h"
+
+file_cache content_cache;
+
+void file_cache::sketch::resize(size_t width)
+{
+    size_t w = 64;
+    while (w < width)
+    {
+        w <<= 1;
+    }
+    counters.assign(w * 4, 0);
+    mask = w - 1;
+    additions = 0;
+}
+
+// 4行各取哈希的一种混合
+static inline uint32_t sketch_index(uint64_t hash, int row, uint32_t mask)
+{
+    return (uint32_t)(((hash + row) * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+}
+
+void file_cache::sketch::add(uint64_t hash)
+{
+    if (counters.empty())
+    {
+        return;
+    }
+    for (int row = 0; row < 4; ++row)
+    {
+        uint8_t &c = counters[row * (mask + 1) + sketch_index(hash, row, mask)];
+        if (c < 15)
+        {
+            ++c;
+        }
+    }
+    if (++additions >= (mask + 1) * 10)
+    {
+        for (size_t i = 0; i < counters.size(); ++i)
+        {
+            counters[i] >>= 1;
+        }
+        additions /= 2;
+    }
+}
+
+int file_cache::sketch::estimate(uint64_t hash) const
+{
+    if (counters.empty())
+    {
+        return 0;
+    }
+    int m = 15;
+    for (int row = 0; row < 4; ++row)
+    {
+        int c = counters[row * (mask + 1) + sketch_index(hash, row, mask)];
+        m = c < m ? c : m;
+    }
+    return m;
+}
+
+file_cache::file_cache()
+    : m_budget(0), m_hits(0), m_misses(0), m_inserts(0), m_rejects(0), m_evictions(0), m_bytes(0)
+{
+}
+
+file_cache::~file_cache()
+{
+    configure(0);
+}
+
+// 每个分片的窗口区和主区的大小, 以及能缓存的最大文件
+static inline size_t window_limit(size_t limit)
+{
+    return limit / 100;
+}
+
+static inline size_t max_object(size_t limit)
+{
+    return limit / 4;
+}
+
+void file_cache::configure(size_t budget)
+{
+    m_budget.store(budget, std::memory_order_relaxed);
+    size_t limit = budget / SHARDS;
+    for (int i = 0; i < SHARDS; ++i)
+    {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        trim(s, limit);
+        // 按平均8K一个文件估计条目数, 计数器的宽度取它的两倍
+        size_t width = limit / 4096;
+        if (limit == 0)
+        {
+            s.freq.counters.clear();
+        }
+        else if (s.freq.counters.empty() || width > (s.freq.mask + 1) * 2 || width * 2 < s.freq.mask + 1)
+        {
+            s.freq.resize(width);
+        }
+        s.lock.unlock();
+    }
+}
+
+void file_cache::move_to(shard &s, entry *e, SEGMENT seg)
+{
+    s.lists[e->segment].erase(e->pos);
+    s.bytes[e->segment] -= e->size;
+    e->segment = seg;
+    s.lists[seg].push_front(e);
+    e->pos = s.lists[seg].begin();
+    s.bytes[seg] += e->size;
+}
+
+void file_cache::remove(shard &s, entry *e, bool evicted)
+{
+    s.lists[e->segment].erase(e->pos);
+    s.bytes[e->segment] -= e->size;
+    s.map.erase(e->path);
+    m_bytes.fetch_sub(e->size, std::memory_order_relaxed);
+    if (evicted)
+    {
+        m_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    delete e;
+}
+
+// e已经在某个链表里(窗口区或者刚放进试用区): 主区放不下时和试用区最旧的文件比较频率, 输的一方被淘汰
+void file_cache::admit(shard &s, entry *e, size_t limit)
+{
+    size_t main_limit = limit - window_limit(limit);
+    move_to(s, e, PROBATION);
+    while (s.bytes[PROBATION] + s.bytes[PROTECTED] > main_limit)
+    {
+        // e在试用区的头部, 试用区只剩它时从保护区里找
+        entry *victim = s.lists[PROBATION].back();
+        if (victim == e)
+        {
+            victim = s.lists[PROTECTED].empty() ? NULL : s.lists[PROTECTED].back();
+        }
+        if (!victim)
+        {
+            break;
+        }
+        if (s.freq.estimate(e->hash) > s.freq.estimate(victim->hash))
+        {
+            remove(s, victim, true);
+        }
+        else
+        {
+            m_rejects.fetch_add(1, std::memory_order_relaxed);
+            remove(s, e, false);
+            return;
+        }
+    }
+}
+
+// 把分片缩小到limit以内, limit为0时清空
+void file_cache::trim(shard &s, size_t limit)
+{
+    size_t window = window_limit(limit);
+    while (s.bytes[WINDOW] > window)
+    {
+        remove(s, s.lists[WINDOW].back(), true);
+    }
+    while (s.bytes[PROBATION] + s.bytes[PROTECTED] > limit - window)
+    {
+        SEGMENT seg = s.lists[PROBATION].empty() ? PROTECTED : PROBATION;
+        remove(s, s.lists[seg].back(), true);
+    }
+}
+
+std::shared_ptr<const cached_body> file_cache::lookup(const char *path, const struct stat &st)
+{
+    size_t limit = m_budget.load(std::memory_order_relaxed) / SHARDS;
+    uint64_t hash = pack_hash(path, strlen(path));
+    shard &s = shard_for(hash);
+    std::shared_ptr<const cached_body> body;
+    s.lock.lock();
+    s.freq.add(hash);
+    std::unordered_map<std::string, entry *>::iterator it = s.map.find(path);
+    if (it != s.map.end())
+    {
+        entry *e = it->second;
+        if (e->dev != st.st_dev || e->ino != st.st_ino || e->size != (size_t)st.st_size || e->mtime.tv_sec != st.st_mtim.tv_sec
+            || e->mtime.tv_nsec != st.st_mtim.tv_nsec)
+        {
+            // 文件被修改过
+            remove(s, e, false);
+        }
+        else
+        {
+            body = e->body;
+            if (e->segment == PROBATION)
+            {
+                // 再次访问, 升进保护区; 保护区超出80%时最旧的降回试用区
+                move_to(s, e, PROTECTED);
+                size_t protected_limit = (limit - window_limit(limit)) / 5 * 4;
+                while (s.bytes[PROTECTED] > protected_limit && s.lists[PROTECTED].back() != e)
+                {
+                    move_to(s, s.lists[PROTECTED].back(), PROBATION);
+                }
+            }
+            else
+            {
+                move_to(s, e, e->segment);
+            }
+        }
+    }
+    s.lock.unlock();
+    (body ? m_hits : m_misses).fetch_add(1, std::memory_order_relaxed);
+    return body;
+}
+
+bool file_cache::worth_loading(const char *path, size_t size)
+{
+    size_t limit = m_budget.load(std::memory_order_relaxed) / SHARDS;
+    if (size == 0 || size > max_object(limit))
+    {
+        return false;
+    }
+    if (size <= window_limit(limit))
+    {
+        return true;
+    }
+    // 直接进主区的文件要先看频率, 不值得的就不读了
+    uint64_t hash = pack_hash(path, strlen(path));
+    shard &s = shard_for(hash);
+    s.lock.lock();
+    bool worth = s.bytes[PROBATION] + s.bytes[PROTECTED] + size <= limit - window_limit(limit)
+                 || (!s.lists[PROBATION].empty()
+                     && s.freq.estimate(hash) > s.freq.estimate(s.lists[PROBATION].back()->hash));
+    s.lock.unlock();
+    if (!worth)
+    {
+        m_rejects.fetch_add(1, std::memory_order_relaxed);
+    }
+    return worth;
+}
+
+std::shared_ptr<const cached_body> file_cache::load(int fd, const char *path, const struct stat &st)
+{
+    std::shared_ptr<cached_body> body = std::make_shared<cached_body>();
+    body->size = st.st_size;
+    body->data = new char[body->size];
+    size_t done = 0;
+    while (done < body->size)
+    {
+        ssize_t n = pread(fd, body->data + done, body->size - done, done);
+        if (n <= 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    if (done != body->size)
+    {
+        // 读的时候文件被截短了
+        return std::shared_ptr<const cached_body>();
+    }
+
+    size_t limit = m_budget.load(std::memory_order_relaxed) / SHARDS;
+    uint64_t hash = pack_hash(path, strlen(path));
+    shard &s = shard_for(hash);
+    s.lock.lock();
+    if (limit == 0)
+    {
+        s.lock.unlock();
+        return body;
+    }
+    // 别的线程同时读了同一个文件, 用新读到的替换
+    std::unordered_map<std::string, entry *>::iterator it = s.map.find(path);
+    if (it != s.map.end())
+    {
+        remove(s, it->second, false);
+    }
+    entry *e = new entry;
+    e->path = path;
+    e->hash = hash;
+    e->body = body;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+    e->segment = WINDOW;
+    s.lists[WINDOW].push_front(e);
+    e->pos = s.lists[WINDOW].begin();
+    s.bytes[WINDOW] += e->size;
+    s.map[e->path] = e;
+    m_bytes.fetch_add(e->size, std::memory_order_relaxed);
+    m_inserts.fetch_add(1, std::memory_order_relaxed);
+    // 窗口区满了, 最旧的去主区参加准入; 比窗口区大的文件自己直接去
+    if (e->size > window_limit(limit))
+    {
+        admit(s, e, limit);
+    }
+    while (s.bytes[WINDOW] > window_limit(limit))
+    {
+        admit(s, s.lists[WINDOW].back(), limit);
+    }
+    s.lock.unlock();
+    return body;
+}
+
+std::string file_cache::stats() const
+{
+    uint64_t hits = m_hits.load(std::memory_order_relaxed);
+    uint64_t misses = m_misses.load(std::memory_order_relaxed);
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "cache: hits=%llu misses=%llu hit_ratio=%.3f inserts=%llu rejects=%llu evictions=%llu bytes=%llu budget=%llu\n",
+             (unsigned long long)hits, (unsigned long long)misses, hits + misses ? (double)hits / (hits + misses) : 0.0,
+             (unsigned long long)m_inserts.load(std::memory_order_relaxed),
+             (unsigned long long)m_rejects.load(std::memory_order_relaxed),
+             (unsigned long long)m_evictions.load(std::memory_order_relaxed),
+             (unsigned long long)m_bytes.load(std::memory_order_relaxed),
+             (unsigned long long)m_budget.load(std::memory_order_relaxed));
+    return buf;
+}
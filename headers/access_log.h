@@ -0,0 +1,95 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <atomic>
+#include "locker.h"
+
+// 二进制访问日志: 每个请求一条32字节的定长记录, 离线用 build/logdecode 转成文本或CSV
+//
+// 每个线程写自己的段文件 <目录>/access-<pid>-<线程>-<序号>.log, 文件先扩到段大小再mmap, 追加一条只是一次memcpy;
+// 写满后截掉没用的部分换下一个文件. 进程退出或者段没写满时文件尾部是0, 解码时遇到时间戳为0的记录就停
+// 时间戳是周期计数, 段文件头里有换算成墙上时间需要的起点和频率. 路径只记FNV-1a哈希, 解码时用 -r 指定网站目录还原
+// HTTP/2的请求不记录
+
+static const char ACCESS_LOG_MAGIC[8] = {'W', 'S', 'L', 'O', 'G', 'v', '1', '\n'};
+
+struct access_log_header
+{
+    char magic[8];
+    uint64_t start_tsc;         // 打开这个段时的周期计数
+    uint64_t start_us;          // 同一时刻的墙上时间, 微秒
+    double ticks_per_us;        // 周期计数的频率
+    uint32_t record_size;       // sizeof(access_record)
+    uint32_t pid;
+    uint32_t thread;
+    uint32_t seq;               // 这个线程的第几个段
+    uint8_t reserved[16];
+};
+
+enum ACCESS_FLAGS
+{
+    ACCESS_KEEP_ALIVE = 1,
+    ACCESS_TLS = 2,
+    ACCESS_GZIP = 4,            // 发送的是gzip版本
+    ACCESS_UNIX = 8,            // 来自unix socket, ip记为127.0.0.1
+};
+
+struct access_record
+{
+    uint64_t tsc;               // 响应写完时的周期计数, 0表示段的结尾
+    uint32_t ip;                // 客户端IPv4, 网络字节序
+    uint32_t path_hash;         // access_path_hash(url中'?'之前的部分), 请求没有解析出url时为0
+    uint32_t bytes;             // 发送的字节数
+    uint32_t latency_us;        // 从读到请求的第一批字节到响应写完
+    uint16_t status;            // HTTP状态码
+    uint8_t method;             // http_conn::METHOD
+    uint8_t flags;              // ACCESS_FLAGS
+    uint32_t conn;              // 连接的序号
+};
+
+// FNV-1a, 服务器和解码工具共用
+inline uint32_t access_path_hash(const char *path, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return h;
+}
+
+class access_logger
+{
+public:
+    access_logger();
+    // 开始写到dir下(目录要已经存在), dir为空时停止; 各线程在下一次记录时换到新的段
+    void configure(const std::string &dir, int segment_mb);
+    bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+    // 写一条记录, path_hash由path算出, latency_us由start_tsc到r.tsc算出
+    // 停止之后各线程在下一次调用时才关闭自己的段, 所以不管是否启用都要调用
+    void append(access_record &r, const char *path, uint64_t start_tsc);
+    void print_stats() const;
+
+private:
+    struct segment;
+    static thread_local segment *m_local;   // 当前线程正在写的段
+    bool open_segment(segment &seg);
+    void close_segment(segment &seg);
+
+    locker m_lock;                          // 保护下面两项, 只在换段时加锁
+    std::string m_dir;
+    size_t m_segment_size;
+    std::atomic<uint32_t> m_generation;     // 每次configure加一, 线程据此发现配置变了
+    std::atomic<bool> m_enabled;
+    std::atomic<uint32_t> m_threads;        // 给线程编号
+    std::atomic<uint64_t> m_segments;       // 统计: 打开过的段数
+    std::atomic<uint64_t> m_failures;       // 统计: 打开失败的次数
+};
+
+// 全局的访问日志, 按配置里的access_log打开
+extern access_logger access_log;
+
+#endif
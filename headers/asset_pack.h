@@ -0,0 +1,91 @@
+#ifndef ASSET_PACK_H
+#define ASSET_PACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+
+// 资源包: 离线把整个网站根目录打成一个文件(tools/mkpack.cpp), 服务器启动时mmap进来,
+// 之后静态文件请求只查内存里的哈希表, 不再stat/open/mmap
+//
+// 文件布局(小端):
+//   pack_header
+//   pack_entry[count]
+//   uint32_t slots[slot_count]     开放寻址的哈希表, 存entry下标+1, 0表示空
+//   字符串区                        路径和预先生成好的响应头
+//   文件内容                        每个都从页边界开始, 有gzip版本的紧跟在后面(同样页对齐)
+static const char PACK_MAGIC[8] = {'W', 'S', 'P', 'A', 'C', 'K', '\0', '\0'};
+static const uint32_t PACK_VERSION = 1;
+static const uint64_t PACK_ALIGN = 4096;
+
+struct pack_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t slot_count;            // 2的幂
+    uint32_t reserved;
+    uint64_t entries_off;
+    uint64_t slots_off;
+    uint64_t total_size;            // 整个文件的大小, 用来发现被截断的包
+};
+
+enum { PACK_DIR = 1 };              // 目录本身也有条目, 请求目录和文件系统模式一样回复400
+
+struct pack_entry
+{
+    uint64_t hash;                  // 路径的FNV-1a
+    uint64_t body_off;
+    uint64_t body_len;
+    uint64_t gzip_off;              // gzip版本, 没有时gzip_len为0
+    uint64_t gzip_len;
+    uint32_t path_off;
+    uint32_t path_len;
+    uint32_t headers_off;           // "Content-Length: ..\r\nContent-Type: ..\r\nETag: ..\r\n"
+    uint32_t headers_len;
+    uint32_t gzip_headers_off;      // gzip版本的头部, 多了Content-Encoding
+    uint32_t gzip_headers_len;
+    uint32_t etag_off;              // ETag的值(带引号), 用来比较If-None-Match和回复304
+    uint32_t etag_len;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+inline uint64_t pack_hash(const char *s, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h = (h ^ (uint8_t)s[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+class asset_pack
+{
+public:
+    // mmap并校验整个包, 格式不对返回空指针
+    static std::shared_ptr<asset_pack> open(const char *path);
+    ~asset_pack();
+
+    // 按路径查找, 没有时返回NULL
+    const pack_entry *find(const char *path, size_t len) const;
+    const char *at(uint64_t off) const { return m_base + off; }
+    uint32_t count() const { return m_header->count; }
+
+    // 当前使用的资源包. 替换是原子的, 正在发送旧包内容的连接各自持有旧包的引用, 发完才释放
+    static std::shared_ptr<asset_pack> current();
+    static void install(std::shared_ptr<asset_pack> pack);
+
+private:
+    asset_pack() : m_base(NULL), m_size(0), m_header(NULL) {}
+    bool validate() const;
+
+    char *m_base;
+    size_t m_size;
+    const pack_header *m_header;
+    const pack_entry *m_entries;
+    const uint32_t *m_slots;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <atomic>
+#include "locker.h"
+
+// 请求抓取: 把到达的请求记成紧凑的二进制记录, 离线用 test_presure/replay 按原来的时间间隔重放
+//
+// 文件格式(小端):
+//   capture_header
+//   capture_record + 路径 + If-None-Match 的值, 一个请求一条, 按到达顺序
+// 只记录请求头里影响服务器行为的部分, 请求体只记长度, 重放时用填充字节代替
+// HTTP/2的请求不记录
+
+static const char CAPTURE_MAGIC[8] = {'W', 'S', 'C', 'A', 'P', 'v', '1', '\n'};
+
+struct capture_header
+{
+    char magic[8];
+    uint64_t start_us;          // 开始抓取时的墙上时间, 微秒
+};
+
+enum CAPTURE_FLAGS
+{
+    CAPTURE_GZIP = 1,           // Accept-Encoding 里有 gzip
+    CAPTURE_KEEP_ALIVE = 2,     // Connection: keep-alive
+    CAPTURE_CHUNKED = 4,        // 请求体是分块编码的, 长度未知
+    CAPTURE_TLS = 8,            // 来自TLS端口
+};
+
+struct capture_record
+{
+    uint64_t time_us;           // 距离开始抓取的微秒数
+    uint32_t conn;              // 连接的序号, 同一个连接上的请求相同
+    uint32_t body_len;          // Content-Length, 超过4G的记为0xffffffff
+    uint8_t method;             // http_conn::METHOD
+    uint8_t flags;              // CAPTURE_FLAGS
+    uint16_t path_len;
+    uint16_t etag_len;
+    uint16_t reserved;
+};
+
+class traffic_capture
+{
+public:
+    traffic_capture();
+    ~traffic_capture();
+    // 开始写到path(覆盖原文件), path为空时停止抓取; 已经在写同一个文件时什么也不做
+    bool open(const std::string &path);
+    // 工作线程不加锁地先看一眼, 没在抓取时省掉拼记录; 真正写之前record()还会在锁里检查m_file
+    bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+    void record(uint32_t conn, int method, int flags, long long body_len,
+                const char *path, size_t path_len, const char *etag, size_t etag_len);
+    // 把缓冲的记录写到文件里, SIGUSR1和退出时调用
+    void flush();
+    // 和record()一样在锁里读统计
+    void print_stats();
+
+private:
+    void close_file();
+
+    locker m_lock;              // 保护m_file和统计, open()只在主线程调用
+    FILE *m_file;
+    std::atomic<bool> m_enabled; // m_file不为空, 给enabled()用
+    std::string m_path;
+    uint64_t m_start;           // 开始抓取时的单调时钟, 微秒
+    uint64_t m_records;
+    uint64_t m_dropped;         // 路径太长, 没有记录
+};
+
+// 全局的抓取器, 按配置里的capture打开
+extern traffic_capture capture;
+
+#endif
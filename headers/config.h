@@ -0,0 +1,56 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <memory>
+
+// 运行参数. 优先级: 默认值 < 配置文件(-f) < 命令行(-o key=value 以及 -p/-m/-r/-c 这些简写)
+//
+// 配置文件每行一个 "key = value", '#' 开始的是注释. 收到SIGHUP时重新读配置文件并再套一遍命令行,
+// 能在运行中修改的(线程数、队列长度、限流、backlog、事件数组、资源包、请求抓取、访问日志、文件缓存、空闲超时、事件流队列、管理路由)立即生效,
+// 其余的(doc_root、连接表大小、读写缓冲区、并发模型、预取线程数、unix socket)要重启, 重新加载时保持原值并打印提示
+struct server_config
+{
+    std::string doc_root;
+    int max_fd;             // 连接表的大小, fd不小于它的连接直接关闭
+    int max_events;         // 一次epoll_wait最多取回的事件数
+    int backlog;            // listen的backlog
+    int threads;            // 线程池的线程数
+    int max_requests;       // 线程池队列里最多等待的连接数
+    int read_buffer;        // 每个连接的读缓冲区, 也就是请求行加请求头的长度上限(带请求体时还要给请求体留512字节)
+    int write_buffer;       // 每个连接的写缓冲区, 放响应头
+    std::string model;      // reactor | rtc | single | coro
+    std::string pack;       // 资源包路径, 为空时从doc_root读文件
+    double rate;            // 每个客户端IP每秒的请求数, 0表示不限, 否则至少为1
+    double burst;           // 令牌桶容量, 0表示和rate相同
+    int conns;              // 每个客户端IP的并发连接数上限, 0表示不限
+    std::string capture;    // 把到达的请求记录到这个文件, 为空时不记录
+    std::string access_log; // 二进制访问日志的目录, 为空时不记录
+    int log_segment;        // 访问日志每个段文件的大小, MB
+    int cache_size;         // 文件内容缓存的大小, MB, 0表示不缓存
+    int idle_timeout;       // 协程模型下连接等待读写超过这么多秒就关闭, 0表示不限
+    int io_threads;         // 把冷文件预取进页缓存的线程数, 0表示不预取, 直接在writev里缺页
+    int sse_queue;          // 事件流每个订阅者最多排队的事件数
+    std::string sse_policy; // 订阅者的队列满了时: drop丢掉最旧的事件, disconnect断开
+    std::string unix_socket;    // 另外在这个unix socket上监听, '@'开头的是抽象地址, 为空时不监听
+    std::string admin_routes;   // /config这类管理路由对谁开放: off不开放, local只对回环地址和unix socket, all对所有客户端
+
+    server_config();
+
+    // 设置一项, 键或者值不合法时返回false并在err里说明
+    bool set(const std::string &key, const std::string &value, std::string &err);
+    // "key=value" 形式
+    bool set(const std::string &assignment, std::string &err);
+    // 读配置文件, 出错时err里是 "文件:行号: 原因"
+    bool load(const char *path, std::string &err);
+    // 每行一个 "key = value", 不能在运行中修改的键后面标上 (restart)
+    std::string dump() const;
+    // 把other里不能在运行中修改的键复制过来, 返回被保留的键名, 逗号分隔
+    std::string keep_restart_only(const server_config &other);
+};
+
+// 当前生效的配置, 供 GET /config 查看; 由main在启动和重新加载时安装
+std::shared_ptr<const server_config> current_config();
+void install_config(std::shared_ptr<const server_config> config);
+
+#endif
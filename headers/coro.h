@@ -0,0 +1,63 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+// 协程模型(-m coro)用到的几样东西: 协程帧的分配器、连接协程的返回类型、等待超时用的最小堆
+// 协程只在主线程里创建和恢复, 所以分配器和堆都不加锁
+
+// 协程帧从按大小分档的空闲链表里分配, 释放时挂回链表, 不还给malloc; 超过最大一档的直接用operator new
+void *coro_frame_alloc(size_t size);
+void coro_frame_free(void *p, size_t size);
+
+// 连接的协程: 创建后先挂起, 由http_conn::start第一次恢复; 结束时也挂起, 由恢复它的一方销毁
+// co_return true 表示连接交还给状态机继续处理(切换到HTTP/2), false 表示要关闭连接
+struct conn_task
+{
+    struct promise_type
+    {
+        bool keep = false;
+
+        conn_task get_return_object() { return conn_task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(bool k) { keep = k; }
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(size_t size) { return coro_frame_alloc(size); }
+        static void operator delete(void *p, size_t size) { coro_frame_free(p, size); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// 等待超时的连接, 按截止时间排成最小堆. 每个连接最多在堆里有一项:
+// 连接每次开始等待只更新自己的截止时间, 堆顶到期时再和连接现在的截止时间对一遍, 没到就按新的时间放回去
+class deadline_queue
+{
+public:
+    struct timer
+    {
+        uint64_t deadline;      // 毫秒, CLOCK_MONOTONIC
+        int fd;
+        uint32_t conn;          // 连接的序号, fd被新连接复用时据此认出过期的项
+    };
+
+    static uint64_t now_ms();
+
+    void push(uint64_t deadline, int fd, uint32_t conn);
+    // 距离最早的截止时间还有多少毫秒, 给epoll_wait用; 堆为空时返回-1
+    int next_timeout(uint64_t now) const;
+    // 取出一项已经到期的, 没有时返回false
+    bool pop_expired(uint64_t now, timer &t);
+    bool empty() const { return m_heap.empty(); }
+
+private:
+    std::vector<timer> m_heap;
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include "locker.h"
+
+// 文件内容缓存: 热门的小文件整个读进内存, 之后的请求不再open/mmap, 也不会在writev里缺页
+//
+// 按字节数限制大小, 分成SHARDS个分片, 每片一把锁. 每个分片是W-TinyLFU:
+//   窗口区(1%)     新文件先进这里, 按LRU淘汰
+//   主区(99%)      分成试用区和保护区(80%), 试用区的文件再被访问一次就升进保护区
+// 窗口区淘汰出来的文件要和试用区最旧的文件比较最近的访问频率(count-min sketch估计), 高的留下.
+// 只访问一次的大文件下载进不了主区, 挤不掉真正热门的文件; 比窗口区还大的文件不经过窗口区, 直接比较频率
+// 每次命中都要stat一次, 文件的设备号、inode、大小或者修改时间变了就丢掉旧内容重新读
+//
+// 缓存的内容用shared_ptr引用计数, 被淘汰时正在发送它的连接仍然持有引用, 发完才释放
+struct cached_body
+{
+    char *data;
+    size_t size;
+    ~cached_body() { delete[] data; }
+};
+
+class file_cache
+{
+public:
+    static const int SHARDS = 16;
+
+    file_cache();
+    ~file_cache();
+    // 总大小, 为0时关闭并清空; 缩小时立即淘汰到新的大小以内
+    void configure(size_t budget);
+    bool enabled() const { return m_budget.load(std::memory_order_relaxed) != 0; }
+
+    // 按相对于网站根目录的路径查找, st是刚stat到的状态; 同时记一次访问频率
+    std::shared_ptr<const cached_body> lookup(const char *path, const struct stat &st);
+    // 没命中时是否值得读进内存: 太大的文件, 或者比窗口区大而频率不够的文件直接mmap
+    bool worth_loading(const char *path, size_t size);
+    // 从已经打开的fd读出文件并交给准入策略; 读失败返回空指针, 没有被接纳时仍然返回读到的内容给这次请求用
+    std::shared_ptr<const cached_body> load(int fd, const char *path, const struct stat &st);
+
+    // "cache: ..." 一行统计, /status 和 SIGUSR1 用
+    std::string stats() const;
+
+private:
+    enum SEGMENT { WINDOW = 0, PROBATION, PROTECTED };
+
+    struct entry
+    {
+        std::string path;
+        uint64_t hash;
+        std::shared_ptr<const cached_body> body;
+        dev_t dev;
+        ino_t ino;
+        size_t size;
+        struct timespec mtime;
+        SEGMENT segment;
+        std::list<entry *>::iterator pos;
+    };
+
+    // count-min sketch: 4行4位计数器(这里用一个字节存一个), 加满 10*宽度 次后全部减半, 让频率反映最近的访问
+    struct sketch
+    {
+        std::vector<uint8_t> counters;
+        uint32_t mask;
+        uint32_t additions;
+        void resize(size_t width);
+        void add(uint64_t hash);
+        int estimate(uint64_t hash) const;
+    };
+
+    struct shard
+    {
+        locker lock;
+        std::unordered_map<std::string, entry *> map;
+        std::list<entry *> lists[3];        // 每个区一个LRU链表, 头部是最近用过的
+        size_t bytes[3];
+        sketch freq;
+        shard() { bytes[0] = bytes[1] = bytes[2] = 0; }
+    };
+
+    shard &shard_for(uint64_t hash) { return m_shards[hash % SHARDS]; }
+    // 下面几个函数都在持有分片锁时调用
+    void move_to(shard &s, entry *e, SEGMENT seg);
+    void remove(shard &s, entry *e, bool evicted);
+    void admit(shard &s, entry *e, size_t limit);
+    void trim(shard &s, size_t limit);
+
+    std::atomic<size_t> m_budget;           // 整个缓存的字节数, 每个分片 1/SHARDS
+    shard m_shards[SHARDS];
+
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<uint64_t> m_inserts;        // 进入缓存的文件数
+    std::atomic<uint64_t> m_rejects;        // 没有通过准入的文件数
+    std::atomic<uint64_t> m_evictions;      // 从主区淘汰的文件数
+    std::atomic<uint64_t> m_bytes;          // 当前缓存的字节数
+};
+
+// 全局的文件缓存, 大小由配置项cache_size决定
+extern file_cache content_cache;
+
+#endif
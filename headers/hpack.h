@@ -0,0 +1,53 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+// HTTP/2头部压缩(RFC 7541)
+// 解码需要完整支持静态表、动态表和Huffman; 编码只用静态表加不压缩的字面量, 不维护动态表
+
+struct hpack_header
+{
+    std::string name;
+    std::string value;
+};
+
+class hpack_decoder
+{
+public:
+    // 动态表的默认上限, 我们不通过SETTINGS_HEADER_TABLE_SIZE修改它
+    static const size_t DEFAULT_TABLE_SIZE = 4096;
+
+    hpack_decoder();
+
+    // 解码一个完整的头部块(HEADERS + 若干CONTINUATION拼起来的), 结果追加到headers
+    // 解出的头部按 name + value + 32 累计, 超过max_list_size时立即停下; 一个字节的索引可以引用一整条动态表条目,
+    // 只限制压缩后的大小挡不住放大
+    // 返回false表示压缩错误或超过上限, 连接必须以COMPRESSION_ERROR关闭
+    bool decode(const uint8_t *data, size_t len, std::vector<hpack_header> &headers, size_t max_list_size);
+
+private:
+    bool lookup(uint32_t index, hpack_header &h) const;
+    void insert(const hpack_header &h);
+    void evict(size_t max_size);
+
+private:
+    std::deque<hpack_header> m_dynamic;     // 动态表, 头部是最新插入的条目
+    size_t m_size;                          // 动态表当前大小, 每个条目按 name + value + 32 计算
+    size_t m_max_size;                      // 对端通过大小更新指令设置的上限
+};
+
+// 编码一个带N位前缀的整数, flags是首字节前缀以外的高位
+void hpack_encode_int(std::string &out, uint8_t flags, int prefix_bits, uint32_t value);
+
+// 静态表中完整匹配的条目, 例如 :status 200
+void hpack_encode_indexed(std::string &out, uint32_t index);
+
+// 不加入索引的字面量, 名字取静态表中的条目
+void hpack_encode_literal(std::string &out, uint32_t name_index, const char *value, size_t len);
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include "hpack.h"
+#include "rate_limit.h"
+
+// 一个流的响应体: file_address非空时是文件映射, 发完munmap; 来自资源包或者内容缓存时hold持有它们的引用, 发完释放
+struct stream_body
+{
+    const char *data;
+    size_t len;
+    char *file_address;
+    std::shared_ptr<const void> hold;
+};
+
+// HTTP/2 明文(h2c)会话, 挂在一个http_conn上
+// 连接的生命周期、epoll事件和读写依然由http_conn负责:
+//   主线程read()把收到的字节交给feed(), 工作线程process()调用on_input()解析帧并生成响应,
+//   主线程write()发送output(), 发空之后调用pump()按流量控制窗口继续生成DATA帧
+// 同一时刻只有一个线程在操作会话, 由EPOLLONESHOT保证
+class h2_session
+{
+public:
+    // 客户端连接序言 "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+    static const char PREFACE[];
+    static const int PREFACE_LEN = 24;
+
+    // 输入缓冲区的上限, 对端不按规矩读响应时用来限制内存
+    static const size_t INPUT_LIMIT = 256 * 1024;
+    // 一个头部块(HEADERS加上后面的CONTINUATION)的上限, 也作为SETTINGS_MAX_HEADER_LIST_SIZE通告给对端,
+    // 解码后的头部列表同样不能超过它
+    static const size_t MAX_HEADER_BLOCK = 64 * 1024;
+    // 输出缓冲区超过这个值就不再生成DATA帧, 等发送出去再说
+    static const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+
+    // limit_slot是连接在client_limiter里的槽位, 每个新的流取一个令牌
+    h2_session(int limit_slot = client_limiter::NO_SLOT);
+    ~h2_session();
+
+    // 带先验知识的h2c: 发送服务器SETTINGS, 等待客户端序言
+    void start();
+    // 流上能回复的结果: 文件和几种错误页面, 其余的(路由、代理、资源包等)升级时不切换, 按HTTP/1.1回复
+    static bool can_respond(int code);
+    // Upgrade: h2c: 先回101, 再发SETTINGS, 升级前的请求作为流1的请求
+    // settings是HTTP2-Settings头的内容(base64url编码的SETTINGS负载)
+    bool start_upgrade(const char *settings, int code, char *file_address, const struct stat &file_stat);
+
+    // 追加收到的字节, 超过INPUT_LIMIT返回false
+    bool feed(const char *data, int len);
+    // 解析已收到的完整帧并生成响应, 返回false表示连接出错(GOAWAY已经写入输出)
+    bool on_input();
+    // 在流量控制窗口允许的范围内轮流为各个流生成DATA帧
+    void pump();
+
+    const char *output() const { return m_out.data() + m_out_pos; }
+    size_t output_size() const { return m_out.size() - m_out_pos; }
+    void consume(size_t n);
+
+    // 所有流都已结束并且不再接受新的流, 发完已有输出后应该关闭连接
+    bool finished() const { return m_closing && m_streams.empty(); }
+
+private:
+    struct stream
+    {
+        uint32_t id;
+        int32_t send_window;    // 对端给这个流的发送窗口
+        const char *body;       // 响应体: mmap的文件或者静态的错误页面
+        size_t body_len;
+        size_t sent;
+        char *file_address;     // 非空时需要munmap
+        std::shared_ptr<const void> hold;   // 资源包或者缓存条目
+        bool queued;            // 是否在m_ready中
+    };
+
+    void write_frame_header(uint32_t len, uint8_t type, uint8_t flags, uint32_t stream_id);
+    void write_settings();
+    void write_window_update(uint32_t stream_id, uint32_t increment);
+    void write_rst_stream(uint32_t stream_id, uint32_t error);
+    void goaway(uint32_t error);
+
+    bool handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len);
+    bool handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len);
+    bool handle_settings(uint8_t flags, const uint8_t *payload, uint32_t len, bool from_frame);
+    bool handle_window_update(uint32_t stream_id, const uint8_t *payload, uint32_t len);
+    bool end_headers();
+
+    void respond(uint32_t stream_id, int code, const stream_body &body);
+    void close_stream(std::map<uint32_t, stream>::iterator it);
+    void queue_stream(stream &s);
+
+private:
+    hpack_decoder m_decoder;
+
+    std::string m_in;                   // 收到但还没解析的字节
+    std::string m_out;                  // 待发送的帧
+    size_t m_out_pos;                   // m_out中已经发送的位置
+
+    bool m_preface_pending;             // 还没收到客户端序言
+    bool m_closing;
+    int m_limit_slot;                   // 限流表里客户端IP的槽位, NO_SLOT表示不限
+    uint32_t m_last_stream_id;          // 收到的最大流ID, GOAWAY中回报
+
+    // 跨多个帧的头部块: HEADERS没有END_HEADERS时, 后面只能跟同一个流的CONTINUATION
+    uint32_t m_header_stream_id;
+    std::string m_header_block;
+
+    // 对端的设置
+    uint32_t m_peer_max_frame_size;
+    int32_t m_peer_initial_window;
+    int32_t m_conn_send_window;
+
+    std::map<uint32_t, stream> m_streams;   // 还有响应没发完的流
+    std::deque<uint32_t> m_ready;           // 有数据且窗口大于0的流, 轮转发送
+};
+
+#endif
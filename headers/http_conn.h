@@ -16,26 +16,45 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
-#include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "http_response.h"
+#include "http2.h"
+#include "tls_conn.h"
+#include "request_body.h"
+#include "response_stream.h"
+#include "router.h"
+#include "asset_pack.h"
+#include "proxy.h"
+#include "rate_limit.h"
+#include "ready_queue.h"
+#include "capture.h"
+#include "probes.h"
+#include "trace_ring.h"
+#include "access_log.h"
+#include "file_cache.h"
+#include "coro.h"
+#include "prefetch.h"
+#include "websocket.h"
+#include "sse.h"
+#include "threadpool.h"
 #include <sys/uio.h>
+#include <atomic>
 
 class http_conn
 {
 public:
-    static const int FILENAME_LEN = 200;        // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
+    static const int MAX_PATH_LEN = 1024;       // URL路径的最大长度, 更长的回复414
+    static const int MIN_BODY_ROOM = 512;       // 带请求体时请求头之后至少要留给请求体的读缓冲区, 不够回复431
     
-    // HTTP请求方法，这里只支持GET
+    // HTTP请求方法，这里支持GET, 以及带请求体的POST/PUT
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
     
     /*
         解析客户端请求时，主状态机的状态
         CHECK_STATE_REQUESTLINE:当前正在分析请求行
         CHECK_STATE_HEADER:当前正在分析头部字段
-        CHECK_STATE_CONTENT:当前正在解析请求体
+        CHECK_STATE_CONTENT:当前正在接收请求体, 按到达的片段交给消费者
     */
     enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
     
@@ -49,22 +68,81 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        BODY_REQUEST        :   请求体已经全部交给消费者, 响应体由消费者生成
+        STREAM_REQUEST      :   响应体由生成者边生成边发送(分块传输)
+        HANDLER_REQUEST     :   路由的处理函数生成了完整的响应体
+        METHOD_NOT_ALLOWED  :   路由或者静态文件不支持这个请求方法
+        PACK_REQUEST        :   在资源包里找到了文件
+        NOT_MODIFIED        :   资源包里的文件和If-None-Match一致, 回复304
+        PROXY_REQUEST       :   转发给上游, 响应头和响应体来自上游
+        BAD_GATEWAY         :   上游连不上或者响应不合法
+        TOO_MANY_REQUESTS   :   这个客户端IP的请求超过了速率限制
+        URI_TOO_LONG        :   请求的路径超过了MAX_PATH_LEN
+        HEADERS_TOO_LARGE   :   请求头占满了读缓冲区, 留给请求体的空间不到MIN_BODY_ROOM
+        WEBSOCKET_REQUEST   :   路由接受了WebSocket握手, 回101之后切换到ws_session
+        SSE_REQUEST         :   订阅了事件流, 响应头发完之后连接只发送频道里发布的事件
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, BODY_REQUEST, STREAM_REQUEST, HANDLER_REQUEST, METHOD_NOT_ALLOWED, PACK_REQUEST, NOT_MODIFIED, PROXY_REQUEST, BAD_GATEWAY, TOO_MANY_REQUESTS, URI_TOO_LONG, WEBSOCKET_REQUEST, SSE_REQUEST, HEADERS_TOO_LARGE };
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS { LINE_OK , LINE_BAD, LINE_OPEN };
+
+    // 并发模型, 启动时用 -m 选择
+    // MODEL_REACTOR: 主线程读写socket, 工作线程只解析请求和生成响应
+    // MODEL_RUN_TO_COMPLETION: 主线程只分发事件, 工作线程读、解析、写一次做完, 写不完才等EPOLLOUT由主线程接着写
+    // MODEL_SINGLE_THREAD: 不用线程池, 全部在主线程里做, 适合响应很小的场景; 代理会阻塞整个事件循环
+    // MODEL_COROUTINE: 也在主线程里, 每个明文HTTP/1.1连接是一个协程, 按 读->解析->写 顺序写成, 等待时挂起;
+    //                  TLS连接和切换到HTTP/2的连接仍然走单线程模型的状态机
+    enum MODEL { MODEL_REACTOR = 0, MODEL_RUN_TO_COMPLETION, MODEL_SINGLE_THREAD, MODEL_COROUTINE };
 public:
-    http_conn(){}
-    ~http_conn(){}
+    http_conn() : m_read_buf(NULL), m_write_buf(NULL) {}
+    ~http_conn() { if (m_coro) m_coro.destroy(); delete[] m_read_buf; delete[] m_write_buf; }
 public:
-    void init(int sockfd, const sockaddr_in& addr); // 初始化新接受的连接
+    // 初始化新接受的连接, tls表示来自TLS端口, limit_slot是client_limiter::acquire_conn给出的槽位,
+    // cred是unix socket上的连接的对端凭据(SO_PEERCRED), TCP连接为NULL
+    void init(int sockfd, const sockaddr_in& addr, bool tls = false, int limit_slot = client_limiter::NO_SLOT,
+              const ucred *cred = NULL);
     void close_conn();  // 关闭连接
-    void process(); // 处理客户端请求
+    void process(); // 处理客户端请求, 一次完成模式下先读socket
     bool read();// 非阻塞读
     bool write();// 非阻塞写
+    // 速率限制: 可以交给线程池时返回true; 否则已经准备好429响应并等待可写
+    bool admit_request();
+    // 主线程: 这个socket的EPOLLONESHOT事件已经触发, 当前没有注册任何事件
+    void fired() { m_armed = 0; }
+    // 事件流的发布者(任意线程, 持有订阅者的锁): 空闲的订阅者有了新事件, 注册EPOLLOUT
+    void sse_wake();
+    // 记下这个请求到达某个阶段的时间, 写完响应后整条记录放进当前线程的trace_ring
+    void trace( TRACE_STAGE stage ) { m_trace.tsc[stage] = trace_clock(); }
+
+    // 协程模型: init之后创建这个连接的协程; 之后它等待的事件(或超时)到来时由主线程恢复
+    void start();
+    bool has_coro() const { return (bool)m_coro; }
+    // events为0表示等待超时; 协程结束时由这里销毁, 需要时关闭连接
+    void resume( int events );
+    // 空闲超时: epoll_wait最多等多久(毫秒, -1不限), 以及恢复已经超时的连接
+    static int next_timeout();
+    static void expire_waits( http_conn* users );
+    // 主线程: 响应体的下一段已经预取进页缓存, 接着写
+    void prefetched();
+
+    // 打开网站根目录, 启动时调用一次
+    static bool open_root( const char* dir );
+    // 把url映射成doc_root下的文件并mmap
+    static HTTP_CODE map_file( const char* url, struct stat* st, char** address );
+    // HTTP/2的流: 和HTTP/1.1的GET一样按路由表、资源包、内容缓存、文件系统的顺序查找, 找到时返回FILE_REQUEST;
+    // 路径属于某个路由时返回HANDLER_REQUEST, 由HTTP/1.1处理
+    static HTTP_CODE find_body( const char* url, stream_body& body );
+    // 在根目录下打开url对应的文件, 不能离开根目录; 可以发送时返回FILE_REQUEST, fd交给调用者关闭
+    static HTTP_CODE open_file( const char* url, struct stat* st, int* fd );
 private:
+    static const char* relative_path( const char* url );
+    static HTTP_CODE map_fd( int fd, const struct stat& st, char** address );
+    // 静态文件: use_cache时先查内容缓存, 命中或者读进了缓存时cached非空, 否则映射在address
+    static HTTP_CODE lookup_file( const char* url, struct stat* st, char** address,
+                                  std::shared_ptr<const cached_body>& cached, bool use_cache );
+
     void init();    // 初始化连接
     HTTP_CODE process_read();    // 解析HTTP请求
     bool process_write( HTTP_CODE ret );    // 填充HTTP应答
@@ -72,32 +150,110 @@ private:
     // 下面这一组函数被process_read调用以分析HTTP请求
     HTTP_CODE parse_request_line( char* text );
     HTTP_CODE parse_headers( char* text );
-    HTTP_CODE parse_content( char* text );
+    HTTP_CODE parse_content();
+    HTTP_CODE route_request();
+    HTTP_CODE pack_request( size_t path_len );
     HTTP_CODE do_request();
     // 当前行的起始地址
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
     // 这一组函数被process_write调用以填充HTTP应答。
+    // 响应的固定部分在 http_response.h 里编译期拼好, 这里只做memcpy
     void unmap();
-    bool add_response( const char* format, ... );
-    bool add_content( const char* content );
-    bool add_content_type();
-    bool add_status_line( int status, const char* title );
+    bool add_bytes( const char* data, int len );
+    bool add_piece( const response_piece& p );
+    bool add_date();
     bool add_headers( int content_length );
-    bool add_content_length( int content_length );
-    bool add_linger();
-    bool add_blank_line();
+    bool add_error( const canned_error& e );
+    bool add_stream_headers();
+    // 分块响应: 下一块放进m_iv[1]
+    bool next_chunk();
+    // 代理响应: 下一段响应体放进m_iv[1]或者直接splice出去; 出错返回-1, 在等待上游或客户端返回0
+    int next_proxy();
+    // writev发出了n字节, 调整m_iv和计数
+    void advance( int n );
+    // 响应体来自文件映射、下一段又不在页缓存里时交给I/O线程预取并返回false, 预取完由prefetched接着写
+    bool body_resident();
+    // writev(m_iv), 响应体来自文件映射时最多发body_resident检查过的PREFETCH_WINDOW字节
+    int send_iv();
+    // 新请求的第一批数据要先取到令牌, 超过速率限制时返回true; HTTP/2的流在h2_session::end_headers里取
+    bool over_limit();
+    // 重新注册EPOLLONESHOT事件, 和当前注册的一样时跳过
+    void rearm( int ev );
+    // 响应全部写完: 把这个请求的时间戳交给当前线程的trace_ring, 写一条访问日志
+    void request_done();
+
+    // HTTP/2(h2c): 连接切换后读写都交给h2_session
+    bool upgrade_h2c( HTTP_CODE ret );
+    void process_h2();
+    bool read_h2();
+    bool write_h2();
+
+    // WebSocket: 101发完之后读写都交给ws_session
+    bool valid_ws_handshake() const;
+    void start_ws();
+    void process_ws();
+    bool read_ws();
+    bool write_ws();
+
+    // 事件流: 响应头发完之后订阅频道, 之后只从订阅者队列里writev
+    bool start_sse();
+    bool write_sse();
+
+    // TLS: 握手在工作线程中完成, 之后所有收发都经过下面两个函数
+    bool tls_handshake();
+    int sock_read( char* buf, int len );
+    int sock_writev( const struct iovec* iov, int iovcnt );
+
+    // 协程模型: co_await io(ev) 注册ev后挂起, 恢复时得到触发的事件, 超时得到0; ev为0时不注册(等上游或者已经注册过)
+    struct io_wait
+    {
+        http_conn* conn;
+        int ev;
+        bool await_ready() const { return false; }
+        void await_suspend( std::coroutine_handle<> ) { conn->wait( ev ); }
+        int await_resume() const { return conn->m_events; }
+    };
+    io_wait io( int ev ) { return io_wait{ this, ev }; }
+    void wait( int ev );
+    conn_task serve();
 
 public:
     static int m_epollfd;       // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-    static int m_user_count;    // 统计用户的数量
+    static int m_root_fd;       // 网站根目录(O_PATH)
+    static std::atomic<int> m_user_count;    // 统计用户的数量, 一次完成模式下工作线程也会关闭连接
+    static router* m_router;    // 动态内容的路由表, 启动时注册好, 之后只读
+    static MODEL m_model;       // 并发模型
+    static int m_read_buffer_size;              // 读缓冲区的大小, 启动时按配置设置
+    static int m_write_buffer_size;             // 写缓冲区的大小
+    static ready_queue<http_conn>* m_ready;     // 反应堆模式下交还主线程写的连接
+    static std::atomic<uint64_t> m_epoll_ctls;  // 统计: epoll_ctl次数
+    static std::atomic<uint64_t> m_requests;    // 统计: 生成的响应数
+    static std::atomic<uint32_t> m_conn_count;  // 已经接受的连接数, 用来给连接编号
+    static int m_idle_timeout;                  // 协程模型下等待读写的超时, 秒, 0表示不限
+    static threadpool<prefetch_request>* m_prefetch_pool;   // 预取冷文件的I/O线程, io_threads为0时为空
+    static ready_queue<http_conn>* m_prefetched;            // 预取完交还主线程的连接
+    static std::atomic<uint64_t> m_prefetches;  // 统计: 提交的预取次数
 
 private:
     int m_sockfd;           // 该HTTP连接的socket和对方的socket地址
     sockaddr_in m_address;
+    bool m_unix;                            // 来自unix socket, 对端是m_peer_cred
+    ucred m_peer_cred;
+    int m_limit_slot;                       // 限流表里这个客户端IP的槽位
+    int m_armed;                            // 当前注册的事件, 0表示已经触发过, 没有注册
+    uint32_t m_conn_id;                     // 连接的序号, 抓取的请求里用来区分连接
+    trace_record m_trace;                   // 当前请求各个阶段的时间戳
+    int m_status;                           // 响应的状态码, 写访问日志用
+
+    std::coroutine_handle<conn_task::promise_type> m_coro;  // 协程模型下这个连接的协程, 其余情况为空
+    int m_events;                           // 恢复协程时触发的事件
+    uint64_t m_deadline;                    // 当前等待的截止时间, 毫秒, 0表示不超时
+    bool m_timer_queued;                    // 在m_deadlines里已经有一项
+    static deadline_queue m_deadlines;
     
-    char m_read_buf[ READ_BUFFER_SIZE ];    // 读缓冲区
+    char* m_read_buf;                       // 读缓冲区, 这个槽位第一次有连接时分配
     int m_read_idx;                         // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
     int m_checked_idx;                      // 当前正在分析的字符在读缓冲区中的位置
     int m_start_line;                       // 当前正在解析的行的起始位置
@@ -105,23 +261,57 @@ private:
     CHECK_STATE m_check_state;              // 主状态机当前所处的状态
     METHOD m_method;                        // 请求方法
 
-    char m_real_file[ FILENAME_LEN ];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
     char* m_url;                            // 客户请求的目标文件的文件名
     char* m_version;                        // HTTP协议版本号，我们仅支持HTTP1.1
     char* m_host;                           // 主机名
-    int m_content_length;                   // HTTP请求的消息总长度
+    long long m_content_length;             // 请求体的长度(Content-Length)
+    bool m_chunked;                         // 请求体使用 Transfer-Encoding: chunked
+    long long m_body_left;                  // Content-Length请求体还没收到的字节数
+    chunked_decoder m_chunk_decoder;
+    body_consumer* m_consumer;              // 请求体的消费者, 没有请求体时为空
+
+    int m_headers_start;                    // 请求头在读缓冲区中的范围, 交给路由的处理函数
+    int m_headers_end;
+    HTTP_CODE m_route_ret;                  // 带请求体时, 读完请求体之后的响应
+    handler_response m_response;            // 处理函数的输出
+
+    bool m_accept_gzip;                     // Accept-Encoding里有gzip
+    char* m_if_none_match;                  // If-None-Match 头部的值
+    std::shared_ptr<asset_pack> m_pack;     // 响应发完之前持有资源包, 替换资源包不影响正在发送的连接
+    const pack_entry* m_pack_entry;
+    bool m_pack_gzip;                       // 发送gzip版本
     bool m_linger;                          // HTTP请求是否要求保持连接
 
-    char m_write_buf[ WRITE_BUFFER_SIZE ];  // 写缓冲区
+    char* m_write_buf;                      // 写缓冲区
     int m_write_idx;                        // 写缓冲区中待发送的字节数
     char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
+    std::shared_ptr<const cached_body> m_cached;    // 文件内容来自缓存时持有它, 发完才释放
     struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
     struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
     int m_iv_count;
+    const char* m_body;                     // m_iv[1]的起始地址: 文件映射或者当前的分块
+    bool m_body_mapped;                     // m_iv[1]在文件或者资源包的映射里, 发送前要看是否在页缓存里
+    bool m_prefetching;                     // 正在预取, 协程模型下这期间不算空闲超时
+    bool m_prefetch_done;                   // 刚预取过, 下一次发送不再检查(页又被换出也不再等)
+    prefetch_request m_prefetch;
+    chunked_writer* m_stream;               // 分块响应的发送缓冲区, 普通响应时为空
+    proxy_exchange* m_proxy;                // 反向代理的这次转发, 不是代理请求时为空
 
     int bytes_to_send;                       // 剩余的需要发送的字节数
     int bytes_have_send;                     // 当前已经发送的字节数
 
+    bool m_upgrade_h2c;                      // 请求带有 Upgrade: h2c
+    char* m_h2_settings;                     // HTTP2-Settings 头部的值
+    h2_session* m_h2;                        // 切换到HTTP/2之后的会话, HTTP/1.1时为空
+    bool m_upgrade_ws;                       // 请求带有 Upgrade: websocket
+    char* m_ws_key;                          // Sec-WebSocket-Key 头部的值
+    int m_ws_version;                        // Sec-WebSocket-Version 头部的值
+    ws_handler* m_ws_handler;                // 路由接受了握手, 101发完之前由连接持有
+    ws_session* m_ws;                        // 切换到WebSocket之后的会话
+    std::shared_ptr<sse_channel> m_sse_channel;  // 路由给出的频道, 响应头发完之后订阅
+    sse_subscriber* m_sse;                   // 订阅之后的发送队列
+    tls_conn* m_tls;                         // TLS连接的状态, 明文连接时为空
+
 };
 
 #endif
@@ -0,0 +1,219 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 响应报文的固定部分在编译期拼好, 运行时只需要memcpy进写缓冲区
+
+// 编译期字符串, N是不含结尾'\0'的长度
+template <size_t N>
+struct static_str
+{
+    static constexpr size_t size = N;
+    char data[N + 1];
+};
+
+// 字符串字面量 -> static_str
+template <size_t N>
+constexpr static_str<N - 1> make_str(const char (&s)[N])
+{
+    static_str<N - 1> r{};
+    for (size_t i = 0; i < N; ++i)
+    {
+        r.data[i] = s[i];
+    }
+    return r;
+}
+
+// 编译期拼接
+template <size_t A, size_t B>
+constexpr static_str<A + B> operator+(const static_str<A> &a, const static_str<B> &b)
+{
+    static_str<A + B> r{};
+    for (size_t i = 0; i < A; ++i)
+    {
+        r.data[i] = a.data[i];
+    }
+    for (size_t i = 0; i < B; ++i)
+    {
+        r.data[A + i] = b.data[i];
+    }
+    r.data[A + B] = '\0';
+    return r;
+}
+
+// 整数V的十进制位数
+constexpr size_t dec_len(size_t v)
+{
+    return v < 10 ? 1 : 1 + dec_len(v / 10);
+}
+
+// 编译期整数 -> 十进制字符串, 用于状态码和错误页面的Content-Length
+template <size_t V>
+constexpr static_str<dec_len(V)> make_dec()
+{
+    static_str<dec_len(V)> r{};
+    size_t v = V;
+    for (size_t i = dec_len(V); i > 0; --i)
+    {
+        r.data[i - 1] = '0' + v % 10;
+        v /= 10;
+    }
+    r.data[dec_len(V)] = '\0';
+    return r;
+}
+
+// 状态行 "HTTP/1.1 404 Not Found\r\n"
+template <size_t CODE, size_t N>
+constexpr auto status_line(const static_str<N> &title)
+{
+    return make_str("HTTP/1.1 ") + make_dec<CODE>() + make_str(" ") + title + make_str("\r\n");
+}
+
+// Content-Type及之后的头部, 按是否保持连接分成两份
+template <bool LINGER>
+constexpr auto headers_tail()
+{
+    if constexpr (LINGER)
+    {
+        return make_str("\r\nContent-Type:text/html\r\nConnection: keep-alive\r\n\r\n");
+    }
+    else
+    {
+        return make_str("\r\nContent-Type:text/html\r\nConnection: close\r\n\r\n");
+    }
+}
+
+// 错误响应在状态行和Date之后的全部内容: 头部 + 空行 + 消息体
+template <bool LINGER, size_t N>
+constexpr auto error_tail(const static_str<N> &form)
+{
+    return make_str("Content-Length: ") + make_dec<N>() + headers_tail<LINGER>() + form;
+}
+
+// 运行时使用的视图, 指向一段编译期拼好的字节
+struct response_piece
+{
+    const char *data;
+    int len;
+};
+
+template <size_t N>
+constexpr response_piece piece(const static_str<N> &s)
+{
+    return response_piece{s.data, (int)N};
+}
+
+// 一个完整的错误响应: 状态行, 然后是按m_linger选择的剩余部分
+struct canned_error
+{
+    response_piece status;
+    response_piece tail[2];     // tail[0]: Connection: close, tail[1]: Connection: keep-alive
+};
+
+// 定义HTTP响应的一些状态信息
+inline constexpr auto status_200 = status_line<200>(make_str("OK"));
+
+inline constexpr auto error_400_form = make_str("Your request has bad syntax or is inherently impossible to satisfy.\n");
+inline constexpr auto status_400 = status_line<400>(make_str("Bad Request"));
+inline constexpr auto error_400_close = error_tail<false>(error_400_form);
+inline constexpr auto error_400_keep = error_tail<true>(error_400_form);
+
+inline constexpr auto error_403_form = make_str("You do not have permission to get file from this server.\n");
+inline constexpr auto status_403 = status_line<403>(make_str("Forbidden"));
+inline constexpr auto error_403_close = error_tail<false>(error_403_form);
+inline constexpr auto error_403_keep = error_tail<true>(error_403_form);
+
+inline constexpr auto error_404_form = make_str("The requested file was not found on this server.\n");
+inline constexpr auto status_404 = status_line<404>(make_str("Not Found"));
+inline constexpr auto error_404_close = error_tail<false>(error_404_form);
+inline constexpr auto error_404_keep = error_tail<true>(error_404_form);
+
+inline constexpr auto error_405_form = make_str("The requested method is not allowed for this resource.\n");
+inline constexpr auto status_405 = status_line<405>(make_str("Method Not Allowed"));
+inline constexpr auto error_405_close = error_tail<false>(error_405_form);
+inline constexpr auto error_405_keep = error_tail<true>(error_405_form);
+
+inline constexpr auto error_414_form = make_str("The requested path is longer than the server will handle.\n");
+inline constexpr auto status_414 = status_line<414>(make_str("URI Too Long"));
+inline constexpr auto error_414_close = error_tail<false>(error_414_form);
+inline constexpr auto error_414_keep = error_tail<true>(error_414_form);
+
+inline constexpr auto error_429_form = make_str("Too many requests from your address, please slow down.\n");
+inline constexpr auto status_429 = status_line<429>(make_str("Too Many Requests"));
+inline constexpr auto error_429_close = error_tail<false>(error_429_form);
+inline constexpr auto error_429_keep = error_tail<true>(error_429_form);
+
+inline constexpr auto error_431_form = make_str("The request headers leave no room for the request body.\n");
+inline constexpr auto status_431 = status_line<431>(make_str("Request Header Fields Too Large"));
+inline constexpr auto error_431_close = error_tail<false>(error_431_form);
+inline constexpr auto error_431_keep = error_tail<true>(error_431_form);
+
+inline constexpr auto error_500_form = make_str("There was an unusual problem serving the requested file.\n");
+inline constexpr auto status_500 = status_line<500>(make_str("Internal Error"));
+inline constexpr auto error_500_close = error_tail<false>(error_500_form);
+inline constexpr auto error_500_keep = error_tail<true>(error_500_form);
+
+inline constexpr auto error_502_form = make_str("The upstream server did not return a valid response.\n");
+inline constexpr auto status_502 = status_line<502>(make_str("Bad Gateway"));
+inline constexpr auto error_502_close = error_tail<false>(error_502_form);
+inline constexpr auto error_502_keep = error_tail<true>(error_502_form);
+
+inline constexpr canned_error canned_400 = {piece(status_400), {piece(error_400_close), piece(error_400_keep)}};
+inline constexpr canned_error canned_403 = {piece(status_403), {piece(error_403_close), piece(error_403_keep)}};
+inline constexpr canned_error canned_404 = {piece(status_404), {piece(error_404_close), piece(error_404_keep)}};
+inline constexpr canned_error canned_405 = {piece(status_405), {piece(error_405_close), piece(error_405_keep)}};
+inline constexpr canned_error canned_414 = {piece(status_414), {piece(error_414_close), piece(error_414_keep)}};
+inline constexpr canned_error canned_429 = {piece(status_429), {piece(error_429_close), piece(error_429_keep)}};
+inline constexpr canned_error canned_431 = {piece(status_431), {piece(error_431_close), piece(error_431_keep)}};
+inline constexpr canned_error canned_500 = {piece(status_500), {piece(error_500_close), piece(error_500_keep)}};
+inline constexpr canned_error canned_502 = {piece(status_502), {piece(error_502_close), piece(error_502_keep)}};
+
+// 200响应里Content-Length之前和之后的部分
+inline constexpr auto content_length_prefix = make_str("Content-Length: ");
+inline constexpr auto ok_tail_close = headers_tail<false>();
+inline constexpr auto ok_tail_keep = headers_tail<true>();
+inline constexpr response_piece ok_headers_tail[2] = {piece(ok_tail_close), piece(ok_tail_keep)};
+
+// 分块传输的200响应: 没有Content-Length, 头部最后的空行在Trailer头(如果有)之后另外加
+template <bool LINGER>
+constexpr auto chunked_tail()
+{
+    if constexpr (LINGER)
+    {
+        return make_str("Transfer-Encoding: chunked\r\nContent-Type:text/html\r\nConnection: keep-alive\r\n");
+    }
+    else
+    {
+        return make_str("Transfer-Encoding: chunked\r\nContent-Type:text/html\r\nConnection: close\r\n");
+    }
+}
+inline constexpr auto chunked_tail_close = chunked_tail<false>();
+inline constexpr auto chunked_tail_keep = chunked_tail<true>();
+inline constexpr response_piece chunked_headers_tail[2] = {piece(chunked_tail_close), piece(chunked_tail_keep)};
+inline constexpr auto trailer_prefix = make_str("Trailer: ");
+inline constexpr auto crlf = make_str("\r\n");
+
+// 资源包模式: Content-Length等头部在打包时已经生成好, 运行时只补Connection和空行
+inline constexpr auto connection_close_tail = make_str("Connection: close\r\n\r\n");
+inline constexpr auto connection_keep_tail = make_str("Connection: keep-alive\r\n\r\n");
+inline constexpr response_piece connection_tail[2] = {piece(connection_close_tail), piece(connection_keep_tail)};
+inline constexpr auto status_304 = status_line<304>(make_str("Not Modified"));
+inline constexpr auto etag_prefix = make_str("ETag: ");
+
+// WebSocket握手: 状态行和固定的头部, 后面接Sec-WebSocket-Accept的值和ws_accept_tail
+inline constexpr auto status_101_ws = status_line<101>(make_str("Switching Protocols"))
+    + make_str("Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ");
+inline constexpr auto ws_accept_tail = make_str("\r\n\r\n");
+
+// 事件流: 没有Content-Length, 连接关闭时结束
+inline constexpr auto sse_headers = make_str("Content-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n");
+
+// 无符号整数转十进制, buf至少20字节, 返回写入的字节数(不写'\0')
+int u64_to_dec(uint64_t v, char *buf);
+
+// 当前线程缓存的 "Date: ...\r\n" 头, 每秒最多格式化一次
+response_piece date_header();
+
+#endif
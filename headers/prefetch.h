@@ -0,0 +1,27 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+
+// 冷文件的预取: 主线程writev一个不在页缓存里的文件映射时会在缺页里等磁盘, 整个事件循环跟着停住.
+// 发送前先用mincore看响应体接下来的一段是否都在页缓存里, 不在的话交给I/O线程池(配置项io_threads)读进来,
+// 读完经完成队列交还主线程再接着写. 一次最多检查和发送PREFETCH_WINDOW字节, writev不会碰到没检查过的页
+static const size_t PREFETCH_WINDOW = 1 << 20;
+
+class http_conn;
+
+// 一次预取, 嵌在http_conn里, 同一个连接同时只有一个
+// 预取期间连接没有注册任何事件, 不会被关闭, 映射一直有效
+struct prefetch_request
+{
+    http_conn *conn;
+    const char *addr;
+    size_t len;
+    // I/O线程: 把[addr, addr+len)读进页缓存, 然后把conn放进http_conn::m_prefetched
+    void process();
+};
+
+// [addr, addr+len)所在的页是否都在页缓存里; mincore失败时当作在, 由writev自己缺页
+bool pages_resident(const void *addr, size_t len);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT静态探针, provider是webserver. 探针处只是一条nop, 没有被跟踪时几乎没有开销;
+// 参数统一转成64位有符号整数, bpftrace里是arg0, arg1...
+// 各个阶段的耗时由跟踪脚本用相邻探针的时间差算出(见 tools/bpftrace/), 这里不取时间
+//
+//   bpftrace -l 'usdt:./build/release/app:*'     列出所有探针
+//
+// 有 <sys/sdt.h> 时直接用它; 没有时按同样的格式自己生成 .note.stapsdt, 只支持x86-64和aarch64,
+// 其他平台上探针为空. 定义 WS_NO_PROBES 可以完全去掉
+
+#if defined(WS_NO_PROBES)
+#define WS_PROBE1(name, a1)
+#define WS_PROBE2(name, a1, a2)
+#define WS_PROBE3(name, a1, a2, a3)
+
+#elif defined(__has_include) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define WS_PROBE1(name, a1) DTRACE_PROBE1(webserver, name, (long long)(a1))
+#define WS_PROBE2(name, a1, a2) DTRACE_PROBE2(webserver, name, (long long)(a1), (long long)(a2))
+#define WS_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(webserver, name, (long long)(a1), (long long)(a2), (long long)(a3))
+
+#elif defined(__x86_64__) || defined(__aarch64__)
+// 和sys/sdt.h一样的note: 探针地址, 基准地址(用来算预链接之后的偏移), 信号量(不用, 为0),
+// provider, 探针名, 参数格式 "-8@操作数"(8字节有符号, 操作数是寄存器/内存/立即数)
+#define WS_PROBE_ASM(name, args)                                                \
+    "990: nop\n"                                                                \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                               \
+    ".balign 4\n"                                                               \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                          \
+    "991: .asciz \"stapsdt\"\n"                                                 \
+    "992: .balign 4\n"                                                          \
+    "993: .8byte 990b\n"                                                        \
+    ".8byte _.stapsdt.base\n"                                                   \
+    ".8byte 0\n"                                                                \
+    ".asciz \"webserver\"\n"                                                    \
+    ".asciz \"" #name "\"\n"                                                    \
+    ".asciz \"" args "\"\n"                                                     \
+    "994: .balign 4\n"                                                          \
+    ".popsection\n"                                                             \
+    ".ifndef _.stapsdt.base\n"                                                  \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"     \
+    ".weak _.stapsdt.base\n"                                                    \
+    ".hidden _.stapsdt.base\n"                                                  \
+    "_.stapsdt.base: .space 1\n"                                                \
+    ".size _.stapsdt.base, 1\n"                                                 \
+    ".popsection\n"                                                             \
+    ".endif\n"
+
+#define WS_PROBE1(name, a1)                                                     \
+    __asm__ __volatile__(WS_PROBE_ASM(name, "-8@%0")                            \
+                         :: "nor"((long long)(a1)))
+#define WS_PROBE2(name, a1, a2)                                                 \
+    __asm__ __volatile__(WS_PROBE_ASM(name, "-8@%0 -8@%1")                      \
+                         :: "nor"((long long)(a1)), "nor"((long long)(a2)))
+#define WS_PROBE3(name, a1, a2, a3)                                             \
+    __asm__ __volatile__(WS_PROBE_ASM(name, "-8@%0 -8@%1 -8@%2")                \
+                         :: "nor"((long long)(a1)), "nor"((long long)(a2)), "nor"((long long)(a3)))
+
+#else
+#define WS_PROBE1(name, a1)
+#define WS_PROBE2(name, a1, a2)
+#define WS_PROBE3(name, a1, a2, a3)
+#endif
+
+#endif
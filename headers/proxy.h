@@ -0,0 +1,166 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+#include "locker.h"
+#include "request_body.h"
+
+class router;
+struct request_view;
+
+// 反向代理: 指定前缀的请求转发给上游的HTTP/1.1服务器
+//
+// 工作线程里: 从本线程的连接池取一个到上游的长连接, 发出请求(请求体由proxy_body边收边转发), 读回响应头
+// 主线程里: 响应体在http_conn::write里搬运, 明文连接并且长度确定时用splice经过管道直接从上游socket送到客户端socket,
+//           其余情况(TLS, 分块)读到用户态缓冲区再走普通的writev
+// 等待上游数据时上游socket也注册到同一个epoll里, data.fd是 客户端fd | UPSTREAM_EVENT
+
+static const int UPSTREAM_EVENT = 1 << 30;
+
+// 负载均衡方式
+enum BALANCE { BALANCE_ROUND_ROBIN = 0, BALANCE_LEAST_CONN };
+
+struct upstream_server
+{
+    sockaddr_in addr;
+    std::string name;                   // host:port
+    std::atomic<int> active;            // 正在进行的请求数, 最少连接用
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> connects;     // 新建的连接数, 和requests比较可以看出连接复用的情况
+    std::atomic<uint64_t> failures;
+};
+
+// 一个前缀对应的一组上游服务器
+class upstream_group
+{
+public:
+    upstream_group(const std::string &prefix, bool strip, BALANCE balance);
+    // "host:port", host只支持IPv4地址
+    bool add_server(const char *host_port);
+    // 按负载均衡方式选一台; 从start开始的第n次尝试, 用来在连接失败时换下一台
+    upstream_server *pick(unsigned attempt, unsigned &start);
+    const std::string &prefix() const { return m_prefix; }
+    bool strip() const { return m_strip; }
+    size_t size() const { return m_servers.size(); }
+    upstream_server *server(size_t i) const { return m_servers[i].get(); }
+
+private:
+    std::string m_prefix;
+    bool m_strip;                       // 转发时把前缀换成'/'
+    BALANCE m_balance;
+    std::vector<std::unique_ptr<upstream_server>> m_servers;
+    std::atomic<unsigned> m_next;
+};
+
+class upstream_pool;
+
+struct upstream_conn
+{
+    int fd;
+    upstream_server *server;
+    upstream_pool *pool;                // 取出它的连接池, 用完还回去
+};
+
+// 每个工作线程一个空闲连接池. 请求结束时主线程把连接还回来, 所以存取要加锁, 平时没有竞争
+class upstream_pool
+{
+public:
+    static const int MAX_IDLE = 64;
+
+    // 当前线程的连接池
+    static upstream_pool *local();
+    // 取一个到server的连接, 没有空闲的就新建; reused表示是不是复用的
+    upstream_conn *acquire(upstream_server *server, bool &reused);
+    // 还回连接, reusable为false时直接关闭
+    void release(upstream_conn *conn, bool reusable);
+
+private:
+    ~upstream_pool();
+    locker m_lock;
+    std::vector<upstream_conn *> m_idle;
+};
+
+// 一次转发
+class proxy_exchange
+{
+public:
+    enum PUMP { PUMP_DATA, PUMP_WAIT_CLIENT, PUMP_WAIT_UPSTREAM, PUMP_DONE, PUMP_ERROR };
+
+    explicit proxy_exchange(upstream_group *group);
+    ~proxy_exchange();
+
+    // 工作线程: 连接上游并发出请求头. 失败返回false, 连接回复502
+    bool begin(const request_view &req);
+    // 请求体的一段, 由proxy_body调用
+    bool send_body(const char *data, size_t len);
+    // 请求(包括请求体)发完之后读回响应头, 失败返回false
+    bool finish_request();
+
+    // 发给客户端的响应头, 客户端要求的keep_alive上游的响应长度不确定时会被关掉
+    const std::string &client_head(bool &keep_alive);
+
+    // 主线程: 下一段响应体放在data/len, 和分块响应一样由writev发出
+    PUMP next(const char *&data, int &len);
+    // 主线程: 明文连接用splice直接搬运, 返回PUMP_DATA表示不能用splice, 改用next
+    PUMP splice_to(int client_fd);
+    // 主线程: 上游暂时没有数据, 在epoll里等待上游socket, 可读时client_fd的连接继续发送
+    void wait_upstream(int epollfd, int client_fd);
+    bool finished() const { return m_state == DONE; }
+
+private:
+    enum BODY_MODE { BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_EOF };
+    enum STATE { SENDING, BODY, DONE, FAILED };
+    static const int BUFFER_SIZE = 16 * 1024;
+    static const int SPLICE_THRESHOLD = 64 * 1024;  // 剩下的响应体比这个短就不值得建管道了
+
+    bool connect_upstream();
+    bool send_all(const char *data, size_t len);
+    bool read_head();
+    bool parse_head(int head_len);
+    void release();
+
+    upstream_group *m_group;
+    upstream_conn *m_conn;
+    bool m_reused;
+    bool m_has_body;
+    bool m_chunked_request;             // 请求体要重新按分块编码发出
+    int m_epollfd;                      // 上游socket注册在epoll里时不为-1
+    std::string m_request;              // 请求头, 复用的连接已经失效时换一个连接重发
+    std::string m_head;                 // 改写后的响应头
+    bool m_upstream_keep;               // 上游允许复用这个连接
+    BODY_MODE m_mode;
+    long long m_left;                   // BODY_LENGTH时还没转发的字节数
+    chunked_decoder m_decoder;          // BODY_CHUNKED时只用来找到响应体的结尾, 数据原样转发
+    STATE m_state;
+    char *m_buf;
+    int m_buf_start;
+    int m_buf_len;
+    int m_pipe[2];
+    int m_pipe_len;
+};
+
+// 请求体的消费者: 收到多少就转发多少
+class proxy_body : public body_consumer
+{
+public:
+    explicit proxy_body(proxy_exchange *exchange) : m_exchange(exchange) {}
+    bool on_data(const char *data, size_t len) { return m_exchange->send_body(data, len); }
+    int on_end(char *out, int cap) { return 0; }
+
+private:
+    proxy_exchange *m_exchange;
+};
+
+// 命令行里的 "prefix=host:port,host:port", 解析出错返回false
+bool add_proxy(const char *spec, bool strip, BALANCE balance);
+// 把add_proxy加入的前缀注册成路由
+void register_proxy_routes(router &r);
+// SIGUSR1: 每台上游的请求数和新建连接数
+void print_proxy_stats();
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+#include <atomic>
+
+// 按客户端IP限制并发连接数和请求速率
+//
+// 状态放在固定大小的开放寻址表里, 每个IP一个16字节的槽: IP, 当前连接数, 令牌桶
+// 令牌桶的令牌数(千分之一个令牌为单位)和上次补充的时间(毫秒)打包在一个64位原子变量里, 一次CAS更新
+// 连接数为0并且很久没有请求的槽会被新的IP顶替, 不需要单独的清理线程
+// 连接建立时定位一次槽位, 之后每个请求只是对这个槽做一次CAS
+class client_limiter
+{
+public:
+    static const uint32_t SLOT_BITS = 16;
+    static const int MAX_PROBE = 8;             // 连续8个槽都被占用时放行, 不记录
+    static const uint64_t AGE_MS = 60 * 1000;   // 空闲超过这么久的槽可以被顶替
+
+    client_limiter();
+    // rate: 每秒补充的令牌数(四舍五入成整数, 小于1表示不限), burst: 桶的容量, max_conns: 并发连接数上限; 为0表示不限制
+    void configure(double rate, double burst, int max_conns);
+    bool enabled() const { return m_enabled; }
+
+    // accept之后调用: 返回这个IP的槽位, 之后交给release_conn和take_token;
+    // 连接数已经到上限返回LIMITED, 表满了或者没有启用返回NO_SLOT(都放行)
+    static const int NO_SLOT = -1;
+    static const int LIMITED = -2;
+    int acquire_conn(uint32_t ip);
+    void release_conn(int slot);
+    // 连接上开始一个新的请求时取一个令牌, 没有令牌返回false
+    bool take_token(int slot);
+
+    void print_stats() const;
+
+private:
+    struct slot
+    {
+        std::atomic<uint32_t> ip;               // 网络字节序, 0表示空槽
+        std::atomic<uint32_t> conns;
+        std::atomic<uint64_t> bucket;           // 高24位令牌数*1000, 低40位上次补充的时间
+    };
+    static const uint64_t TIME_MASK = (1ull << 40) - 1;
+
+    uint64_t now_ms() const;
+    uint64_t full_bucket(uint64_t now) const;
+
+    slot *m_slots;
+    bool m_enabled;
+    uint64_t m_rate;                            // 每毫秒补充的令牌数*1000, 也就是每秒的令牌数
+    uint64_t m_burst;                           // 桶容量*1000
+    uint32_t m_max_conns;
+    uint64_t m_epoch;                           // 时间从configure开始算
+
+    std::atomic<uint64_t> m_conn_rejects;
+    std::atomic<uint64_t> m_request_rejects;
+    std::atomic<uint64_t> m_table_full;
+};
+
+// 全局的限流器, main里按命令行配置
+extern client_limiter limiter;
+
+#endif
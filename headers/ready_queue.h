@@ -0,0 +1,81 @@
+#ifndef READY_QUEUE_H
+#define READY_QUEUE_H
+
+#include <vector>
+#include <atomic>
+#include <exception>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "locker.h"
+
+// 工作线程把生成好响应的连接交还给主线程的队列
+// 工作线程不再用EPOLL_CTL_MOD注册EPOLLOUT, 而是把连接放进队列, 主线程取出后直接写, 写不完才注册EPOLLOUT.
+// 只有队列由空变为非空时才写一次eventfd唤醒主线程, 多个工作线程同时完成时只唤醒一次
+template <typename T>
+class ready_queue
+{
+public:
+    ready_queue();
+    ~ready_queue();
+    // 注册到epoll里的eventfd
+    int fd() const { return m_eventfd; }
+    // 工作线程: 交还一个连接
+    void push(T *item);
+    // 主线程: eventfd可读时取走所有连接
+    void drain(std::vector<T *> &out);
+    uint64_t wakeups() const { return m_wakeups.load(std::memory_order_relaxed); }
+
+private:
+    int m_eventfd;
+    locker m_lock;
+    std::vector<T *> m_items;
+    std::atomic<uint64_t> m_wakeups;
+};
+
+template <typename T>
+ready_queue<T>::ready_queue() : m_wakeups(0)
+{
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventfd < 0)
+    {
+        throw std::exception();
+    }
+}
+
+template <typename T>
+ready_queue<T>::~ready_queue()
+{
+    close(m_eventfd);
+}
+
+template <typename T>
+void ready_queue<T>::push(T *item)
+{
+    m_lock.lock();
+    bool was_empty = m_items.empty();
+    m_items.push_back(item);
+    m_lock.unlock();
+    if (was_empty)
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(m_eventfd, &one, sizeof(one));
+        (void)ret;
+        m_wakeups.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+void ready_queue<T>::drain(std::vector<T *> &out)
+{
+    // 先清eventfd再取队列: 之后再放进来的连接一定会重新唤醒
+    uint64_t count;
+    ssize_t ret = read(m_eventfd, &count, sizeof(count));
+    (void)ret;
+    out.clear();
+    m_lock.lock();
+    m_items.swap(out);
+    m_lock.unlock();
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef REQUEST_BODY_H
+#define REQUEST_BODY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 请求体的消费者: 请求体按到达的片段依次交给它, 连接本身从不缓存整个请求体
+// 消费者在工作线程里同步执行, 处理不过来时连接不会继续从socket读取(读缓冲区满了就停),
+// 由TCP的接收窗口让客户端慢下来
+class body_consumer
+{
+public:
+    virtual ~body_consumer() {}
+    // 收到一段请求体, 返回false表示处理失败, 连接回复500
+    virtual bool on_data(const char *data, size_t len) = 0;
+    // 请求体结束, 把响应体写进out(最多cap字节), 返回长度, 小于0表示失败
+    virtual int on_end(char *out, int cap) = 0;
+};
+
+// 默认的消费者: 不保存数据, 只统计长度和FNV-1a校验值并在响应里返回, 用来测试上传
+class discard_consumer : public body_consumer
+{
+public:
+    discard_consumer() : m_bytes(0), m_hash(14695981039346656037ull) {}
+    bool on_data(const char *data, size_t len);
+    int on_end(char *out, int cap);
+
+private:
+    uint64_t m_bytes;
+    uint64_t m_hash;
+};
+
+// Transfer-Encoding: chunked 的增量解码器
+// 数据可以在任意位置被切断, 解出的数据直接交给消费者, 扩展和trailer被跳过
+class chunked_decoder
+{
+public:
+    enum RESULT { NEED_MORE = 0, DONE, BAD_CHUNK, CONSUMER_ERROR };
+
+    // trailer总长度的上限, 防止对端用无穷的trailer占着连接
+    static const size_t MAX_TRAILER = 8192;
+
+    chunked_decoder() { reset(); }
+    void reset();
+    // 解码data中的字节, consumed返回用掉的字节数; 返回DONE时consumed之后的字节属于下一个请求
+    RESULT feed(const char *data, size_t len, size_t &consumed, body_consumer *consumer);
+
+private:
+    enum STATE { SIZE, SIZE_EXT, SIZE_LF, DATA, DATA_CR, DATA_LF, TRAILER_START, TRAILER_LINE, TRAILER_LF, END_LF, FINISHED };
+
+    STATE m_state;
+    uint64_t m_chunk_left;      // 当前块还没收到的字节数
+    int m_size_digits;          // 块长度已经读到的十六进制位数
+    size_t m_trailer_bytes;     // 块扩展和trailer已经跳过的字节数
+};
+
+#endif
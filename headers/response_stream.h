@@ -0,0 +1,60 @@
+#ifndef RESPONSE_STREAM_H
+#define RESPONSE_STREAM_H
+
+#include <stdint.h>
+
+// 响应体的生成者: 内容边生成边发送, 长度事先不知道, 用 Transfer-Encoding: chunked 发出
+// 第一块在工作线程里生成, 之后每次socket可写、上一块发完时在主线程里生成下一块, 所以produce不能阻塞
+class body_producer
+{
+public:
+    virtual ~body_producer() {}
+    // 生成下一段响应体写进buf(最多cap字节), 返回长度; 返回0表示结束, 小于0表示出错(连接直接断开)
+    virtual int produce(char *buf, int cap) = 0;
+    // 响应头里预告的trailer名字, 逗号分隔; 没有trailer时返回NULL
+    virtual const char *trailer_names() const { return NULL; }
+    // 结束后的trailer, 每行 "Name: value\r\n", 写进buf(最多cap字节), 返回长度
+    virtual int trailers(char *buf, int cap) { return 0; }
+};
+
+// 分块编码的发送缓冲区, 一次只保存一块, 内存占用和响应长度无关
+class chunked_writer
+{
+public:
+    static const int BUFFER_SIZE = 16 * 1024;
+
+    explicit chunked_writer(body_producer *producer);
+    ~chunked_writer();
+
+    body_producer *producer() const { return m_producer; }
+    // 向生成者要下一块, 加上块头块尾; 生成者结束时生成最后的0长度块和trailer. 出错返回false
+    bool refill();
+    const char *data() const { return m_buf + m_start; }
+    int size() const { return m_len; }
+    // 最后一块已经生成, 发完就结束
+    bool finished() const { return m_finished; }
+
+private:
+    body_producer *m_producer;
+    char *m_buf;
+    int m_start;
+    int m_len;
+    bool m_finished;
+};
+
+// 生成指定长度的文本, trailer里带FNV-1a校验值, 用来测试和压测分块响应
+class pattern_producer : public body_producer
+{
+public:
+    explicit pattern_producer(uint64_t total) : m_total(total), m_sent(0), m_hash(14695981039346656037ull) {}
+    int produce(char *buf, int cap);
+    const char *trailer_names() const { return "X-Checksum"; }
+    int trailers(char *buf, int cap);
+
+private:
+    uint64_t m_total;
+    uint64_t m_sent;
+    uint64_t m_hash;
+};
+
+#endif
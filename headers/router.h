@@ -0,0 +1,121 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include "request_body.h"
+#include "response_stream.h"
+
+class proxy_exchange;
+class ws_handler;
+class sse_channel;
+
+// 路由按方法分派用的位掩码, 位号和http_conn::METHOD一致
+enum
+{
+    ROUTE_GET = 1 << 0,
+    ROUTE_POST = 1 << 1,
+    ROUTE_PUT = 1 << 3,
+};
+
+// 处理函数看到的请求. 指针都指向连接的读缓冲区, 不做拷贝, 在这次请求的响应发完之前有效
+struct request_view
+{
+    int method;                 // http_conn::METHOD
+    const char *path;           // 不含查询串, 不以'\0'结尾, 长度是path_len
+    size_t path_len;
+    const char *rest;           // 前缀路由时路径中前缀之后的部分, 精确路由时是空串
+    size_t rest_len;
+    const char *query;          // '?'之后的部分, 没有时为NULL
+    const char *host;           // 可能为NULL
+    const sockaddr_in *peer;    // 客户端地址, unix socket上的连接是127.0.0.1
+    const ucred *cred;          // unix socket上的连接: 对端进程的pid/uid/gid, TCP连接为NULL
+    long long content_length;
+    bool chunked;
+    bool keep_alive;
+
+    // 请求头区域: 解析时每行的\r\n被换成了\0\0
+    const char *headers;
+    const char *headers_end;
+    // 按名字(不区分大小写)查找请求头, 返回值的起始位置, 没有时返回NULL
+    const char *header(const char *name) const;
+};
+
+// 处理函数的输出, 三者选一: 固定的响应体, 分块生成的响应体, 或者接收请求体的消费者
+// 反向代理另外给出proxy, 响应原样来自上游, 这时consumer负责转发请求体
+// WebSocket路由给出websocket, 请求是合法的握手时连接回101并把之后的帧交给它, 否则回400
+// 事件流路由给出sse, 连接回复text/event-stream之后订阅这个频道(频道不归连接管)
+// stream, consumer, proxy和websocket由连接负责delete
+struct handler_response
+{
+    std::string body;
+    body_producer *stream;
+    body_consumer *consumer;    // 请求带请求体时有效, 请求体结束后由它生成响应体
+    proxy_exchange *proxy;
+    ws_handler *websocket;
+    std::shared_ptr<sse_channel> sse;
+};
+
+// 处理函数的结果, 出错时连接回复对应的错误页面
+enum ROUTE_RESULT { ROUTE_OK = 0, ROUTE_BAD_REQUEST, ROUTE_FORBIDDEN, ROUTE_NOT_FOUND, ROUTE_ERROR, ROUTE_BAD_GATEWAY };
+
+typedef ROUTE_RESULT (*route_handler)(const request_view &req, handler_response &resp);
+
+struct route
+{
+    route_handler handler;
+    unsigned methods;           // ROUTE_GET | ROUTE_POST ...
+    size_t prefix_len;          // 匹配到的路由本身的长度
+};
+
+// 路由表: 启动时注册精确路由和前缀路由, 然后compile()成扁平的字典树
+// 查找时沿着路径逐字节往下走, 精确匹配优先, 否则取最长的前缀路由
+// 大多数静态文件的路径在前一两个字节就走不下去了, 所以对静态文件几乎没有开销
+class router
+{
+public:
+    router();
+    // 注册必须在compile()之前, compile()之后只读, 多个线程可以同时查找
+    void add_exact(const char *path, unsigned methods, route_handler handler);
+    void add_prefix(const char *prefix, unsigned methods, route_handler handler);
+    void compile();
+
+    // 没有匹配的路由返回NULL
+    const route *match(const char *path, size_t len) const;
+
+private:
+    void add(const char *path, unsigned methods, route_handler handler, bool prefix);
+
+    // 注册阶段的节点
+    struct build_node
+    {
+        std::map<char, int> kids;
+        int exact;
+        int prefix;
+    };
+    std::vector<build_node> m_build;
+
+    // compile()之后的扁平字典树, 每个节点的出边连续存放
+    struct node
+    {
+        uint32_t first_edge;
+        uint32_t edge_count;
+        int32_t exact;          // m_routes的下标, -1表示没有
+        int32_t prefix;
+    };
+    std::vector<node> m_nodes;
+    std::vector<char> m_edge_char;
+    std::vector<uint32_t> m_edge_target;
+    std::vector<route> m_routes;
+};
+
+// 注册内置的路由: /upload, /stream/<字节数>, /status
+void register_builtin_routes(router &r);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <atomic>
+#include "locker.h"
+
+// Server-Sent Events广播: GET /events/<频道> 订阅, POST /events/<频道> 把请求体作为一个事件发给所有订阅者
+//
+// 事件在发布时只编码一次("id: ..\ndata: ..\n\n"), 放在引用计数的缓冲区里; 每个订阅者的发送队列里只放引用,
+// 连接用writev直接从共享的缓冲区发送, 发完出队, 最后一个订阅者发完时缓冲区释放.
+// 订阅者的队列有上限(配置项sse_queue), 满了按sse_policy处理: drop丢掉最旧的还没开始发的事件, disconnect断开这个订阅者
+//
+// 频道由订阅者、还没发完响应头的订阅请求和发布者用shared_ptr持有, 最后一个离开时释放, 名字表里只放weak_ptr;
+// 随便GET一个名字不会永久占住频道表
+//
+// 订阅者发空队列后连接只注册EPOLLRDHUP; 发布者放进事件时注册EPOLLOUT唤醒它, 之后和普通响应一样在write()里发送
+
+typedef std::shared_ptr<const std::string> sse_buffer;
+
+class http_conn;
+class sse_channel;
+
+// 一个订阅者, 由连接持有. 队列和状态由lock保护, 发布者和处理这个连接的线程都会访问
+struct sse_subscriber
+{
+    locker lock;
+    http_conn *conn;
+    std::shared_ptr<sse_channel> channel;
+    std::deque<sse_buffer> queue;
+    size_t offset;          // queue.front()已经发出的字节数
+    bool idle;              // 队列发空了, 在等发布者唤醒
+    bool overflow;          // disconnect策略下队列满了, 连接下一次写时关闭
+
+    sse_subscriber(http_conn *c, const std::shared_ptr<sse_channel> &ch)
+        : conn(c), channel(ch), offset(0), idle(false), overflow(false) {}
+    // writev发出了n字节, 发完的事件出队
+    void advance(size_t n);
+};
+
+class sse_channel
+{
+public:
+    sse_channel() : m_last_id(0) {}
+    void subscribe(sse_subscriber *s);
+    void unsubscribe(sse_subscriber *s);
+    // 编码一次, 放进每个订阅者的队列, 返回订阅者数
+    int publish(const char *data, size_t len);
+
+private:
+    locker m_lock;
+    std::vector<sse_subscriber *> m_subs;
+    uint64_t m_last_id;
+};
+
+class sse_hub
+{
+public:
+    static const size_t MAX_CHANNELS = 1024;
+    static const size_t MAX_EVENT = 64 * 1024;      // 一个事件的数据上限
+
+    sse_hub() : m_queue_limit(256), m_disconnect(false), m_subscribers(0), m_events(0), m_dropped(0), m_disconnected(0) {}
+    // 每个订阅者最多排队的事件数, 满了时断开(true)还是丢掉最旧的(false)
+    void configure(int queue_limit, bool disconnect);
+    // 按名字找频道, create时没有就创建; 频道数到了上限或者没找到时返回空. 没有人持有的频道自动释放
+    std::shared_ptr<sse_channel> channel(const std::string &name, bool create);
+    // GET /status 里的一行, 还没有用过事件流时为空
+    std::string stats();
+
+private:
+    friend class sse_channel;
+
+    void purge();
+
+    std::atomic<int> m_queue_limit;
+    std::atomic<bool> m_disconnect;
+    std::atomic<int> m_subscribers;
+    std::atomic<uint64_t> m_events;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_disconnected;
+
+    locker m_lock;
+    std::map<std::string, std::weak_ptr<sse_channel>> m_channels;
+};
+
+extern sse_hub sse_events;
+
+#endif
@@ -6,6 +6,14 @@
 #include <exception>
 #include <pthread.h>
 #include "locker.h"
+#include "probes.h"
+
+// 线程池的编号, 只用于跟踪探针
+enum POOL_ID
+{
+    POOL_HTTP = 0,          // 处理HTTP请求的工作线程
+    POOL_PREFETCH           // 预取冷文件的I/O线程
+};
 
 // 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类
 template <typename T>
@@ -13,19 +21,26 @@ class threadpool
 {
 public:
     /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量*/
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    // pool_id放在enqueue/dequeue探针的第三个参数里, 区分进程里的几个池, 见 POOL_HTTP 等
+    threadpool(int thread_number = 8, int max_requests = 10000, int pool_id = POOL_HTTP);
     ~threadpool();
     bool append(T *request);
+    // 运行中调整线程数和队列长度(SIGHUP重新加载配置时), 由主线程调用
+    // 增加时新建线程; 减少时让多出来的线程取完手上的请求后退出
+    bool set_thread_number(int thread_number);
+    void set_max_requests(int max_requests);
 private:
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void *worker(void *arg);
     void run();
+    // 新建n个脱离线程
+    bool spawn(int n);
 private:
     // 线程的数量
     int m_thread_number;
 
-    // 描述线程池的数组，大小为m_thread_number
-    pthread_t *m_threads;
+    // 等待退出的线程数, 线程被唤醒时先看这里
+    int m_retire;
 
     // 请求队列中最多允许的、等待处理的请求的数量
     int m_max_requests;
@@ -41,53 +56,85 @@ private:
 
     // 是否结束线程
     bool m_stop;
+
+    // 池的编号, POOL_ID
+    int m_pool_id;
 };
 
 template <typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests) 
-: m_thread_number(thread_number), m_max_requests(max_requests),m_stop(false), m_threads(NULL)
+threadpool<T>::threadpool(int thread_number, int max_requests, int pool_id)
+: m_thread_number(0), m_retire(0), m_max_requests(max_requests), m_stop(false), m_pool_id(pool_id)
 {
 
     if ((thread_number <= 0) || (max_requests <= 0))
     {
         throw std::exception();
     }
-    ///new线程
-    m_threads = new pthread_t[m_thread_number];
-    if (!m_threads)
+    if (!spawn(thread_number))
     {
         throw std::exception();
     }
+}
 
-    // 创建thread_number 个线程，并将他们设置为脱离线程。
-    for (int i = 0; i < thread_number; ++i)
+// 创建n个线程，并将他们设置为脱离线程。
+template <typename T>
+bool threadpool<T>::spawn(int n)
+{
+    for (int i = 0; i < n; ++i)
     {
-        //printf("create the %dth thread\n", i);
         ///创建线程
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0)
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, this) != 0)
         {
-            delete[] m_threads;
-            throw std::exception();
+            return false;
         }
         ///设置线程脱离
-        if (pthread_detach(m_threads[i]))
-        {
-            delete[] m_threads;
-            throw std::exception();
-        }
+        pthread_detach(thread);
+        ++m_thread_number;
     }
+    return true;
 }
 
 template <typename T>
 threadpool<T>::~threadpool()
 {
-    delete[] m_threads;
-
     ///使得所有的线程都停止run函数
     m_stop = true;
     
 }
 
+template <typename T>
+bool threadpool<T>::set_thread_number(int thread_number)
+{
+    if (thread_number <= 0)
+    {
+        return false;
+    }
+    if (thread_number > m_thread_number)
+    {
+        return spawn(thread_number - m_thread_number);
+    }
+    int extra = m_thread_number - thread_number;
+    m_queuelocker.lock();
+    m_retire += extra;
+    m_queuelocker.unlock();
+    m_thread_number = thread_number;
+    // 每个要退出的线程多一次唤醒, 信号量的计数和队列里的请求数仍然对得上
+    for (int i = 0; i < extra; ++i)
+    {
+        m_queuestat.post();
+    }
+    return true;
+}
+
+template <typename T>
+void threadpool<T>::set_max_requests(int max_requests)
+{
+    m_queuelocker.lock();
+    m_max_requests = max_requests;
+    m_queuelocker.unlock();
+}
+
 ///添加连接请求到请求队列
 template <typename T>
 bool threadpool<T>::append(T *request)
@@ -95,12 +142,13 @@ bool threadpool<T>::append(T *request)
     
     // 操作工作队列时一定要加锁，因为它被所有线程共享。
     m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests)
+    if (m_workqueue.size() > (size_t)m_max_requests)
     {
         m_queuelocker.unlock();
         return false;
     }
     m_workqueue.push_back(request);
+    WS_PROBE3(enqueue, request, m_workqueue.size(), m_pool_id);
     m_queuelocker.unlock();
 
     ///信号量在这里表示等待处理的事件数量
@@ -124,6 +172,12 @@ void threadpool<T>::run()
     {
         m_queuestat.wait();///如果请求队列里没东西就阻塞在这,直到请求队列有东西为止
         m_queuelocker.lock();///加锁
+        if (m_retire > 0)
+        {
+            --m_retire;
+            m_queuelocker.unlock();
+            break;
+        }
         if (m_workqueue.empty())
         {
             m_queuelocker.unlock();
@@ -133,6 +187,7 @@ void threadpool<T>::run()
         ///取出一个http请求
         T *request = m_workqueue.front();
         m_workqueue.pop_front();
+        WS_PROBE3(dequeue, request, m_workqueue.size(), m_pool_id);
 
         //解锁
         m_queuelocker.unlock();
@@ -0,0 +1,47 @@
+#ifndef TLS_CONN_H
+#define TLS_CONN_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+// TLS终结: 握手在用户态由OpenSSL完成, 内核支持kTLS时把会话密钥交给内核,
+// 之后这个方向就直接在socket上recv/writev, 和明文连接走同一条路径(包括mmap文件的零拷贝发送)
+// 内核不支持时退回SSL_read/SSL_write
+class tls_conn
+{
+public:
+    enum HANDSHAKE_RESULT { HS_DONE = 0, HS_WANT_READ, HS_WANT_WRITE, HS_ERROR };
+
+    // 加载证书和私钥, 创建全局SSL_CTX, 失败返回false
+    static bool init_context(const char *cert_file, const char *key_file);
+    static bool enabled() { return m_ctx != NULL; }
+    // 打印握手次数、会话复用、握手耗时和kTLS启用情况
+    static void print_stats();
+
+public:
+    tls_conn();
+    ~tls_conn();
+
+    bool attach(int fd);
+    // 非阻塞握手, 可以多次调用直到返回HS_DONE
+    HANDSHAKE_RESULT handshake();
+    bool established() const { return m_established; }
+    // 握手时OpenSSL已经解密但还没被读走的数据
+    bool has_pending() const;
+
+    // 语义和recv/writev一致: 返回-1且errno为EAGAIN表示需要等待, 返回0表示对端关闭
+    int read(char *buf, int len);
+    int writev(const struct iovec *iov, int iovcnt);
+
+private:
+    static SSL_CTX *m_ctx;
+
+    SSL *m_ssl;
+    int m_fd;
+    bool m_established;
+    bool m_ktls_send;       // 发送方向由内核加密
+    bool m_ktls_recv;       // 接收方向由内核解密
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef TRACE_RING_H
+#define TRACE_RING_H
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// 每个请求各个阶段的时间戳, 用来解释单个的长尾请求
+//
+// 时间戳是CPU的周期计数(x86的TSC, aarch64的虚拟计数器), 一次读取只要几纳秒, 不进内核
+// 请求的响应写完后, 完成写的那个线程把这条记录放进自己的环形缓冲区, 只有这个线程写, 不用加锁;
+// 导出的线程读的时候不拦写者, 按顺序锁(seqlock)的读法: 复制一条记录后再看一次m_head, 期间被覆盖的丢掉
+// 环写满后覆盖最旧的记录; 导出时(SIGUSR2 或 GET /trace)换算成微秒, 输出Chrome的trace-event JSON,
+// 用 chrome://tracing 或 https://ui.perfetto.dev 打开: 每个连接一行, 每个请求一段, 里面是相邻阶段之间的间隔
+// HTTP/2的请求不记录
+
+enum TRACE_STAGE
+{
+    TRACE_ACCEPT = 0,       // accept, 只有连接上的第一个请求有
+    TRACE_FIRST_READ,       // 读到这个请求的第一批字节
+    TRACE_ENQUEUE,          // 交给线程池, 单线程模型没有
+    TRACE_DEQUEUE,          // 工作线程开始处理(单线程模型是主线程)
+    TRACE_PARSED,           // 解析完请求
+    TRACE_READY,            // 生成好响应
+    TRACE_FIRST_WRITE,      // 第一次写socket
+    TRACE_LAST_WRITE,       // 响应全部写完
+    TRACE_STAGES
+};
+
+struct trace_record
+{
+    uint64_t tsc[TRACE_STAGES];     // 没有经过的阶段为0
+    uint32_t conn;                  // 连接的序号
+    int32_t fd;
+    uint32_t bytes;                 // 响应的字节数
+    uint8_t code;                   // http_conn::HTTP_CODE
+    uint8_t method;                 // http_conn::METHOD
+    uint16_t reserved;
+};
+
+inline uint64_t trace_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// 一个线程的环形缓冲区: 单写者, 导出时别的线程只读
+class trace_ring
+{
+public:
+    static const uint32_t SIZE = 4096;      // 每个线程保留最近的这么多个请求
+
+    trace_ring(int tid) : m_tid(tid), m_head(0) {}
+    void push(const trace_record &r)
+    {
+        uint64_t h = m_head.load(std::memory_order_relaxed);
+        // 上一次push发布的m_head要先于这次覆盖槽位的写被看到, 读者才能靠它认出被覆盖的记录; x86上不产生指令
+        std::atomic_thread_fence(std::memory_order_release);
+        m_records[h & (SIZE - 1)] = r;
+        m_head.store(h + 1, std::memory_order_release);
+    }
+    // 把还没有被覆盖的记录按Chrome trace-event格式追加到out, 每个事件前面带逗号(第一个除外, first记录是否已有事件)
+    void dump(std::string &out, bool &first, double ticks_per_us, uint64_t base) const;
+
+private:
+    int m_tid;
+    std::atomic<uint64_t> m_head;           // 已经写入的记录总数
+    trace_record m_records[SIZE];
+};
+
+// 当前线程的环, 第一次调用时创建并登记, 之后导出时能找到; 线程退出后环保留
+trace_ring &trace_local();
+
+// 周期计数器每微秒的计数, 按进程启动以来的计数和单调时钟算出
+double trace_ticks_per_us();
+
+// 导出所有线程的环, 返回完整的JSON文档
+std::string trace_dump();
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// WebSocket(RFC 6455), 挂在一个http_conn上, 用法和h2_session一样:
+//   路由的处理函数在handler_response::websocket里给出处理者, 连接回101之后创建会话;
+//   主线程read()直接读进连接的读缓冲区(会话借用它做输入缓冲区), 工作线程process()调用on_input()解析帧,
+//   主线程write()发送output()
+// 收到的数据帧原地解掩码后按到达的片段交给处理者, 不等整条消息收齐, 大消息也不拷贝;
+// 输入缓冲区里只需要放得下帧头和控制帧(不超过125字节), 每个连接不另外占内存
+// 不支持扩展(permessage-deflate), 文本消息不检查UTF-8
+
+enum WS_OPCODE
+{
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xA,
+};
+
+// 关闭帧的状态码
+enum WS_CLOSE_CODE
+{
+    WS_CLOSE_NORMAL = 1000,
+    WS_CLOSE_GOING_AWAY = 1001,
+    WS_CLOSE_PROTOCOL_ERROR = 1002,
+    WS_CLOSE_TOO_BIG = 1009,
+};
+
+// 掩码: data[i] ^= key[(phase + i) % 4], 客户端发送和服务器接收共用.
+// 按编译时的目标指令集一次处理32(AVX2)或16(SSE2/NEON)字节, 剩下的按8字节和单字节处理
+inline void ws_mask(char *data, size_t len, const uint8_t key[4], size_t phase)
+{
+    uint8_t k[4] = {key[phase & 3], key[(phase + 1) & 3], key[(phase + 2) & 3], key[(phase + 3) & 3]};
+    uint32_t k32;
+    memcpy(&k32, k, 4);
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i m256 = _mm256_set1_epi32((int)k32);
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(v, m256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i m128 = _mm_set1_epi32((int)k32);
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, m128));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t m128 = vreinterpretq_u8_u32(vdupq_n_u32(k32));
+    for (; i + 16 <= len; i += 16)
+    {
+        vst1q_u8((uint8_t *)data + i, veorq_u8(vld1q_u8((const uint8_t *)data + i), m128));
+    }
+#endif
+    uint64_t k64 = (uint64_t)k32 << 32 | k32;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        v ^= k64;
+        memcpy(data + i, &v, 8);
+    }
+    // 前面每次处理的都是4的倍数, 这里从k[0]开始
+    for (size_t j = 0; i < len; ++i, ++j)
+    {
+        data[i] ^= k[j & 3];
+    }
+}
+
+// Sec-WebSocket-Accept: base64(SHA-1(key + 固定的GUID)), 写到out里28个字符
+static const int WS_ACCEPT_LEN = 28;
+void ws_accept_key(const char *key, size_t len, char out[WS_ACCEPT_LEN]);
+
+class ws_session;
+
+// 一个WebSocket连接上的应用逻辑, 每个连接一个, 由会话delete
+// 回调都在处理这个连接的线程里调用, 同一时刻只有一个线程
+class ws_handler
+{
+public:
+    virtual ~ws_handler() {}
+    // 握手完成
+    virtual void on_open(ws_session &s) {}
+    // 一条文本或二进制消息的一段: opcode是整条消息的类型, first/last标出消息的开头和结尾
+    // data指向会话的输入缓冲区, 已经解掩码, 只在调用期间有效; 空消息也会调用一次, len为0
+    virtual void on_data(ws_session &s, int opcode, const char *data, size_t len, bool first, bool last) = 0;
+    // 收到对端的关闭帧, 或者因为协议错误关闭; 之后不再有回调
+    virtual void on_close(ws_session &s, int code) {}
+};
+
+class ws_session
+{
+public:
+    // 输出缓冲区超过这个值就不再读对端的数据, 等发送出去再说
+    static const size_t OUTPUT_HIGH_WATER = 256 * 1024;
+
+    // buf是输入缓冲区, 由调用者持有; 其中已经有used字节(握手请求之后读到的)
+    ws_session(ws_handler *handler, char *buf, size_t size, size_t used);
+    ~ws_session();
+    // 调用处理者的on_open, 可能产生输出
+    void start();
+
+    // 直接读进输入缓冲区: 可写的位置和长度, 读到n字节后commit; 缓冲区满时len为0
+    char *input_space(size_t &len) { len = m_in_size - m_in_end; return m_in + m_in_end; }
+    void commit(size_t n) { m_in_end += n; }
+    // 解析已收到的帧并交给处理者, 返回false表示协议错误(关闭帧已经写入输出)
+    bool on_input();
+
+    // 发一帧, fin为false时后面还有延续帧; 处理者可以把收到的一段直接转发出去
+    void send_frame(int opcode, const char *data, size_t len, bool fin);
+    void send(int opcode, const char *data, size_t len) { send_frame(opcode, data, len, true); }
+    // 主动关闭: 发关闭帧, 之后不再交付收到的数据
+    void close(int code);
+
+    const char *output() const { return m_out.data() + m_out_pos; }
+    size_t output_size() const { return m_out.size() - m_out_pos; }
+    void consume(size_t n);
+
+    // 已经发出了关闭帧, 发完输出后应该关闭连接
+    bool finished() const { return m_close_sent; }
+
+private:
+    bool fail(int code);
+    bool handle_control(int opcode, const char *payload, size_t len);
+
+    ws_handler *m_handler;
+
+    char *m_in;
+    size_t m_in_size;
+    size_t m_in_start;
+    size_t m_in_end;
+
+    // 正在接收的数据帧
+    bool m_in_payload;          // 帧头已经解析, 在接收负载
+    uint64_t m_left;            // 这一帧还没收到的负载
+    uint8_t m_key[4];
+    size_t m_phase;             // 已经解掩码的负载字节数, 决定下一段从掩码的哪个字节开始
+    bool m_frame_fin;
+    // 正在接收的消息, 可能由多个帧组成
+    int m_msg_opcode;           // 0表示不在消息中间
+    bool m_msg_started;         // 这条消息已经交付过至少一段
+
+    std::string m_out;
+    size_t m_out_pos;
+    bool m_close_sent;
+    bool m_close_received;
+};
+
+#endif
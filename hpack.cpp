@@ -0,0 +1,378 @@
+#include <string.h>
+#include "headers/hpack.h"
+
+// 静态表, 下标从1开始(RFC 7541 附录A)
+static const char *const static_table[][2] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+static const uint32_t STATIC_TABLE_LEN = 61;
+
+// 每个符号的Huffman码长(RFC 7541 附录B), 最后一个是EOS
+// 这套编码是规范Huffman编码: 码字按(码长, 符号)排序依次递增, 所以只存码长就能还原
+static const uint8_t huffman_code_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static const int HUFFMAN_MAX_LEN = 30;
+static const int HUFFMAN_EOS = 256;
+
+// 规范Huffman的解码表: 每种码长的第一个码字, 以及它在排序后符号表中的位置
+struct huffman_table
+{
+    uint32_t first_code[HUFFMAN_MAX_LEN + 1];
+    uint32_t count[HUFFMAN_MAX_LEN + 1];
+    uint32_t first_index[HUFFMAN_MAX_LEN + 1];
+    uint16_t symbols[257];
+
+    huffman_table()
+    {
+        memset(count, 0, sizeof(count));
+        for (int s = 0; s < 257; ++s)
+        {
+            count[huffman_code_len[s]]++;
+        }
+        uint32_t code = 0, index = 0;
+        for (int len = 1; len <= HUFFMAN_MAX_LEN; ++len)
+        {
+            first_code[len] = code;
+            first_index[len] = index;
+            // 同一码长内按符号值排序
+            for (int s = 0; s < 257; ++s)
+            {
+                if (huffman_code_len[s] == len)
+                {
+                    symbols[index++] = s;
+                }
+            }
+            code = (code + count[len]) << 1;
+        }
+    }
+};
+
+static const huffman_table &get_huffman_table()
+{
+    static const huffman_table table;
+    return table;
+}
+
+static bool huffman_decode(const uint8_t *data, size_t len, std::string &out)
+{
+    const huffman_table &t = get_huffman_table();
+    uint32_t code = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        for (int shift = 7; shift >= 0; --shift)
+        {
+            code = (code << 1) | ((data[i] >> shift) & 1);
+            ++bits;
+            if (code - t.first_code[bits] < t.count[bits])
+            {
+                int sym = t.symbols[t.first_index[bits] + code - t.first_code[bits]];
+                if (sym == HUFFMAN_EOS)
+                {
+                    return false;
+                }
+                out.push_back((char)sym);
+                code = 0;
+                bits = 0;
+            }
+            else if (bits == HUFFMAN_MAX_LEN)
+            {
+                return false;
+            }
+        }
+    }
+    // 结尾的填充必须是不超过7位的EOS前缀, 也就是全1
+    return bits <= 7 && code == (1u << bits) - 1;
+}
+
+// 解码N位前缀的整数, pos指向首字节, 成功后移动到整数之后
+static bool decode_int(const uint8_t *data, size_t len, size_t &pos, int prefix_bits, uint32_t &value)
+{
+    if (pos >= len)
+    {
+        return false;
+    }
+    uint32_t mask = (1u << prefix_bits) - 1;
+    value = data[pos++] & mask;
+    if (value < mask)
+    {
+        return true;
+    }
+    int m = 0;
+    while (pos < len)
+    {
+        uint8_t b = data[pos++];
+        if (m > 21)
+        {
+            // 超过28位, 没有合法的头部会这么长
+            return false;
+        }
+        value += (uint32_t)(b & 0x7f) << m;
+        m += 7;
+        if (!(b & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool decode_string(const uint8_t *data, size_t len, size_t &pos, std::string &out)
+{
+    if (pos >= len)
+    {
+        return false;
+    }
+    bool huffman = data[pos] & 0x80;
+    uint32_t n;
+    if (!decode_int(data, len, pos, 7, n) || n > len - pos)
+    {
+        return false;
+    }
+    out.clear();
+    if (huffman)
+    {
+        if (!huffman_decode(data + pos, n, out))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        out.assign((const char *)data + pos, n);
+    }
+    pos += n;
+    return true;
+}
+
+hpack_decoder::hpack_decoder() : m_size(0), m_max_size(DEFAULT_TABLE_SIZE)
+{
+}
+
+// 下标 1..61 是静态表, 之后是动态表(从最新的条目开始)
+bool hpack_decoder::lookup(uint32_t index, hpack_header &h) const
+{
+    if (index == 0)
+    {
+        return false;
+    }
+    if (index <= STATIC_TABLE_LEN)
+    {
+        h.name = static_table[index][0];
+        h.value = static_table[index][1];
+        return true;
+    }
+    index -= STATIC_TABLE_LEN + 1;
+    if (index >= m_dynamic.size())
+    {
+        return false;
+    }
+    h = m_dynamic[index];
+    return true;
+}
+
+void hpack_decoder::evict(size_t max_size)
+{
+    while (m_size > max_size && !m_dynamic.empty())
+    {
+        const hpack_header &old = m_dynamic.back();
+        m_size -= old.name.size() + old.value.size() + 32;
+        m_dynamic.pop_back();
+    }
+}
+
+void hpack_decoder::insert(const hpack_header &h)
+{
+    size_t entry = h.name.size() + h.value.size() + 32;
+    // 比整张表还大的条目会清空动态表, 但不算错误
+    evict(entry > m_max_size ? 0 : m_max_size - entry);
+    if (entry <= m_max_size)
+    {
+        m_dynamic.push_front(h);
+        m_size += entry;
+    }
+}
+
+bool hpack_decoder::decode(const uint8_t *data, size_t len, std::vector<hpack_header> &headers, size_t max_list_size)
+{
+    size_t pos = 0;
+    size_t list_size = 0;
+    // 大小更新只能出现在头部块的开头
+    bool allow_size_update = true;
+    while (pos < len)
+    {
+        uint8_t b = data[pos];
+        uint32_t index;
+        hpack_header h;
+        if (b & 0x80)
+        {
+            // 1xxxxxxx 完整索引
+            if (!decode_int(data, len, pos, 7, index) || !lookup(index, h))
+            {
+                return false;
+            }
+            list_size += h.name.size() + h.value.size() + 32;
+            if (list_size > max_list_size)
+            {
+                return false;
+            }
+            headers.push_back(h);
+            allow_size_update = false;
+            continue;
+        }
+        if ((b & 0xe0) == 0x20)
+        {
+            // 001xxxxx 动态表大小更新
+            if (!allow_size_update || !decode_int(data, len, pos, 5, index) || index > DEFAULT_TABLE_SIZE)
+            {
+                return false;
+            }
+            m_max_size = index;
+            evict(m_max_size);
+            continue;
+        }
+
+        // 01xxxxxx 字面量并加入索引; 0000xxxx 不加入索引; 0001xxxx 永不索引
+        bool indexing = (b & 0xc0) == 0x40;
+        if (!decode_int(data, len, pos, indexing ? 6 : 4, index))
+        {
+            return false;
+        }
+        if (index != 0)
+        {
+            if (!lookup(index, h))
+            {
+                return false;
+            }
+        }
+        else if (!decode_string(data, len, pos, h.name))
+        {
+            return false;
+        }
+        if (!decode_string(data, len, pos, h.value))
+        {
+            return false;
+        }
+        list_size += h.name.size() + h.value.size() + 32;
+        if (list_size > max_list_size)
+        {
+            return false;
+        }
+        if (indexing)
+        {
+            insert(h);
+        }
+        headers.push_back(h);
+        allow_size_update = false;
+    }
+    return true;
+}
+
+void hpack_encode_int(std::string &out, uint8_t flags, int prefix_bits, uint32_t value)
+{
+    uint32_t mask = (1u << prefix_bits) - 1;
+    if (value < mask)
+    {
+        out.push_back((char)(flags | value));
+        return;
+    }
+    out.push_back((char)(flags | mask));
+    value -= mask;
+    while (value >= 0x80)
+    {
+        out.push_back((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+void hpack_encode_indexed(std::string &out, uint32_t index)
+{
+    hpack_encode_int(out, 0x80, 7, index);
+}
+
+void hpack_encode_literal(std::string &out, uint32_t name_index, const char *value, size_t len)
+{
+    hpack_encode_int(out, 0x00, 4, name_index);
+    hpack_encode_int(out, 0x00, 7, len);
+    out.append(value, len);
+}
@@ -0,0 +1,743 @@
+#include <string.h>
+#include <sys/mman.h>
+#include "headers/http2.h"
+#include "headers/http_conn.h"
+#include "headers/http_response.h"
+
+const char h2_session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// 帧类型
+enum
+{
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9
+};
+
+// 帧标志
+enum
+{
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20
+};
+
+// 错误码
+enum
+{
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+    H2_HTTP_1_1_REQUIRED = 0xd
+};
+
+// 设置项
+enum
+{
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+static const uint32_t FRAME_HEADER_LEN = 9;
+static const uint32_t DEFAULT_MAX_FRAME_SIZE = 16384;
+static const int32_t DEFAULT_WINDOW = 65535;
+static const int64_t MAX_WINDOW = 0x7fffffff;
+static const uint32_t MAX_CONCURRENT_STREAMS = 100;
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(std::string &out, uint32_t v)
+{
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+// HTTP2-Settings头使用不带填充的base64url编码
+static bool base64url_decode(const char *in, std::string &out)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+    for (; *in; ++in)
+    {
+        char c = *in;
+        int v;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '-')
+            v = 62;
+        else if (c == '_')
+            v = 63;
+        else if (c == '=')
+            break;
+        else
+            return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out.push_back((char)((acc >> bits) & 0xff));
+        }
+    }
+    return true;
+}
+
+h2_session::h2_session(int limit_slot)
+    : m_out_pos(0), m_preface_pending(true), m_closing(false), m_limit_slot(limit_slot),
+      m_last_stream_id(0), m_header_stream_id(0),
+      m_peer_max_frame_size(DEFAULT_MAX_FRAME_SIZE), m_peer_initial_window(DEFAULT_WINDOW),
+      m_conn_send_window(DEFAULT_WINDOW)
+{
+}
+
+h2_session::~h2_session()
+{
+    while (!m_streams.empty())
+    {
+        close_stream(m_streams.begin());
+    }
+}
+
+void h2_session::start()
+{
+    write_settings();
+}
+
+bool h2_session::start_upgrade(const char *settings, int code, char *file_address, const struct stat &file_stat)
+{
+    // 设置解析失败就不升级, 按HTTP/1.1正常响应
+    std::string payload;
+    if (!settings || !base64url_decode(settings, payload) || !handle_settings(0, (const uint8_t *)payload.data(), payload.size(), false))
+    {
+        m_out.clear();
+        m_closing = false;
+        return false;
+    }
+
+    m_out.append("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    write_settings();
+
+    // 升级前的请求隐式成为流1, 客户端那一侧已经半关闭
+    m_last_stream_id = 1;
+    stream_body body = {file_address, code == http_conn::FILE_REQUEST ? (size_t)file_stat.st_size : 0, file_address, NULL};
+    respond(1, code, body);
+    return true;
+}
+
+bool h2_session::feed(const char *data, int len)
+{
+    if (m_in.size() + len > INPUT_LIMIT)
+    {
+        return false;
+    }
+    m_in.append(data, len);
+    return true;
+}
+
+void h2_session::consume(size_t n)
+{
+    m_out_pos += n;
+    if (m_out_pos == m_out.size())
+    {
+        m_out.clear();
+        m_out_pos = 0;
+    }
+    else if (m_out_pos >= OUTPUT_HIGH_WATER)
+    {
+        // 已发送的部分太多了, 挪掉免得缓冲区一直增长
+        m_out.erase(0, m_out_pos);
+        m_out_pos = 0;
+    }
+}
+
+void h2_session::write_frame_header(uint32_t len, uint8_t type, uint8_t flags, uint32_t stream_id)
+{
+    m_out.push_back((char)(len >> 16));
+    m_out.push_back((char)(len >> 8));
+    m_out.push_back((char)len);
+    m_out.push_back((char)type);
+    m_out.push_back((char)flags);
+    put_u32(m_out, stream_id & 0x7fffffff);
+}
+
+void h2_session::write_settings()
+{
+    write_frame_header(12, FRAME_SETTINGS, 0, 0);
+    m_out.push_back(0);
+    m_out.push_back(SETTINGS_MAX_CONCURRENT_STREAMS);
+    put_u32(m_out, MAX_CONCURRENT_STREAMS);
+    m_out.push_back(0);
+    m_out.push_back(SETTINGS_MAX_HEADER_LIST_SIZE);
+    put_u32(m_out, MAX_HEADER_BLOCK);
+}
+
+void h2_session::write_window_update(uint32_t stream_id, uint32_t increment)
+{
+    write_frame_header(4, FRAME_WINDOW_UPDATE, 0, stream_id);
+    put_u32(m_out, increment);
+}
+
+void h2_session::write_rst_stream(uint32_t stream_id, uint32_t error)
+{
+    write_frame_header(4, FRAME_RST_STREAM, 0, stream_id);
+    put_u32(m_out, error);
+}
+
+// 连接错误: 发送GOAWAY, 丢弃所有流, 发完就关闭连接
+void h2_session::goaway(uint32_t error)
+{
+    write_frame_header(8, FRAME_GOAWAY, 0, 0);
+    put_u32(m_out, m_last_stream_id);
+    put_u32(m_out, error);
+    while (!m_streams.empty())
+    {
+        close_stream(m_streams.begin());
+    }
+    m_ready.clear();
+    m_closing = true;
+}
+
+bool h2_session::on_input()
+{
+    size_t pos = 0;
+    if (m_preface_pending)
+    {
+        if (m_in.size() < (size_t)PREFACE_LEN)
+        {
+            return true;
+        }
+        if (memcmp(m_in.data(), PREFACE, PREFACE_LEN) != 0)
+        {
+            goaway(H2_PROTOCOL_ERROR);
+            return false;
+        }
+        m_preface_pending = false;
+        pos = PREFACE_LEN;
+    }
+
+    bool ok = true;
+    while (m_in.size() - pos >= FRAME_HEADER_LEN)
+    {
+        const uint8_t *p = (const uint8_t *)m_in.data() + pos;
+        uint32_t len = (p[0] << 16) | (p[1] << 8) | p[2];
+        if (len > DEFAULT_MAX_FRAME_SIZE)
+        {
+            goaway(H2_FRAME_SIZE_ERROR);
+            ok = false;
+            break;
+        }
+        if (m_in.size() - pos < FRAME_HEADER_LEN + len)
+        {
+            break;
+        }
+        if (!handle_frame(p[3], p[4], get_u32(p + 5) & 0x7fffffff, p + FRAME_HEADER_LEN, len))
+        {
+            ok = false;
+            break;
+        }
+        pos += FRAME_HEADER_LEN + len;
+    }
+    m_in.erase(0, pos);
+    return ok;
+}
+
+bool h2_session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len)
+{
+    // 头部块没结束时, 只允许同一个流的CONTINUATION
+    if (m_header_stream_id != 0 && (type != FRAME_CONTINUATION || stream_id != m_header_stream_id))
+    {
+        goaway(H2_PROTOCOL_ERROR);
+        return false;
+    }
+
+    switch (type)
+    {
+    case FRAME_DATA:
+    {
+        if (stream_id == 0 || stream_id > m_last_stream_id)
+        {
+            goaway(H2_PROTOCOL_ERROR);
+            return false;
+        }
+        // 我们不处理请求体, 收到多少就归还多少接收窗口
+        if (len > 0)
+        {
+            write_window_update(0, len);
+            if (!(flags & FLAG_END_STREAM) && m_streams.count(stream_id))
+            {
+                write_window_update(stream_id, len);
+            }
+        }
+        return true;
+    }
+    case FRAME_HEADERS:
+        return handle_headers(flags, stream_id, payload, len);
+    case FRAME_CONTINUATION:
+        if (m_header_stream_id == 0)
+        {
+            goaway(H2_PROTOCOL_ERROR);
+            return false;
+        }
+        // 不带END_HEADERS的CONTINUATION可以一直发, 头部块要有上限
+        if (m_header_block.size() + len > MAX_HEADER_BLOCK)
+        {
+            goaway(H2_ENHANCE_YOUR_CALM);
+            return false;
+        }
+        m_header_block.append((const char *)payload, len);
+        return (flags & FLAG_END_HEADERS) ? end_headers() : true;
+    case FRAME_PRIORITY:
+        // 不实现优先级, 所有流轮转发送
+        if (stream_id == 0 || len != 5)
+        {
+            goaway(stream_id == 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+        return true;
+    case FRAME_RST_STREAM:
+    {
+        if (stream_id == 0 || len != 4)
+        {
+            goaway(stream_id == 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+        std::map<uint32_t, stream>::iterator it = m_streams.find(stream_id);
+        if (it != m_streams.end())
+        {
+            close_stream(it);
+        }
+        return true;
+    }
+    case FRAME_SETTINGS:
+        if (stream_id != 0)
+        {
+            goaway(H2_PROTOCOL_ERROR);
+            return false;
+        }
+        return handle_settings(flags, payload, len, true);
+    case FRAME_PING:
+        if (stream_id != 0 || len != 8)
+        {
+            goaway(stream_id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+        if (!(flags & FLAG_ACK))
+        {
+            write_frame_header(8, FRAME_PING, FLAG_ACK, 0);
+            m_out.append((const char *)payload, 8);
+        }
+        return true;
+    case FRAME_GOAWAY:
+        // 对端不会再开新的流, 已有的流发完就关闭
+        m_closing = true;
+        return true;
+    case FRAME_WINDOW_UPDATE:
+        return handle_window_update(stream_id, payload, len);
+    case FRAME_PUSH_PROMISE:
+        // 客户端不能推送
+        goaway(H2_PROTOCOL_ERROR);
+        return false;
+    default:
+        // 未知类型的帧直接忽略
+        return true;
+    }
+}
+
+bool h2_session::handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len)
+{
+    // 客户端发起的流ID必须是奇数并且递增, 我们也不接受请求尾部(trailers)
+    if (stream_id == 0 || !(stream_id & 1) || stream_id <= m_last_stream_id)
+    {
+        goaway(H2_PROTOCOL_ERROR);
+        return false;
+    }
+    m_last_stream_id = stream_id;
+
+    uint32_t pad = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1)
+        {
+            goaway(H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+        pad = payload[0];
+        payload++;
+        len--;
+    }
+    if (flags & FLAG_PRIORITY)
+    {
+        if (len < 5)
+        {
+            goaway(H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+        payload += 5;
+        len -= 5;
+    }
+    if (pad > len)
+    {
+        goaway(H2_PROTOCOL_ERROR);
+        return false;
+    }
+
+    m_header_stream_id = stream_id;
+    m_header_block.assign((const char *)payload, len - pad);
+    return (flags & FLAG_END_HEADERS) ? end_headers() : true;
+}
+
+// 一个流的请求头已经完整, 解码并生成响应
+bool h2_session::end_headers()
+{
+    uint32_t stream_id = m_header_stream_id;
+    std::vector<hpack_header> headers;
+    // 即使要拒绝这个流也必须解码, 否则动态表会和对端不一致; 解出的头部也受通告的MAX_HEADER_LIST_SIZE限制
+    bool ok = m_decoder.decode((const uint8_t *)m_header_block.data(), m_header_block.size(), headers, MAX_HEADER_BLOCK);
+    m_header_stream_id = 0;
+    m_header_block.clear();
+    if (!ok)
+    {
+        goaway(H2_COMPRESSION_ERROR);
+        return false;
+    }
+
+    if (m_streams.size() >= MAX_CONCURRENT_STREAMS)
+    {
+        write_rst_stream(stream_id, H2_REFUSED_STREAM);
+        return true;
+    }
+
+    // 每个流和HTTP/1.1的一个请求一样取一个令牌, 取不到回复429(REFUSED_STREAM会让客户端立刻重试)
+    stream_body body = {NULL, 0, NULL, NULL};
+    if (m_limit_slot >= 0 && !limiter.take_token(m_limit_slot))
+    {
+        respond(stream_id, http_conn::TOO_MANY_REQUESTS, body);
+        return true;
+    }
+
+    const std::string *method = NULL, *path = NULL;
+    for (size_t i = 0; i < headers.size(); ++i)
+    {
+        if (headers[i].name == ":method")
+        {
+            method = &headers[i].value;
+        }
+        else if (headers[i].name == ":path")
+        {
+            path = &headers[i].value;
+        }
+    }
+
+    // 和HTTP/1.1一样只支持GET; 查找的顺序也和HTTP/1.1一样: 路由表, 资源包, 内容缓存, 文件系统
+    int code = http_conn::BAD_REQUEST;
+    if (method && path && *method == "GET" && !path->empty() && (*path)[0] == '/')
+    {
+        code = http_conn::find_body(path->c_str(), body);
+    }
+    if (code == http_conn::HANDLER_REQUEST)
+    {
+        // 路由的处理函数(代理、流式响应、WebSocket等)只对接了HTTP/1.1, 让客户端换HTTP/1.1重发
+        write_rst_stream(stream_id, H2_HTTP_1_1_REQUIRED);
+        return true;
+    }
+    respond(stream_id, code, body);
+    return true;
+}
+
+bool h2_session::handle_settings(uint8_t flags, const uint8_t *payload, uint32_t len, bool from_frame)
+{
+    if (flags & FLAG_ACK)
+    {
+        if (len != 0)
+        {
+            goaway(H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+        return true;
+    }
+    if (len % 6 != 0)
+    {
+        goaway(H2_FRAME_SIZE_ERROR);
+        return false;
+    }
+    for (uint32_t i = 0; i < len; i += 6)
+    {
+        uint16_t id = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = get_u32(payload + i + 2);
+        switch (id)
+        {
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+            {
+                goaway(H2_PROTOCOL_ERROR);
+                return false;
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+        {
+            if (value > MAX_WINDOW)
+            {
+                goaway(H2_FLOW_CONTROL_ERROR);
+                return false;
+            }
+            // 新的初始窗口对所有已有的流生效, 只调整差值
+            int32_t delta = (int32_t)value - m_peer_initial_window;
+            m_peer_initial_window = value;
+            for (std::map<uint32_t, stream>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+            {
+                if ((int64_t)it->second.send_window + delta > MAX_WINDOW)
+                {
+                    goaway(H2_FLOW_CONTROL_ERROR);
+                    return false;
+                }
+                it->second.send_window += delta;
+                queue_stream(it->second);
+            }
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < DEFAULT_MAX_FRAME_SIZE || value > 0xffffff)
+            {
+                goaway(H2_PROTOCOL_ERROR);
+                return false;
+            }
+            m_peer_max_frame_size = value;
+            break;
+        default:
+            // 表大小只影响对端的解码器, 我们编码时不使用动态表; 未知设置忽略
+            break;
+        }
+    }
+    if (from_frame)
+    {
+        write_frame_header(0, FRAME_SETTINGS, FLAG_ACK, 0);
+    }
+    return true;
+}
+
+bool h2_session::handle_window_update(uint32_t stream_id, const uint8_t *payload, uint32_t len)
+{
+    if (len != 4)
+    {
+        goaway(H2_FRAME_SIZE_ERROR);
+        return false;
+    }
+    uint32_t increment = get_u32(payload) & 0x7fffffff;
+    if (increment == 0)
+    {
+        goaway(H2_PROTOCOL_ERROR);
+        return false;
+    }
+    if (stream_id == 0)
+    {
+        if (m_conn_send_window + (int64_t)increment > MAX_WINDOW)
+        {
+            goaway(H2_FLOW_CONTROL_ERROR);
+            return false;
+        }
+        m_conn_send_window += increment;
+        return true;
+    }
+    std::map<uint32_t, stream>::iterator it = m_streams.find(stream_id);
+    if (it == m_streams.end())
+    {
+        // 已经发完的流, 忽略
+        return true;
+    }
+    if (it->second.send_window + (int64_t)increment > MAX_WINDOW)
+    {
+        write_rst_stream(stream_id, H2_FLOW_CONTROL_ERROR);
+        close_stream(it);
+        return true;
+    }
+    it->second.send_window += increment;
+    queue_stream(it->second);
+    return true;
+}
+
+bool h2_session::can_respond(int code)
+{
+    switch (code)
+    {
+    case http_conn::FILE_REQUEST:
+    case http_conn::BAD_REQUEST:
+    case http_conn::FORBIDDEN_REQUEST:
+    case http_conn::NO_RESOURCE:
+    case http_conn::URI_TOO_LONG:
+    case http_conn::INTERNAL_ERROR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// 写出响应的HEADERS帧, 有响应体的流进入发送队列, code要满足can_respond
+void h2_session::respond(uint32_t stream_id, int code, const stream_body &file)
+{
+    const char *body = NULL;
+    size_t body_len = 0;
+    std::string block;
+
+    // :status 200/400/404/500 在静态表里有完整条目, 403/414/429只能用名字索引加字面量
+    switch (code)
+    {
+    case http_conn::FILE_REQUEST:
+        hpack_encode_indexed(block, 8);
+        body = file.data;
+        body_len = file.len;
+        break;
+    case http_conn::BAD_REQUEST:
+        hpack_encode_indexed(block, 12);
+        body = error_400_form.data;
+        body_len = error_400_form.size;
+        break;
+    case http_conn::FORBIDDEN_REQUEST:
+        hpack_encode_literal(block, 8, "403", 3);
+        body = error_403_form.data;
+        body_len = error_403_form.size;
+        break;
+    case http_conn::NO_RESOURCE:
+        hpack_encode_indexed(block, 13);
+        body = error_404_form.data;
+        body_len = error_404_form.size;
+        break;
+    case http_conn::URI_TOO_LONG:
+        hpack_encode_literal(block, 8, "414", 3);
+        body = error_414_form.data;
+        body_len = error_414_form.size;
+        break;
+    case http_conn::TOO_MANY_REQUESTS:
+        hpack_encode_literal(block, 8, "429", 3);
+        body = error_429_form.data;
+        body_len = error_429_form.size;
+        break;
+    default:
+        // INTERNAL_ERROR
+        hpack_encode_indexed(block, 14);
+        body = error_500_form.data;
+        body_len = error_500_form.size;
+        break;
+    }
+
+    char num[20];
+    hpack_encode_literal(block, 28, num, u64_to_dec(body_len, num));   // content-length
+    hpack_encode_literal(block, 31, "text/html", 9);                    // content-type
+    // date: 复用HTTP/1.1的缓存, 去掉 "Date: " 和结尾的 "\r\n"
+    response_piece date = date_header();
+    hpack_encode_literal(block, 33, date.data + 6, date.len - 8);
+
+    write_frame_header(block.size(), FRAME_HEADERS, FLAG_END_HEADERS | (body_len == 0 ? FLAG_END_STREAM : 0), stream_id);
+    m_out.append(block);
+
+    if (body_len == 0)
+    {
+        return;
+    }
+    stream &s = m_streams[stream_id];
+    s.id = stream_id;
+    s.send_window = m_peer_initial_window;
+    s.body = body;
+    s.body_len = body_len;
+    s.sent = 0;
+    s.file_address = code == http_conn::FILE_REQUEST ? file.file_address : NULL;
+    s.hold = code == http_conn::FILE_REQUEST ? file.hold : NULL;
+    s.queued = false;
+    queue_stream(s);
+}
+
+void h2_session::queue_stream(stream &s)
+{
+    if (!s.queued && s.send_window > 0)
+    {
+        s.queued = true;
+        m_ready.push_back(s.id);
+    }
+}
+
+void h2_session::close_stream(std::map<uint32_t, stream>::iterator it)
+{
+    if (it->second.file_address)
+    {
+        munmap(it->second.file_address, it->second.body_len);
+    }
+    // 如果还在m_ready中, pump()取出时会发现它已经不存在
+    m_streams.erase(it);
+}
+
+void h2_session::pump()
+{
+    // 升级的连接在收到客户端序言之前只发101、SETTINGS和流1的HEADERS,
+    // 客户端(例如curl)未必能缓存紧跟在101后面的大量数据
+    if (m_preface_pending)
+    {
+        return;
+    }
+    while (output_size() < OUTPUT_HIGH_WATER && m_conn_send_window > 0 && !m_ready.empty())
+    {
+        uint32_t id = m_ready.front();
+        m_ready.pop_front();
+        std::map<uint32_t, stream>::iterator it = m_streams.find(id);
+        if (it == m_streams.end())
+        {
+            continue;
+        }
+        stream &s = it->second;
+        s.queued = false;
+        if (s.send_window <= 0)
+        {
+            // 等WINDOW_UPDATE再放回队列
+            continue;
+        }
+
+        // 每次只给一个流发一帧, 然后排到队尾, 这样多个流交替前进
+        size_t n = s.body_len - s.sent;
+        if (n > m_peer_max_frame_size)
+            n = m_peer_max_frame_size;
+        if (n > (size_t)s.send_window)
+            n = s.send_window;
+        if (n > (size_t)m_conn_send_window)
+            n = m_conn_send_window;
+
+        bool last = s.sent + n == s.body_len;
+        write_frame_header(n, FRAME_DATA, last ? FLAG_END_STREAM : 0, id);
+        m_out.append(s.body + s.sent, n);
+        s.sent += n;
+        s.send_window -= n;
+        m_conn_send_window -= n;
+
+        if (last)
+        {
+            close_stream(it);
+        }
+        else
+        {
+            queue_stream(s);
+        }
+    }
+}
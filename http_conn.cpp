@@ -1,25 +1,40 @@
 #include "headers/http_conn.h"
 
-// 定义HTTP响应的一些状态信息
-const char *ok_200_title = "OK";
-const char *error_400_title = "Bad Request";
-const char *error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char *error_403_title = "Forbidden";
-const char *error_403_form = "You do not have permission to get file from this server.\n";
-const char *error_404_title = "Not Found";
-const char *error_404_form = "The requested file was not found on this server.\n";
-const char *error_500_title = "Internal Error";
-const char *error_500_form = "There was an unusual problem serving the requested file.\n";
-
-// 网站的根目录
-const char *doc_root = "/home/mal/Webserver/resources";
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+// 网站根目录, 启动时打开一次, 之后所有的文件都相对它查找
+int http_conn::m_root_fd = -1;
 
 // 所有的客户数
-int http_conn::m_user_count = 0;
+std::atomic<int> http_conn::m_user_count(0);
 
 // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
 int http_conn::m_epollfd = -1;
 
+// 动态内容的路由表, 为空时所有请求都是静态文件
+router *http_conn::m_router = NULL;
+
+http_conn::MODEL http_conn::m_model = http_conn::MODEL_REACTOR;
+
+// 读写缓冲区的大小, main按配置设置, 之后不再改变
+int http_conn::m_read_buffer_size = 2048;
+int http_conn::m_write_buffer_size = 1024;
+
+// 反应堆模式下工作线程把生成好响应的连接交还给主线程, 由main创建
+ready_queue<http_conn> *http_conn::m_ready = NULL;
+
+// 客户端socket上的epoll_ctl次数和处理的请求数, /status 里输出, 用来看每个请求的系统调用开销
+std::atomic<uint64_t> http_conn::m_epoll_ctls(0);
+std::atomic<uint64_t> http_conn::m_requests(0);
+
+// 连接的序号, 抓取请求时区分连接
+std::atomic<uint32_t> http_conn::m_conn_count(0);
+
+threadpool<prefetch_request> *http_conn::m_prefetch_pool = NULL;
+ready_queue<http_conn> *http_conn::m_prefetched = NULL;
+std::atomic<uint64_t> http_conn::m_prefetches(0);
+
 ///设置文件描述符非阻塞
 int setnonblocking(int fd)
 {
@@ -53,6 +68,7 @@ void addfd(int epollfd, int fd, bool one_shot)
 
 
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    http_conn::m_epoll_ctls.fetch_add(1, std::memory_order_relaxed);
     
     // 设置文件描述符非阻塞
     setnonblocking(fd);
@@ -73,6 +89,7 @@ void modfd(int epollfd, int fd, int ev)
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
     // 修改epoll上这个事件的状态
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+    http_conn::m_epoll_ctls.fetch_add(1, std::memory_order_relaxed);
 }
 
 // 关闭连接
@@ -80,24 +97,78 @@ void http_conn::close_conn()
 {
     if (m_sockfd != -1)
     {
-        ///移除文件描述符
-        removefd(m_epollfd, m_sockfd);
+        WS_PROBE1(close, m_sockfd);
+        // 不用EPOLL_CTL_DEL: socket没有dup过, close时内核自动把它从epoll里删掉
+        // 清理完再close: 工作线程关闭连接时, fd一旦close就可能被主线程accept复用
+        int fd = m_sockfd;
 
         ///socket文件描述符赋值为-1        
         m_sockfd = -1;
 
+        // 协程模型: 挂起在等待上的协程连同它的帧一起销毁(协程自己结束时由resume销毁, 不会走到这里)
+        if (m_coro)
+        {
+            m_coro.destroy();
+            m_coro = nullptr;
+        }
+        // HTTP/2会话里还映射着各个流的文件
+        delete m_h2;
+        m_h2 = NULL;
+        delete m_ws;
+        m_ws = NULL;
+        delete m_ws_handler;
+        m_ws_handler = NULL;
+        // 先退订再close: 发布者持有频道的锁时可能正要唤醒这个连接
+        if (m_sse)
+        {
+            m_sse->channel->unsubscribe(m_sse);
+            delete m_sse;
+            m_sse = NULL;
+        }
+        m_sse_channel.reset();
+        delete m_tls;
+        m_tls = NULL;
+        delete m_consumer;
+        m_consumer = NULL;
+        delete m_stream;
+        m_stream = NULL;
+        delete m_proxy;
+        m_proxy = NULL;
+        m_pack.reset();
+        m_cached.reset();
+        limiter.release_conn(m_limit_slot);
+        m_limit_slot = client_limiter::NO_SLOT;
+
         m_user_count--; // 关闭一个连接，将客户总数量-1
+        close(fd);
     }
 }
 
 // 初始化连接,外部调用初始化套接字地址
-void http_conn::init(int sockfd, const sockaddr_in &addr)
+void http_conn::init(int sockfd, const sockaddr_in &addr, bool tls, int limit_slot, const ucred *cred)
 {
     ///设置socket文件描述符
     m_sockfd = sockfd;
 
     ///设置socket地址
     m_address = addr;
+    m_limit_slot = limit_slot;
+    m_unix = cred != NULL;
+    if (cred)
+    {
+        m_peer_cred = *cred;
+    }
+
+    // 新连接总是从HTTP/1.1开始, 收到h2c序言或升级请求后才切换
+    m_h2 = NULL;
+    m_ws = NULL;
+    m_ws_handler = NULL;
+    m_sse = NULL;
+    m_tls = NULL;
+    m_consumer = NULL;
+    m_stream = NULL;
+    m_proxy = NULL;
+    m_file_address = 0;
 
     // 端口复用
     int reuse = 1;
@@ -109,10 +180,28 @@ void http_conn::init(int sockfd, const sockaddr_in &addr)
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     ///向epoll中添加新的socket描述符
+    if (!m_read_buf)
+    {
+        m_read_buf = new char[m_read_buffer_size];
+        m_write_buf = new char[m_write_buffer_size];
+    }
     addfd(m_epollfd, sockfd, true);
+    m_armed = EPOLLIN;
+    m_conn_id = m_conn_count.fetch_add(1, std::memory_order_relaxed);
+    trace(TRACE_ACCEPT);
     // 客户总数++
     m_user_count++;
     init();
+
+    // TLS连接先握手, 第一个EPOLLIN交给工作线程调用SSL_accept
+    if (tls)
+    {
+        m_tls = new tls_conn;
+        if (!m_tls->attach(sockfd))
+        {
+            close_conn();
+        }
+    }
 }
 
 void http_conn::init()
@@ -130,10 +219,47 @@ void http_conn::init()
     m_url = 0;
     // HTTP版本号
     m_version = 0;
-    // 请求消息的长度
+    // 请求体
     m_content_length = 0;
+    m_chunked = false;
+    m_body_left = 0;
+    m_chunk_decoder.reset();
+    delete m_consumer;
+    m_consumer = NULL;
+    // 分块响应
+    delete m_stream;
+    m_stream = NULL;
+    delete m_proxy;
+    m_proxy = NULL;
+    // 资源包
+    m_accept_gzip = false;
+    m_if_none_match = 0;
+    m_pack.reset();
+    m_cached.reset();
+    m_pack_entry = NULL;
+    m_pack_gzip = false;
+    m_body_mapped = false;
+    m_prefetching = false;
+    m_prefetch_done = false;
+    // 路由
+    m_route_ret = NO_REQUEST;
+    m_headers_start = 0;
+    m_headers_end = 0;
     // 主机名
     m_host = 0;
+    // h2c升级请求
+    m_upgrade_h2c = false;
+    // WebSocket握手, 没能切换过去的处理者在这里释放
+    m_upgrade_ws = false;
+    m_ws_key = 0;
+    m_ws_version = 0;
+    delete m_ws_handler;
+    m_ws_handler = NULL;
+    m_sse_channel.reset();
+    // 连接的accept时间留给第一个请求, 其余阶段每个请求重新记
+    memset(m_trace.tsc + TRACE_FIRST_READ, 0, sizeof(m_trace.tsc) - sizeof(m_trace.tsc[0]));
+    m_trace.bytes = 0;
+    m_h2_settings = 0;
     // 解析行的起始位置
     m_start_line = 0;
     // 当前解析到哪了
@@ -142,26 +268,41 @@ void http_conn::init()
     m_read_idx = 0;
     // 待发送的字节数
     m_write_idx = 0;
-    // 清空读写缓冲区和路径
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+    // 清空读写缓冲区
+    bzero(m_read_buf, m_read_buffer_size);
+    bzero(m_write_buf, m_write_buffer_size);
 }
 
 // 通过recv循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read()
 {
-    // 读缓冲区放不下了
-    if (m_read_idx >= READ_BUFFER_SIZE)
+    if (m_tls && !m_tls->established())
     {
-        return false;
+        // 还在握手, 交给工作线程
+        return true;
+    }
+    if (m_h2)
+    {
+        return read_h2();
+    }
+    if (m_ws)
+    {
+        return read_ws();
+    }
+
+    // 读缓冲区放不下了: 请求头太长就断开; 接收请求体时是消费者还没跟上, 先不读,
+    // 数据留在内核的接收缓冲区里, 工作线程腾出空间后重新注册EPOLLIN
+    if (m_read_idx >= m_read_buffer_size)
+    {
+        return m_check_state == CHECK_STATE_CONTENT;
     }
+    int start_idx = m_read_idx;
     int bytes_read = 0;///每次实际读到了多少
     while (true)
     {
-        // 从m_read_buf + m_read_idx索引处开始保存数据，大小是READ_BUFFER_SIZE - m_read_idx
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx,
-                          READ_BUFFER_SIZE - m_read_idx, 0);
+        // 从m_read_buf + m_read_idx索引处开始保存数据，大小是m_read_buffer_size - m_read_idx
+        bytes_read = sock_read(m_read_buf + m_read_idx,
+                               m_read_buffer_size - m_read_idx);
         // 发生了一些错误
         if (bytes_read == -1)
         {
@@ -179,10 +320,105 @@ bool http_conn::read()
         }
         // 偏移
         m_read_idx += bytes_read;
+
+        // 带先验知识的h2c: 收到完整的序言就切换, 之后的字节直接交给会话, 不受读缓冲区大小限制
+        if (m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == 0 && m_read_idx >= h2_session::PREFACE_LEN
+            && memcmp(m_read_buf, h2_session::PREFACE, h2_session::PREFACE_LEN) == 0)
+        {
+            m_h2 = new h2_session(m_limit_slot);
+            m_h2->start();
+            m_h2->feed(m_read_buf, m_read_idx);
+            m_read_idx = 0;
+            return read_h2();
+        }
+        if (m_read_idx >= m_read_buffer_size)
+        {
+            break;
+        }
+    }
+    WS_PROBE2(read, m_sockfd, m_read_idx - start_idx);
+    if (m_read_idx > start_idx && !m_trace.tsc[TRACE_FIRST_READ])
+    {
+        trace(TRACE_FIRST_READ);
+    }
+    return true;
+}
+
+// HTTP/2连接: 读缓冲区只做中转, 收到的字节都交给会话
+bool http_conn::read_h2()
+{
+    while (true)
+    {
+        int bytes_read = sock_read(m_read_buf, m_read_buffer_size);
+        if (bytes_read == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return false;
+        }
+        else if (bytes_read == 0)
+        {
+            return false;
+        }
+        if (!m_h2->feed(m_read_buf, bytes_read))
+        {
+            return false;
+        }
     }
     return true;
 }
 
+// 从socket读, TLS连接经过tls_conn解密(kTLS时也是直接recv)
+int http_conn::sock_read(char *buf, int len)
+{
+    if (m_tls)
+    {
+        return m_tls->read(buf, len);
+    }
+    return recv(m_sockfd, buf, len, 0);
+}
+
+int http_conn::sock_writev(const struct iovec *iov, int iovcnt)
+{
+    int ret = m_tls ? m_tls->writev(iov, iovcnt) : writev(m_sockfd, iov, iovcnt);
+    WS_PROBE2(writev, m_sockfd, ret);
+    return ret;
+}
+
+// 继续TLS握手, 返回true表示握手完成并且已经读到了数据, 可以接着解析请求
+// 其余情况下已经重新注册了事件或者关闭了连接
+bool http_conn::tls_handshake()
+{
+    switch (m_tls->handshake())
+    {
+    case tls_conn::HS_DONE:
+        // 客户端可能把请求和握手的最后一个消息一起发了过来, 已经被OpenSSL读进了缓冲区,
+        // 这部分数据不会再触发EPOLLIN, 所以这里直接读
+        if (!read())
+        {
+            close_conn();
+            return false;
+        }
+        if (!m_h2 && m_read_idx == 0)
+        {
+            rearm(EPOLLIN);
+            return false;
+        }
+        return true;
+    case tls_conn::HS_WANT_READ:
+        rearm(EPOLLIN);
+        return false;
+    case tls_conn::HS_WANT_WRITE:
+        rearm(EPOLLOUT);
+        return false;
+    default:
+        close_conn();
+        return false;
+    }
+}
+
 // 解析一行，判断依据\r\n
 http_conn::LINE_STATUS http_conn::parse_line()
 {
@@ -249,6 +485,14 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
         // 忽略大小写比较
         m_method = GET;
     }
+    else if (strcasecmp(method, "POST") == 0)
+    {
+        m_method = POST;
+    }
+    else if (strcasecmp(method, "PUT") == 0)
+    {
+        m_method = PUT;
+    }
     else
     {
         return BAD_REQUEST;
@@ -283,6 +527,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     }
     // 请求第一行结束,检查状态变成检查头
     m_check_state = CHECK_STATE_HEADER;
+    m_headers_start = m_checked_idx;
     // 还没有解析完,继续解析
     return NO_REQUEST;
 }
@@ -293,18 +538,61 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
     // 遇到空行，表示头部字段解析完毕
     if (text[0] == '\0')
     {
+        if (capture.enabled())
+        {
+            int flags = (m_accept_gzip ? CAPTURE_GZIP : 0) | (m_linger ? CAPTURE_KEEP_ALIVE : 0)
+                      | (m_chunked ? CAPTURE_CHUNKED : 0) | (m_tls ? CAPTURE_TLS : 0);
+            capture.record(m_conn_id, m_method, flags, m_content_length, m_url, strlen(m_url),
+                           m_if_none_match, m_if_none_match ? strlen(m_if_none_match) : 0);
+        }
         // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
         // 状态机转移到CHECK_STATE_CONTENT状态
 
+        // 同时给出两种长度可能被用来做请求走私, 直接拒绝
+        if (m_chunked && m_content_length != 0)
+        {
+            m_linger = false;
+            return BAD_REQUEST;
+        }
         // 存在消息体
-        if (m_content_length != 0)
+        if (m_content_length != 0 || m_chunked)
         {
+            // 请求头还要留在读缓冲区里(m_url等指向它), 请求体只能用剩下的空间; 剩得太少时
+            // 每次只能搬几个字节, 一点不剩时读不进来也交不出去, 主线程和工作线程会一直空转
+            if (m_read_buffer_size - m_checked_idx < MIN_BODY_ROOM)
+            {
+                m_linger = false;
+                return HEADERS_TOO_LARGE;
+            }
             // 转移到解析消息体
             m_check_state = CHECK_STATE_CONTENT;
+            m_body_left = m_content_length;
+            m_headers_end = text - m_read_buf;
+            // 先查路由: 处理函数给出请求体的消费者, 或者在请求体读完之后直接使用它的响应
+            m_route_ret = route_request();
+            // 代理的请求体由处理函数给出的消费者转发
+            if (m_route_ret != BODY_REQUEST && m_route_ret != PROXY_REQUEST)
+            {
+                if (m_route_ret != HANDLER_REQUEST && m_route_ret != STREAM_REQUEST && m_route_ret != FILE_REQUEST
+                    && m_route_ret != PACK_REQUEST && m_route_ret != NOT_MODIFIED)
+                {
+                    // 请求体还没读, 回复错误后关闭连接
+                    m_linger = false;
+                    return m_route_ret;
+                }
+                // 处理函数不关心请求体, 读完丢掉
+                m_consumer = new discard_consumer;
+            }
             // 返回解析未结束
             return NO_REQUEST;
         }
+        // POST/PUT必须带请求体
+        if (m_method != GET)
+        {
+            return BAD_REQUEST;
+        }
         // 否则说明我们已经得到了一个完整的HTTP请求
+        m_headers_end = text - m_read_buf;
         return GET_REQUEST;
     }
     else if (strncasecmp(text, "Connection:", 11) == 0)
@@ -324,8 +612,69 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
         text += 15;
         text += strspn(text, " \t");
 
-        // 消息体长度
-        m_content_length = atol(text);
+        // 消息体长度, 只接受十进制数字
+        char *end;
+        errno = 0;
+        m_content_length = strtoll(text, &end, 10);
+        if (end == text || *end != '\0' || m_content_length < 0 || errno == ERANGE)
+        {
+            m_linger = false;
+            return BAD_REQUEST;
+        }
+    }
+    else if (strncasecmp(text, "Transfer-Encoding:", 18) == 0)
+    {
+        // 只支持 Transfer-Encoding: chunked
+        text += 18;
+        text += strspn(text, " \t");
+        if (strcasecmp(text, "chunked") != 0)
+        {
+            m_linger = false;
+            return BAD_REQUEST;
+        }
+        m_chunked = true;
+    }
+    else if (strncasecmp(text, "Upgrade:", 8) == 0)
+    {
+        // 处理Upgrade头部字段, 只认h2c和websocket  Upgrade: h2c
+        text += 8;
+        text += strspn(text, " \t");
+        if (strcasecmp(text, "h2c") == 0)
+        {
+            m_upgrade_h2c = true;
+        }
+        else if (strcasecmp(text, "websocket") == 0)
+        {
+            m_upgrade_ws = true;
+        }
+    }
+    else if (strncasecmp(text, "Sec-WebSocket-Key:", 18) == 0)
+    {
+        text += 18;
+        text += strspn(text, " \t");
+        m_ws_key = text;
+    }
+    else if (strncasecmp(text, "Sec-WebSocket-Version:", 22) == 0)
+    {
+        m_ws_version = atoi(text + 22);
+    }
+    else if (strncasecmp(text, "HTTP2-Settings:", 15) == 0)
+    {
+        // h2c升级时客户端的SETTINGS, base64url编码
+        text += 15;
+        text += strspn(text, " \t");
+        m_h2_settings = text;
+    }
+    else if (strncasecmp(text, "Accept-Encoding:", 16) == 0)
+    {
+        // 资源包里有预先压缩好的gzip版本
+        m_accept_gzip = strstr(text + 16, "gzip") != NULL;
+    }
+    else if (strncasecmp(text, "If-None-Match:", 14) == 0)
+    {
+        text += 14;
+        text += strspn(text, " \t");
+        m_if_none_match = text;
     }
     else if (strncasecmp(text, "Host:", 5) == 0)
     {
@@ -342,15 +691,49 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
 // 事实上就是把connection, content-length, host都判断一下, 然后把相应的信息存起来    
 }
 
-// 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content(char *text)
+// 把读缓冲区中已经收到的请求体交给消费者, 交出去的字节从缓冲区里移走, 腾出空间继续读
+// 请求头(m_url等指针指向的内容)在m_checked_idx之前, 不受影响
+http_conn::HTTP_CODE http_conn::parse_content()
 {
-    if (m_read_idx >= (m_content_length + m_checked_idx))
+    char *data = m_read_buf + m_checked_idx;
+    size_t avail = m_read_idx - m_checked_idx;
+    size_t used = 0;
+    bool done;
+    if (m_chunked)
     {
-        text[m_content_length] = '\0';
-        return GET_REQUEST;
+        chunked_decoder::RESULT r = m_chunk_decoder.feed(data, avail, used, m_consumer);
+        if (r == chunked_decoder::BAD_CHUNK)
+        {
+            // 不知道请求在哪里结束, 这个连接不能再用了
+            m_linger = false;
+            return BAD_REQUEST;
+        }
+        if (r == chunked_decoder::CONSUMER_ERROR)
+        {
+            m_linger = false;
+            return INTERNAL_ERROR;
+        }
+        done = r == chunked_decoder::DONE;
     }
-    return NO_REQUEST;
+    else
+    {
+        used = avail < (size_t)m_body_left ? avail : (size_t)m_body_left;
+        if (used > 0 && !m_consumer->on_data(data, used))
+        {
+            m_linger = false;
+            return INTERNAL_ERROR;
+        }
+        m_body_left -= used;
+        done = m_body_left == 0;
+    }
+    memmove(data, data + used, avail - used);
+    m_read_idx -= used;
+    if (!done)
+    {
+        return NO_REQUEST;
+    }
+    // 响应在读请求头的时候已经决定了
+    return m_route_ret;
 }
 
 // 主状态机，解析请求
@@ -366,6 +749,12 @@ http_conn::HTTP_CODE http_conn::process_read()
     while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK)) 
             || ((line_status = parse_line()) == LINE_OK))
     {
+        // 请求体不按行解析
+        if (m_check_state == CHECK_STATE_CONTENT)
+        {
+            return parse_content();
+        }
+
         // 获取一行数据
         text = get_line();
 
@@ -389,25 +778,15 @@ http_conn::HTTP_CODE http_conn::process_read()
             {
                 // 当前状态是请求头部
                 ret = parse_headers(text);
-                if (ret == BAD_REQUEST)
-                {
-                    return BAD_REQUEST;
-                }
-                else if (ret == GET_REQUEST)// 没有请求体, 已经获取了完整请求
+                if (ret == GET_REQUEST)// 没有请求体, 已经获取了完整请求
                 {
-                    return do_request();
+                    return route_request();
                 }
-                break;
-            }
-            case CHECK_STATE_CONTENT:
-            {
-                ret = parse_content(text);// 解析请求体
-                if (ret == GET_REQUEST)
+                else if (ret != NO_REQUEST)
                 {
-                    return do_request();
+                    // 请求有问题, 或者路由在请求体到达之前就决定了错误响应
+                    return ret;
                 }
-                // 说明行数据还不完整
-                line_status = LINE_OPEN;
                 break;
             }
             default:
@@ -421,277 +800,964 @@ http_conn::HTTP_CODE http_conn::process_read()
     return NO_REQUEST;
 }
 
-// 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
-// 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
-// 映射到内存地址m_file_address处，并告诉调用者获取文件成功
-http_conn::HTTP_CODE http_conn::do_request()
+// 查路由表, 有匹配的路由就调用处理函数, 否则作为静态文件处理
+http_conn::HTTP_CODE http_conn::route_request()
 {
-    // 把根目录复制到目标文件目录里
-    strcpy(m_real_file, doc_root);
-    
-
-    int len = strlen(doc_root);
-    // 在根目录后面加上用户请求的路径
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if (stat(m_real_file, &m_file_stat) < 0)
+    const char *query = strchr(m_url, '?');
+    size_t path_len = query ? query - m_url : strlen(m_url);
+    const route *r = m_router ? m_router->match(m_url, path_len) : NULL;
+    if (!r)
     {
-        // 获取失败
-        return NO_RESOURCE;
+        // 静态文件只支持GET
+        if (m_method != GET)
+        {
+            return METHOD_NOT_ALLOWED;
+        }
+        // 加载了资源包时只从包里找, 不再访问文件系统
+        m_pack = asset_pack::current();
+        return m_pack ? pack_request(path_len) : do_request();
     }
-
-    // 判断访问权限
-    // S_IROTH是其他组的读权限
-    if (!(m_file_stat.st_mode & S_IROTH))
+    if (!(r->methods & (1u << m_method)))
     {
-        // 不可访问
-        return FORBIDDEN_REQUEST;
+        return METHOD_NOT_ALLOWED;
     }
 
-    // 判断是否是目录
-    if (S_ISDIR(m_file_stat.st_mode))
+    request_view req;
+    req.method = m_method;
+    req.path = m_url;
+    req.path_len = path_len;
+    req.rest = m_url + r->prefix_len;
+    req.rest_len = path_len - r->prefix_len;
+    req.query = query ? query + 1 : NULL;
+    req.host = m_host;
+    req.peer = &m_address;
+    req.cred = m_unix ? &m_peer_cred : NULL;
+    req.content_length = m_content_length;
+    req.chunked = m_chunked;
+    req.keep_alive = m_linger;
+    req.headers = m_read_buf + m_headers_start;
+    req.headers_end = m_read_buf + m_headers_end;
+
+    m_response.body.clear();
+    m_response.stream = NULL;
+    m_response.consumer = NULL;
+    m_response.proxy = NULL;
+    m_response.websocket = NULL;
+    m_response.sse.reset();
+    ROUTE_RESULT ret = r->handler(req, m_response);
+    // 生成者, 消费者, 代理和WebSocket处理者交给连接管理
+    m_stream = m_response.stream ? new chunked_writer(m_response.stream) : NULL;
+    m_consumer = m_response.consumer;
+    m_proxy = m_response.proxy;
+    m_ws_handler = m_response.websocket;
+    if (ret != ROUTE_OK && m_proxy)
+    {
+        // 转发失败时回复错误页面, 不再从上游取响应
+        delete m_proxy;
+        m_proxy = NULL;
+    }
+    if (m_ws_handler && (ret != ROUTE_OK || !valid_ws_handshake()))
+    {
+        delete m_ws_handler;
+        m_ws_handler = NULL;
+        if (ret == ROUTE_OK)
+        {
+            m_linger = false;
+            return BAD_REQUEST;
+        }
+    }
+    switch (ret)
     {
+    case ROUTE_OK:
+        break;
+    case ROUTE_BAD_REQUEST:
         return BAD_REQUEST;
+    case ROUTE_FORBIDDEN:
+        return FORBIDDEN_REQUEST;
+    case ROUTE_NOT_FOUND:
+        return NO_RESOURCE;
+    case ROUTE_BAD_GATEWAY:
+        return BAD_GATEWAY;
+    default:
+        return INTERNAL_ERROR;
     }
-
-    // 以只读方式打开文件
-    int fd = open(m_real_file, O_RDONLY);
-    // 创建内存映射
-    // 映射区域可读, 私人的写时拷贝, 想要映射的文件描述符, 偏移量0
-    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    return FILE_REQUEST;
+    if (m_proxy)
+    {
+        return PROXY_REQUEST;
+    }
+    if (m_ws_handler)
+    {
+        return WEBSOCKET_REQUEST;
+    }
+    if (m_response.sse)
+    {
+        m_sse_channel = std::move(m_response.sse);
+        m_linger = false;
+        return SSE_REQUEST;
+    }
+    if (m_stream)
+    {
+        return STREAM_REQUEST;
+    }
+    return m_consumer ? BODY_REQUEST : HANDLER_REQUEST;
 }
 
-// 对内存映射区执行munmap操作
-void http_conn::unmap()
+// 在资源包里查找静态文件, 目录和文件系统模式一样回复400
+http_conn::HTTP_CODE http_conn::pack_request(size_t path_len)
 {
-    // 如果内存地址存在
-    if (m_file_address)
+    const pack_entry *e = m_pack->find(m_url, path_len);
+    if (!e)
     {
-        // 取消文件映射
-        munmap(m_file_address, m_file_stat.st_size);
-        // 恢复文件映射的地址
-        m_file_address = 0;
+        return NO_RESOURCE;
+    }
+    if (e->flags & PACK_DIR)
+    {
+        return BAD_REQUEST;
+    }
+    m_pack_entry = e;
+    if (m_if_none_match && (strcmp(m_if_none_match, "*") == 0
+        || memmem(m_if_none_match, strlen(m_if_none_match), m_pack->at(e->etag_off), e->etag_len)))
+    {
+        return NOT_MODIFIED;
     }
+    m_pack_gzip = m_accept_gzip && e->gzip_len > 0;
+    return PACK_REQUEST;
 }
 
-// 写HTTP响应
-bool http_conn::write()
+// 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
+// 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
+// 映射到内存地址m_file_address处，并告诉调用者获取文件成功
+http_conn::HTTP_CODE http_conn::do_request()
 {
-    int temp = 0;
+    WS_PROBE1(lookup, m_sockfd);
+    // 要升级到HTTP/2的请求把文件映射交给流1, 不走缓存
+    HTTP_CODE ret = lookup_file(m_url, &m_file_stat, &m_file_address, m_cached, !m_upgrade_h2c);
+    WS_PROBE3(lookup_done, m_sockfd, ret, ret == FILE_REQUEST ? m_file_stat.st_size : 0);
+    return ret;
+}
 
-    if (bytes_to_send == 0)
+http_conn::HTTP_CODE http_conn::lookup_file(const char *url, struct stat *st, char **address,
+                                            std::shared_ptr<const cached_body> &cached, bool use_cache)
+{
+    if (!use_cache || !content_cache.enabled())
     {
-        // 将要发送的字节为0，这一次响应结束。
-
-        // 重置epollin, 并且重新初始化http请求
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init();
-        return true;
+        return map_file(url, st, address);
     }
-
-    while (1)
+    // 缓存里的文件都是经过open_file打开的, 命中时只用fstatat确认还是同一个文件, 不再打开
+    const char *rel = relative_path(url);
+    if (strlen(url) <= MAX_PATH_LEN && fstatat(m_root_fd, rel, st, 0) == 0
+        && S_ISREG(st->st_mode) && (st->st_mode & S_IROTH) && st->st_size > 0)
     {
-        // 聚集写
-        // 写缓冲和请求的文件信息一起写进去
-        temp = writev(m_sockfd, m_iv, m_iv_count);
-        if (temp <= -1)
-        {
-            // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
-            // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
-            if (errno == EAGAIN)
-            {
-                // 等待EPOLLOUT事件(等待可写)
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
-                return true;
-            }
-            // 这里是出错了, 解除内存映射
-            unmap();
-            return false;
-        }
-        // 等待发送的字符个数-=temp
-        bytes_to_send -= temp;
-        // 已经发送的字符个数+=temp
-        bytes_have_send += temp;
-
-        // 如果请求头已经发送完毕
-        if(bytes_have_send >= m_iv[0].iov_len)
-        {
-            // 请求头归零
-            m_iv[0].iov_len = 0;
-            // 文件可能也已经发送了一部分
-            // 更新新的文件地址
-            m_iv[1].iov_base = m_file_address + (bytes_have_send-m_write_idx);
-            // 更新新的文件长度为待发送长度
-            m_iv[1].iov_len = bytes_to_send;
-        }
-        else
+        cached = content_cache.lookup(rel, *st);
+    }
+    HTTP_CODE ret = FILE_REQUEST;
+    int fd;
+    if (!cached && (ret = open_file(url, st, &fd)) == FILE_REQUEST)
+    {
+        if (content_cache.worth_loading(rel, st->st_size))
         {
-            // 更新新的地址
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            // 新的文件长度需要减去当前一次发送的文件长度
-            m_iv[0].iov_len -= temp;
+            cached = content_cache.load(fd, rel, *st);
         }
-
-        if (bytes_to_send <= 0)
+        if (!cached)
         {
-            // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
-            unmap();
-            // 发送(写)完了, 等待可读事件
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
-
-            if (m_linger)
-            {
-                init();
-                return true;
-            }
-            else
-            {
-                return false;
-            }
+            ret = map_fd(fd, *st, address);
         }
+        close(fd);
     }
-    return false;
+    return ret;
 }
 
-// 往写缓冲中写入待发送的数据
-bool http_conn::add_response(const char *format, ...)
+http_conn::HTTP_CODE http_conn::find_body(const char *url, stream_body &body)
 {
-    // 如果需要写的东西超过了写缓冲区的大小, 写入失败
-    if (m_write_idx >= WRITE_BUFFER_SIZE)
+    size_t path_len = strcspn(url, "?");
+    if (m_router && m_router->match(url, path_len))
+    {
+        return HANDLER_REQUEST;
+    }
+    std::shared_ptr<asset_pack> pack = asset_pack::current();
+    if (pack)
+    {
+        const pack_entry *e = pack->find(url, path_len);
+        if (!e)
+        {
+            return NO_RESOURCE;
+        }
+        if (e->flags & PACK_DIR)
+        {
+            return BAD_REQUEST;
+        }
+        body.data = pack->at(e->body_off);
+        body.len = e->body_len;
+        body.hold = pack;
+        return FILE_REQUEST;
+    }
+    struct stat st;
+    std::shared_ptr<const cached_body> cached;
+    HTTP_CODE ret = lookup_file(url, &st, &body.file_address, cached, true);
+    if (ret != FILE_REQUEST)
+    {
+        return ret;
+    }
+    if (cached)
+    {
+        body.data = cached->data;
+        body.len = cached->size;
+        body.hold = cached;
+    }
+    else
+    {
+        body.data = body.file_address;
+        body.len = st.st_size;
+    }
+    return FILE_REQUEST;
+}
+
+bool http_conn::open_root(const char *dir)
+{
+    m_root_fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    return m_root_fd >= 0;
+}
+
+// "/a/b" -> "a/b", "/" -> "."
+const char *http_conn::relative_path(const char *url)
+{
+    while (*url == '/')
+    {
+        ++url;
+    }
+    return *url ? url : ".";
+}
+
+// 内核不支持openat2时的退路: 只能按字面拒绝"..", 挡不住指向根目录外面的符号链接
+static bool has_dotdot(const char *path)
+{
+    for (const char *p = path; (p = strstr(p, "..")) != NULL; p += 2)
+    {
+        if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+http_conn::HTTP_CODE http_conn::open_file(const char *url, struct stat *st, int *fd)
+{
+    if (strlen(url) > MAX_PATH_LEN)
+    {
+        return URI_TOO_LONG;
+    }
+    const char *rel = relative_path(url);
+
+    // 相对于根目录逐级解析, ".."、绝对路径的符号链接和/proc下的魔术链接都不能离开根目录
+    // O_NONBLOCK: 打开FIFO时不会卡住
+    static bool no_openat2 = false;
+    int f = -1;
+    if (!no_openat2)
+    {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        f = syscall(SYS_openat2, m_root_fd, rel, &how, sizeof(how));
+        if (f < 0 && errno == ENOSYS)
+        {
+            no_openat2 = true;
+        }
+    }
+    if (no_openat2)
+    {
+        if (has_dotdot(rel))
+        {
+            return FORBIDDEN_REQUEST;
+        }
+        f = openat(m_root_fd, rel, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    }
+    if (f < 0)
+    {
+        switch (errno)
+        {
+        case ENAMETOOLONG:
+            return URI_TOO_LONG;
+        // EXDEV: 路径想要离开根目录
+        case EACCES:
+        case EPERM:
+        case EXDEV:
+        case ELOOP:
+            return FORBIDDEN_REQUEST;
+        default:
+            return NO_RESOURCE;
+        }
+    }
+
+    if (fstat(f, st) < 0)
+    {
+        close(f);
+        return NO_RESOURCE;
+    }
+    // 判断访问权限
+    // S_IROTH是其他组的读权限
+    if (!(st->st_mode & S_IROTH))
+    {
+        // 不可访问
+        close(f);
+        return FORBIDDEN_REQUEST;
+    }
+
+    // 判断是否是目录
+    if (S_ISDIR(st->st_mode))
+    {
+        close(f);
+        return BAD_REQUEST;
+    }
+    // FIFO、socket、设备文件: st_size没有意义, 也不能mmap
+    if (!S_ISREG(st->st_mode))
+    {
+        close(f);
+        return FORBIDDEN_REQUEST;
+    }
+    *fd = f;
+    return FILE_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::map_fd(int fd, const struct stat &st, char **address)
+{
+    *address = 0;
+    if (st.st_size == 0)
+    {
+        return FILE_REQUEST;
+    }
+    // 创建内存映射
+    // 映射区域可读, 私人的写时拷贝, 想要映射的文件描述符, 偏移量0
+    char *addr = (char *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        return INTERNAL_ERROR;
+    }
+    *address = addr;
+    return FILE_REQUEST;
+}
+
+// 把url映射成doc_root下的文件并mmap
+// 空文件不做映射, address置为0
+http_conn::HTTP_CODE http_conn::map_file(const char *url, struct stat *st, char **address)
+{
+    int fd;
+    HTTP_CODE ret = open_file(url, st, &fd);
+    if (ret != FILE_REQUEST)
+    {
+        return ret;
+    }
+    ret = map_fd(fd, *st, address);
+    close(fd);
+    return ret;
+}
+
+// 对内存映射区执行munmap操作
+void http_conn::unmap()
+{
+    // 如果内存地址存在
+    if (m_file_address)
+    {
+        // 取消文件映射
+        munmap(m_file_address, m_file_stat.st_size);
+        // 恢复文件映射的地址
+        m_file_address = 0;
+    }
+    m_cached.reset();
+}
+
+// 主线程在把连接交给线程池之前调用(一次完成模式下在工作线程读完之后): 新请求的第一批数据要先取到令牌,
+// 取不到就直接回复429并关闭, 不进入线程池
+bool http_conn::admit_request()
+{
+    if (!over_limit())
+    {
+        return true;
+    }
+    m_linger = false;
+    // 响应很短, 直接写, 写完write返回false关闭连接
+    if (!process_write(TOO_MANY_REQUESTS) || !write())
+    {
+        close_conn();
+    }
+    return false;
+}
+
+bool http_conn::over_limit()
+{
+    if (m_limit_slot < 0 || m_h2 || m_ws || (m_tls && !m_tls->established())
+        || m_check_state != CHECK_STATE_REQUESTLINE || m_checked_idx != 0)
     {
         return false;
     }
+    return !limiter.take_token(m_limit_slot);
+}
 
-    // 定义可变参数列表
-    va_list arg_list;
-    // 通过format(可变参数...的前一个)初始化arg_list指针
-    va_start(arg_list, format);
+void http_conn::advance(int n)
+{
+    // 等待发送的字符个数-=n
+    bytes_to_send -= n;
+    // 已经发送的字符个数+=n
+    bytes_have_send += n;
+    m_trace.bytes += n;
+
+    // 如果请求头已经发送完毕
+    if(bytes_have_send >= (int)m_iv[0].iov_len)
+    {
+        // 请求头归零
+        m_iv[0].iov_len = 0;
+        // 文件可能也已经发送了一部分
+        // 更新新的文件地址
+        m_iv[1].iov_base = (char *)m_body + (bytes_have_send-m_write_idx);
+        // 更新新的文件长度为待发送长度
+        m_iv[1].iov_len = bytes_to_send;
+    }
+    else
+    {
+        // 更新新的地址
+        m_iv[0].iov_base = m_write_buf + bytes_have_send;
+        // 新的文件长度需要减去当前一次发送的文件长度
+        m_iv[0].iov_len -= n;
+    }
+}
 
-    // 可变参数写入, 写入到缓冲区
-    // 写入m_write_buf + m_write_idx,写入长度,格式化字符串,可变参数
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
+// 写HTTP响应
+bool http_conn::write()
+{
+    if (m_tls && !m_tls->established())
+    {
+        // 握手时socket写缓冲满了才会走到这里, 很少见, 直接在主线程里继续握手
+        process();
+        return true;
+    }
+    if (m_h2)
+    {
+        return write_h2();
+    }
+    if (m_ws)
+    {
+        return write_ws();
+    }
+    if (m_sse)
+    {
+        return write_sse();
+    }
+
+    int temp = 0;
+
+    // 代理响应: 上游来了新数据, 或者splice时客户端又可写了
+    if (bytes_to_send == 0 && m_proxy && !m_proxy->finished())
+    {
+        int r = next_proxy();
+        if (r <= 0)
+        {
+            return r == 0;
+        }
+        if (bytes_to_send == 0)
+        {
+            // 响应体已经全部splice出去
+            request_done();
+            if (!m_linger)
+            {
+                return false;
+            }
+            init();
+            rearm(EPOLLIN);
+            return true;
+        }
+    }
+
+    if (bytes_to_send == 0)
+    {
+        // 将要发送的字节为0，这一次响应结束。
+
+        // 重新初始化http请求, 再重置epollin
+        init();
+        rearm(EPOLLIN);
+        return true;
+    }
+
+    if (!m_trace.tsc[TRACE_FIRST_WRITE])
+    {
+        trace(TRACE_FIRST_WRITE);
+    }
+    while (1)
+    {
+        // 冷文件先预取, 不在这里等磁盘
+        if (!body_resident())
+        {
+            return true;
+        }
+        // 聚集写
+        // 写缓冲和请求的文件信息一起写进去
+        temp = send_iv();
+        if (temp <= -1)
+        {
+            // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
+            // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
+            if (errno == EAGAIN)
+            {
+                // 等待EPOLLOUT事件(等待可写)
+                rearm(EPOLLOUT);
+                return true;
+            }
+            // 这里是出错了, 解除内存映射
+            unmap();
+            return false;
+        }
+        advance(temp);
+
+        // 分块响应: 这一块发完了就向生成者要下一块, 直到socket写满
+        if (bytes_to_send <= 0 && m_stream && !m_stream->finished())
+        {
+            if (!next_chunk())
+            {
+                // 头部已经发出去了, 只能断开连接让客户端知道响应不完整
+                return false;
+            }
+            continue;
+        }
+
+        // 代理响应: 这一段发完了就向上游要下一段
+        if (bytes_to_send <= 0 && m_proxy && !m_proxy->finished())
+        {
+            int r = next_proxy();
+            if (r <= 0)
+            {
+                return r == 0;
+            }
+            if (bytes_to_send > 0)
+            {
+                continue;
+            }
+        }
+
+        if (bytes_to_send <= 0)
+        {
+            // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
+            request_done();
+            unmap();
+            if (m_ws_handler)
+            {
+                start_ws();
+                return true;
+            }
+            if (m_sse_channel)
+            {
+                return start_sse();
+            }
+            if (!m_linger)
+            {
+                return false;
+            }
+            // 发送(写)完了, 等待可读事件
+            // 先init再注册: 一次完成模式下write在工作线程里, 注册之后别的线程可能马上接手这个连接
+            init();
+            rearm(EPOLLIN);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool http_conn::body_resident()
+{
+    if (!m_prefetch_pool || !m_body_mapped || m_iv_count < 2 || m_iv[1].iov_len == 0)
+    {
+        return true;
+    }
+    if (m_prefetch_done)
+    {
+        m_prefetch_done = false;
+        return true;
+    }
+    size_t len = m_iv[1].iov_len < PREFETCH_WINDOW ? m_iv[1].iov_len : PREFETCH_WINDOW;
+    if (pages_resident(m_iv[1].iov_base, len))
+    {
+        return true;
+    }
+    m_prefetch.conn = this;
+    m_prefetch.addr = (const char *)m_iv[1].iov_base;
+    m_prefetch.len = len;
+    m_prefetching = true;
+    // 队列满了就不等了, 在这里缺页
+    if (!m_prefetch_pool->append(&m_prefetch))
+    {
+        m_prefetching = false;
+        return true;
+    }
+    m_prefetches.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
 
-    // 写入失败
-    if (len < 0)
+int http_conn::send_iv()
+{
+    if (!m_prefetch_pool || !m_body_mapped || m_iv_count < 2 || m_iv[1].iov_len <= PREFETCH_WINDOW)
+    {
+        return sock_writev(m_iv, m_iv_count);
+    }
+    struct iovec iv[2] = {m_iv[0], m_iv[1]};
+    iv[1].iov_len = PREFETCH_WINDOW;
+    return sock_writev(iv, 2);
+}
+
+void http_conn::prefetched()
+{
+    m_prefetching = false;
+    m_prefetch_done = true;
+    if (m_coro)
+    {
+        resume(EPOLLOUT);
+    }
+    else if (!write())
+    {
+        close_conn();
+    }
+}
+
+// 往写缓冲中追加一段已经拼好的字节
+bool http_conn::add_bytes(const char *data, int len)
+{
+    // 如果需要写的东西超过了写缓冲区的大小, 写入失败
+    if (len > m_write_buffer_size - m_write_idx)
     {
         return false;
     }
-    // 写入大小增加len
+    memcpy(m_write_buf + m_write_idx, data, len);
     m_write_idx += len;
-
-    // 使用完毕,关闭arg_list
-    va_end(arg_list);
-    // 返回写入成功
     return true;
 }
 
-// 加入状态行
-bool http_conn::add_status_line(int status, const char *title)
+bool http_conn::add_piece(const response_piece &p)
 {
-    return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+    return add_bytes(p.data, p.len);
 }
 
-// 加入消息头
+// 加入Date头, 内容由当前线程缓存, 每秒刷新一次
+bool http_conn::add_date()
+{
+    return add_piece(date_header());
+}
+
+// 加入消息头: Content-Length, Content-Type, Connection 和空行
 bool http_conn::add_headers(int content_len)
 {
-    return (add_content_length(content_len)&&add_content_type()&&add_linger()&&add_blank_line());
+    // 数字部分最多20位, 先一次性检查空间, 再直接写进缓冲区
+    if (content_length_prefix.size + 20 > (size_t)(m_write_buffer_size - m_write_idx))
+    {
+        return false;
+    }
+    memcpy(m_write_buf + m_write_idx, content_length_prefix.data, content_length_prefix.size);
+    m_write_idx += content_length_prefix.size;
+    m_write_idx += u64_to_dec(content_len, m_write_buf + m_write_idx);
+    return add_piece(ok_headers_tail[m_linger]);
 }
 
-// 消息体的长度
-bool http_conn::add_content_length(int content_len)
+// 加入完整的错误响应: 状态行, Date, 以及编译期拼好的头部和消息体
+bool http_conn::add_error(const canned_error &e)
 {
-    return add_response("Content-Length: %d\r\n", content_len);
+    return add_piece(e.status) && add_date() && add_piece(e.tail[m_linger]);
 }
 
-// 加入链接类型
-bool http_conn::add_linger()
+// 分块响应的头部: 状态行, Date, Transfer-Encoding等, 生成者有trailer时预告trailer的名字
+bool http_conn::add_stream_headers()
 {
-    return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
+    if (!(add_piece(piece(status_200)) && add_date() && add_piece(chunked_headers_tail[m_linger])))
+    {
+        return false;
+    }
+    const char *trailers = m_stream->producer()->trailer_names();
+    if (trailers && !(add_piece(piece(trailer_prefix)) && add_bytes(trailers, strlen(trailers)) && add_piece(piece(crlf))))
+    {
+        return false;
+    }
+    return add_piece(piece(crlf));
 }
 
-// 加入空行
-bool http_conn::add_blank_line()
+// 生成下一块放进m_iv[1], 写缓冲区里的头部已经发完
+bool http_conn::next_chunk()
 {
-    return add_response("%s", "\r\n");
+    if (!m_stream->refill())
+    {
+        return false;
+    }
+    m_write_idx = 0;
+    bytes_have_send = 0;
+    m_iv[0].iov_len = 0;
+    m_body = m_stream->data();
+    m_iv[1].iov_base = (char *)m_body;
+    m_iv[1].iov_len = m_stream->size();
+    m_iv_count = 2;
+    bytes_to_send = m_stream->size();
+    return true;
 }
 
-// 添加消息体
-bool http_conn::add_content(const char *content)
+int http_conn::next_proxy()
 {
-    return add_response("%s", content);
+    // TLS连接的数据要经过加密, 只能走用户态缓冲区
+    proxy_exchange::PUMP r = m_tls ? proxy_exchange::PUMP_DATA : m_proxy->splice_to(m_sockfd);
+    const char *data = NULL;
+    int len = 0;
+    if (r == proxy_exchange::PUMP_DATA)
+    {
+        r = m_proxy->next(data, len);
+    }
+    switch (r)
+    {
+    case proxy_exchange::PUMP_WAIT_CLIENT:
+        rearm(EPOLLOUT);
+        return 0;
+    case proxy_exchange::PUMP_WAIT_UPSTREAM:
+        m_proxy->wait_upstream(m_epollfd, m_sockfd);
+        return 0;
+    case proxy_exchange::PUMP_ERROR:
+        return -1;
+    default:
+        break;
+    }
+    m_write_idx = 0;
+    bytes_have_send = 0;
+    m_iv[0].iov_len = 0;
+    m_body = data;
+    m_iv[1].iov_base = (char *)data;
+    m_iv[1].iov_len = len;
+    m_iv_count = 2;
+    bytes_to_send = len;
+    return 1;
 }
 
-// 添加消息体的类型
-bool http_conn::add_content_type()
+// 处理结果对应的状态码; 代理的状态码在process_write里从上游的响应头取
+static int http_status(http_conn::HTTP_CODE ret)
 {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    switch (ret)
+    {
+    case http_conn::BAD_REQUEST:
+        return 400;
+    case http_conn::FORBIDDEN_REQUEST:
+        return 403;
+    case http_conn::NO_RESOURCE:
+        return 404;
+    case http_conn::METHOD_NOT_ALLOWED:
+        return 405;
+    case http_conn::TOO_MANY_REQUESTS:
+        return 429;
+    case http_conn::URI_TOO_LONG:
+        return 414;
+    case http_conn::HEADERS_TOO_LARGE:
+        return 431;
+    case http_conn::INTERNAL_ERROR:
+        return 500;
+    case http_conn::BAD_GATEWAY:
+        return 502;
+    case http_conn::NOT_MODIFIED:
+        return 304;
+    case http_conn::WEBSOCKET_REQUEST:
+        return 101;
+    default:
+        return 200;
+    }
 }
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
 bool http_conn::process_write(HTTP_CODE ret)
 {
+    m_trace.code = ret;
+    m_status = http_status(ret);
     // 传入读的内容, 从而决定写的内容
     switch (ret)
     {
     // 服务器内部错误
     case INTERNAL_ERROR:
-        // 错误号500
-        // 加入状态行
-        add_status_line(500, error_500_title);
-        // 加入头
-        add_headers(strlen(error_500_form));
-        // 加入消息体
-        if (!add_content(error_500_form))
+        if (!add_error(canned_500))
         {
             return false;
         }
         break;
     // 语法错误
     case BAD_REQUEST:
-        add_status_line(400, error_400_title);
-        add_headers(strlen(error_400_form));
-        if (!add_content(error_400_form))
+        if (!add_error(canned_400))
         {
             return false;
         }
         break;
     // 没有资源
     case NO_RESOURCE:
-        add_status_line(404, error_404_title);
-        add_headers(strlen(error_404_form));
-        if (!add_content(error_404_form))
+        if (!add_error(canned_404))
+        {
+            return false;
+        }
+        break;
+    // 超过了这个客户端IP的请求速率限制
+    case TOO_MANY_REQUESTS:
+        if (!add_error(canned_429))
+        {
+            return false;
+        }
+        break;
+    case URI_TOO_LONG:
+        if (!add_error(canned_414))
+        {
+            return false;
+        }
+        break;
+    case HEADERS_TOO_LARGE:
+        if (!add_error(canned_431))
+        {
+            return false;
+        }
+        break;
+    case BAD_GATEWAY:
+        if (!add_error(canned_502))
+        {
+            return false;
+        }
+        break;
+    // 代理: 请求已经发给上游, 在这里读回响应头; 响应体在write里边收边发
+    case PROXY_REQUEST:
+    {
+        if (!m_proxy->finish_request())
+        {
+            delete m_proxy;
+            m_proxy = NULL;
+            return process_write(BAD_GATEWAY);
+        }
+        const std::string &head = m_proxy->client_head(m_linger);
+        // "HTTP/1.1 200 ..."
+        m_status = head.size() > 12 ? atoi(head.c_str() + 9) : 0;
+        m_write_idx = 0;
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = 0;
+        m_body = head.data();
+        m_iv[1].iov_base = (char *)m_body;
+        m_iv[1].iov_len = head.size();
+        m_iv_count = 2;
+        bytes_to_send = head.size();
+        return true;
+    }
+    case METHOD_NOT_ALLOWED:
+        if (!add_error(canned_405))
         {
             return false;
         }
         break;
     // 权限不足
     case FORBIDDEN_REQUEST:
-        add_status_line(403, error_403_title);
-        add_headers(strlen(error_403_form));
-        if (!add_content(error_403_form))
+        if (!add_error(canned_403))
+        {
+            return false;
+        }
+        break;
+    // 请求体处理完毕, 响应体由消费者生成
+    case BODY_REQUEST:
+    {
+        char body[256];
+        int len = m_consumer->on_end(body, sizeof(body));
+        if (len < 0)
+        {
+            return process_write(INTERNAL_ERROR);
+        }
+        if (!(add_piece(piece(status_200)) && add_date() && add_headers(len) && add_bytes(body, len)))
+        {
+            return false;
+        }
+        break;
+    }
+    // 处理函数生成了完整的响应体, 和文件一样放在m_iv[1]
+    case HANDLER_REQUEST:
+        if (!(add_piece(piece(status_200)) && add_date() && add_headers(m_response.body.size())))
+        {
+            return false;
+        }
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = m_write_idx;
+        m_body = m_response.body.data();
+        m_iv[1].iov_base = (char *)m_body;
+        m_iv[1].iov_len = m_response.body.size();
+        m_iv_count = 2;
+        bytes_to_send = m_write_idx + m_response.body.size();
+        return true;
+    // 资源包里的文件: 头部是打包时生成好的
+    case PACK_REQUEST:
+    {
+        const pack_entry *e = m_pack_entry;
+        uint32_t headers_off = m_pack_gzip ? e->gzip_headers_off : e->headers_off;
+        uint32_t headers_len = m_pack_gzip ? e->gzip_headers_len : e->headers_len;
+        if (!(add_piece(piece(status_200)) && add_date() && add_bytes(m_pack->at(headers_off), headers_len)
+              && add_piece(connection_tail[m_linger])))
+        {
+            return false;
+        }
+        uint64_t len = m_pack_gzip ? e->gzip_len : e->body_len;
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = m_write_idx;
+        m_body = m_pack->at(m_pack_gzip ? e->gzip_off : e->body_off);
+        m_body_mapped = true;
+        m_iv[1].iov_base = (char *)m_body;
+        m_iv[1].iov_len = len;
+        m_iv_count = 2;
+        bytes_to_send = m_write_idx + len;
+        return true;
+    }
+    // 事件流: 没有长度, 连接关闭时结束
+    case SSE_REQUEST:
+        if (!(add_piece(piece(status_200)) && add_date() && add_piece(piece(sse_headers))))
+        {
+            return false;
+        }
+        break;
+    // WebSocket握手: 101发完之后连接交给ws_session
+    case WEBSOCKET_REQUEST:
+    {
+        char accept[WS_ACCEPT_LEN];
+        ws_accept_key(m_ws_key, strlen(m_ws_key), accept);
+        if (!(add_piece(piece(status_101_ws)) && add_bytes(accept, WS_ACCEPT_LEN) && add_piece(piece(ws_accept_tail))))
+        {
+            return false;
+        }
+        break;
+    }
+    case NOT_MODIFIED:
+        if (!(add_piece(piece(status_304)) && add_date() && add_piece(piece(etag_prefix))
+              && add_bytes(m_pack->at(m_pack_entry->etag_off), m_pack_entry->etag_len) && add_piece(piece(crlf))
+              && add_piece(connection_tail[m_linger])))
         {
             return false;
         }
         break;
     // 文件获取成功
     case FILE_REQUEST:
-        // 加入状态行
-        add_status_line(200, ok_200_title);
-        // 加入消息头
-        add_headers(m_file_stat.st_size);
+        // 加入状态行, Date和其余消息头
+        if (!(add_piece(piece(status_200)) && add_date() && add_headers(m_file_stat.st_size)))
+        {
+            return false;
+        }
         // 初始化聚集写
         m_iv[0].iov_base = m_write_buf;         //读缓冲地址
         m_iv[0].iov_len = m_write_idx;          //读缓冲大小
-        m_iv[1].iov_base = m_file_address;      //文件地址
+        m_body = m_cached ? m_cached->data : m_file_address;
+        m_body_mapped = !m_cached;
+        m_iv[1].iov_base = (char *)m_body;      //文件地址
         m_iv[1].iov_len = m_file_stat.st_size;  //文件大小
         m_iv_count = 2;
 
         // 更新字节数
         bytes_to_send=m_write_idx+m_file_stat.st_size;
         return true;
+    // 分块响应: 头部和第一块一起发
+    case STREAM_REQUEST:
+        if (!add_stream_headers() || !m_stream->refill())
+        {
+            return false;
+        }
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = m_write_idx;
+        m_body = m_stream->data();
+        m_iv[1].iov_base = (char *)m_body;
+        m_iv[1].iov_len = m_stream->size();
+        m_iv_count = 2;
+        bytes_to_send = m_write_idx + m_stream->size();
+        return true;
     default:
         return false;
     }
@@ -699,30 +1765,379 @@ bool http_conn::process_write(HTTP_CODE ret)
     m_iv[0].iov_base = m_write_buf;
     m_iv[0].iov_len = m_write_idx;
     m_iv_count = 1;
+    bytes_to_send = m_write_idx;
     return true;
 }
 
 // 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
 void http_conn::process()
 {
+    trace(TRACE_DEQUEUE);
+    if (m_tls && !m_tls->established() && !tls_handshake())
+    {
+        return;
+    }
+    // 一次完成模式: 主线程只是把可读的连接交给线程池, 在这里读
+    if (m_model == MODEL_RUN_TO_COMPLETION)
+    {
+        if (!read())
+        {
+            close_conn();
+            return;
+        }
+        if (!admit_request())
+        {
+            return;
+        }
+    }
+    if (m_h2)
+    {
+        process_h2();
+        return;
+    }
+    if (m_ws)
+    {
+        process_ws();
+        return;
+    }
+
+    // 带先验知识的h2c: 序言还没收全时先不按HTTP/1.1解析, 收全后在read()里切换
+    if (m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == 0 && m_read_idx < h2_session::PREFACE_LEN
+        && memcmp(m_read_buf, h2_session::PREFACE, m_read_idx) == 0)
+    {
+        rearm(EPOLLIN);
+        return;
+    }
+
     // 解析HTTP请求
     HTTP_CODE read_ret = process_read();
+    WS_PROBE2(process_read, m_sockfd, read_ret);
+    // TLS: 读缓冲区满时停止了读取, 已经被OpenSSL解密缓存的数据不会再触发EPOLLIN, 这里接着读
+    while (read_ret == NO_REQUEST && m_check_state == CHECK_STATE_CONTENT && m_tls && m_tls->has_pending())
+    {
+        if (!read())
+        {
+            close_conn();
+            return;
+        }
+        read_ret = process_read();
+    }
     // 没读完
     if (read_ret == NO_REQUEST)
     {
         // 等待下一波可读事件
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+        rearm(EPOLLIN);
+        return;
+    }
+    trace(TRACE_PARSED);
+
+    // Upgrade: h2c, 这个请求的响应改为在HTTP/2的流1上发送; 流上回复不了的结果忽略Upgrade, 按HTTP/1.1回复
+    if (m_upgrade_h2c && m_method == GET && m_content_length == 0 && !m_chunked && upgrade_h2c(read_ret))
+    {
         return;
     }
 
     // 生成响应
     bool write_ret = process_write(read_ret);
+    WS_PROBE3(process_write, m_sockfd, read_ret, write_ret ? bytes_to_send : -1);
     // 如果写失败或者请求有问题
     if (!write_ret)
     {
         // 关闭连接
         close_conn();
+        return;
+    }
+    m_requests.fetch_add(1, std::memory_order_relaxed);
+    trace(TRACE_READY);
+    if (m_ready)
+    {
+        // 交还主线程直接写, 省掉一次注册EPOLLOUT的epoll_ctl
+        m_ready->push(this);
+        return;
+    }
+    if (m_model != MODEL_REACTOR)
+    {
+        // 直接写, 写不完时write自己注册EPOLLOUT
+        if (!write())
+        {
+            close_conn();
+        }
+        return;
     }
     // 等待可写事件, 可写事件的时候才真正把信息返回, 现在还存在缓冲区
+    rearm(EPOLLOUT);
+}
+
+void http_conn::request_done()
+{
+    trace(TRACE_LAST_WRITE);
+    m_trace.conn = m_conn_id;
+    m_trace.fd = m_sockfd;
+    m_trace.method = m_method;
+    trace_local().push(m_trace);
+    m_trace.tsc[TRACE_ACCEPT] = 0;
+
+    access_record r;
+    r.tsc = m_trace.tsc[TRACE_LAST_WRITE];
+    r.ip = m_address.sin_addr.s_addr;
+    r.bytes = m_trace.bytes;
+    r.status = m_status;
+    r.method = m_method;
+    r.flags = (m_linger ? ACCESS_KEEP_ALIVE : 0) | (m_tls ? ACCESS_TLS : 0) | (m_pack_gzip ? ACCESS_GZIP : 0)
+            | (m_unix ? ACCESS_UNIX : 0);
+    r.conn = m_conn_id;
+    // 管线化的请求在上一个响应写完之前就读到了, 从工作线程开始处理算起
+    access_log.append(r, m_url, m_trace.tsc[TRACE_FIRST_READ] ? m_trace.tsc[TRACE_FIRST_READ] : m_trace.tsc[TRACE_DEQUEUE]);
+}
+
+// 注册要等待的事件. 和当前注册的一样就不调用epoll_ctl
+// 先记下再注册: 注册之后事件可能马上被主线程取到, 主线程会调用fired()清掉
+void http_conn::rearm(int ev)
+{
+    if (m_armed == ev)
+    {
+        return;
+    }
+    m_armed = ev;
+    modfd(m_epollfd, m_sockfd, ev);
+}
+
+// 把连接切换成HTTP/2, 流上回复不了这个结果或者HTTP2-Settings不合法时返回false, 继续按HTTP/1.1响应
+bool http_conn::upgrade_h2c(HTTP_CODE ret)
+{
+    if (!h2_session::can_respond(ret))
+    {
+        return false;
+    }
+    h2_session *h2 = new h2_session(m_limit_slot);
+    if (!h2->start_upgrade(m_h2_settings, ret, ret == FILE_REQUEST ? m_file_address : 0, m_file_stat))
+    {
+        delete h2;
+        return false;
+    }
+    m_h2 = h2;
+    // 文件映射交给流1管理
+    m_file_address = 0;
+    // 请求之后已经收到的字节属于HTTP/2
+    m_h2->feed(m_read_buf + m_checked_idx, m_read_idx - m_checked_idx);
+    m_read_idx = 0;
+    process_h2();
+    return true;
+}
+
+// 解析收到的帧, 有输出就等待可写, 否则继续等待可读
+void http_conn::process_h2()
+{
+    m_h2->on_input();
+    m_h2->pump();
+    if (m_h2->output_size() > 0)
+    {
+        rearm(EPOLLOUT);
+    }
+    else if (m_h2->finished())
+    {
+        close_conn();
+    }
+    else
+    {
+        rearm(EPOLLIN);
+    }
+}
+
+// HTTP/2连接的写: 发送会话的输出, 发空了就让会话按流量控制窗口继续生成DATA帧
+bool http_conn::write_h2()
+{
+    while (true)
+    {
+        if (m_h2->output_size() == 0)
+        {
+            m_h2->pump();
+            if (m_h2->output_size() == 0)
+            {
+                if (m_h2->finished())
+                {
+                    return false;
+                }
+                // 全部发完, 或者在等对端的WINDOW_UPDATE
+                rearm(EPOLLIN);
+                return true;
+            }
+        }
+        struct iovec iv;
+        iv.iov_base = (void *)m_h2->output();
+        iv.iov_len = m_h2->output_size();
+        int temp = sock_writev(&iv, 1);
+        if (temp <= -1)
+        {
+            if (errno == EAGAIN)
+            {
+                // 积压的输出不多时, 等待可写的同时也收新的请求和WINDOW_UPDATE; 否则等发出去再读,
+                // 不然对端只发PING不读, 每个PING的回复都会堆在输出里. 不读时process_h2()也不会被调用
+                rearm(m_h2->output_size() < h2_session::OUTPUT_HIGH_WATER ? EPOLLOUT | EPOLLIN : EPOLLOUT);
+                return true;
+            }
+            return false;
+        }
+        m_h2->consume(temp);
+    }
+}
+
+// 握手要求: GET, 没有请求体, Upgrade: websocket, 版本13, 24个字符的key(16字节的base64)
+bool http_conn::valid_ws_handshake() const
+{
+    return m_upgrade_ws && m_method == GET && m_content_length == 0 && !m_chunked && m_ws_version == 13 && m_ws_key
+        && strlen(m_ws_key) == 24;
+}
+
+// 101已经发完: 握手请求之后收到的字节挪到读缓冲区开头, 之后读缓冲区由会话使用
+void http_conn::start_ws()
+{
+    size_t used = m_read_idx - m_checked_idx;
+    memmove(m_read_buf, m_read_buf + m_checked_idx, used);
+    m_read_idx = 0;
+    m_ws = new ws_session(m_ws_handler, m_read_buf, m_read_buffer_size, used);
+    m_ws_handler = NULL;
+    m_ws->start();
+    process_ws();
+}
+
+// 解析收到的帧, 有输出就等待可写, 否则继续等待可读
+void http_conn::process_ws()
+{
+    m_ws->on_input();
+    // TLS: 输入缓冲区满时停止了读取, 已经解密的数据不会再触发EPOLLIN
+    while (m_tls && m_tls->has_pending() && !m_ws->finished() && m_ws->output_size() < ws_session::OUTPUT_HIGH_WATER)
+    {
+        if (!read_ws())
+        {
+            close_conn();
+            return;
+        }
+        m_ws->on_input();
+    }
+    if (m_ws->output_size() > 0)
+    {
+        rearm(EPOLLOUT);
+    }
+    else if (m_ws->finished())
+    {
+        close_conn();
+    }
+    else
+    {
+        rearm(EPOLLIN);
+    }
+}
+
+// WebSocket连接的读: 直接读进会话的输入缓冲区, 缓冲区满了就留在内核里等会话处理完
+bool http_conn::read_ws()
+{
+    while (true)
+    {
+        size_t len;
+        char *buf = m_ws->input_space(len);
+        if (len == 0)
+        {
+            return true;
+        }
+        int bytes_read = sock_read(buf, len);
+        if (bytes_read == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+            return false;
+        }
+        else if (bytes_read == 0)
+        {
+            return false;
+        }
+        m_ws->commit(bytes_read);
+    }
+}
+
+// WebSocket连接的写: 发完关闭帧后关闭连接
+bool http_conn::write_ws()
+{
+    while (m_ws->output_size() > 0)
+    {
+        struct iovec iv;
+        iv.iov_base = (void *)m_ws->output();
+        iv.iov_len = m_ws->output_size();
+        int temp = sock_writev(&iv, 1);
+        if (temp <= -1)
+        {
+            if (errno == EAGAIN)
+            {
+                // 积压的输出不多时继续收对端的消息, 否则等发出去再读
+                rearm(m_ws->output_size() < ws_session::OUTPUT_HIGH_WATER ? EPOLLOUT | EPOLLIN : EPOLLOUT);
+                return true;
+            }
+            return false;
+        }
+        m_ws->consume(temp);
+    }
+    if (m_ws->finished())
+    {
+        return false;
+    }
+    rearm(EPOLLIN);
+    return true;
+}
+
+bool http_conn::start_sse()
+{
+    m_sse = new sse_subscriber(this, m_sse_channel);
+    m_sse_channel.reset();
+    m_sse->channel->subscribe(m_sse);
+    return write_sse();
+}
+
+// 事件流的写: 队列里的事件引用直接作为iovec, 一次writev发多个, 不拷贝到写缓冲区
+// 发空了就只注册EPOLLRDHUP(对端关闭时由主线程关闭连接), 等发布者唤醒; 整个过程持有订阅者的锁
+bool http_conn::write_sse()
+{
+    static const int SSE_IOV = 64;
+    sse_subscriber *s = m_sse;
+    s->lock.lock();
+    while (!s->overflow && !s->queue.empty())
+    {
+        struct iovec iv[SSE_IOV];
+        int n = 0;
+        for (std::deque<sse_buffer>::iterator it = s->queue.begin(); it != s->queue.end() && n < SSE_IOV; ++it, ++n)
+        {
+            size_t skip = n == 0 ? s->offset : 0;
+            iv[n].iov_base = (void *)((*it)->data() + skip);
+            iv[n].iov_len = (*it)->size() - skip;
+        }
+        int temp = sock_writev(iv, n);
+        if (temp <= -1)
+        {
+            if (errno == EAGAIN)
+            {
+                rearm(EPOLLOUT);
+                s->lock.unlock();
+                return true;
+            }
+            s->lock.unlock();
+            return false;
+        }
+        s->advance(temp);
+    }
+    bool ok = !s->overflow;
+    if (ok)
+    {
+        s->idle = true;
+        // 注册的只有EPOLLRDHUP, 不记在m_armed里: 发布者会在这个连接的线程之外改成EPOLLOUT
+        m_armed = 0;
+        modfd(m_epollfd, m_sockfd, 0);
+    }
+    s->lock.unlock();
+    return ok;
+}
+
+void http_conn::sse_wake()
+{
     modfd(m_epollfd, m_sockfd, EPOLLOUT);
-}
\ No newline at end of file
+}
@@ -0,0 +1,54 @@
+#include <string.h>
+#include <time.h>
+#include "headers/http_response.h"
+
+// 两位一组查表, 每次除法处理两位数字
+static const char digits_lut[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+int u64_to_dec(uint64_t v, char *buf)
+{
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    while (v >= 100)
+    {
+        int idx = (v % 100) * 2;
+        v /= 100;
+        *--p = digits_lut[idx + 1];
+        *--p = digits_lut[idx];
+    }
+    if (v >= 10)
+    {
+        *--p = digits_lut[v * 2 + 1];
+        *--p = digits_lut[v * 2];
+    }
+    else
+    {
+        *--p = '0' + v;
+    }
+    int len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+// 每个工作线程各自缓存, 不需要加锁; time()走vDSO, 比格式化便宜得多
+response_piece date_header()
+{
+    static thread_local time_t cached_sec = -1;
+    static thread_local char buf[64];
+    static thread_local int buf_len = 0;
+
+    time_t now = time(NULL);
+    if (now != cached_sec)
+    {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        buf_len = strftime(buf, sizeof(buf), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        cached_sec = now;
+    }
+    return response_piece{buf, buf_len};
+}
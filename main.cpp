@@ -8,17 +8,53 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <vector>
 #include "headers/locker.h"
 #include "headers/threadpool.h"
 #include "headers/http_conn.h"
-
-#define MAX_FD 65536           // 最大的文件描述符个数
-#define MAX_EVENT_NUMBER 10000 // 监听的最大的事件数量
+#include "headers/config.h"
 
 // 添加文件描述符
 extern void addfd(int epollfd, int fd, bool one_shot);
 extern void removefd(int epollfd, int fd);
 
+// 收到SIGTERM/SIGINT后退出主循环, 让进程正常返回(PGO插桩版本在exit时才写出profile)
+static volatile sig_atomic_t stop_server = 0;
+
+void stop_handler(int sig)
+{
+    stop_server = 1;
+}
+
+// 收到SIGUSR1后在主循环里打印TLS握手统计
+static volatile sig_atomic_t dump_stats = 0;
+
+void stats_handler(int sig)
+{
+    dump_stats = 1;
+}
+
+// 收到SIGUSR2后在主循环里把各线程最近请求的时间戳写到 trace-<pid>.json
+static volatile sig_atomic_t dump_trace = 0;
+
+void trace_handler(int sig)
+{
+    dump_trace = 1;
+}
+
+// 收到SIGHUP后在主循环里重新读配置文件, 并重新加载资源包
+static volatile sig_atomic_t reload_config = 0;
+
+void reload_handler(int sig)
+{
+    reload_config = 1;
+}
+
 void addsig(int sig, void(handler)(int))
 {
     // 创建新的信号
@@ -32,14 +68,219 @@ void addsig(int sig, void(handler)(int))
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
+// 创建监听socket并绑定到port, 失败返回-1
+int open_listen(int port, int backlog)
+{
+    // 创建socket, 使用ipv4, tcp流传输, 默认参数
+    // 这里相当于接入口的文件描述符
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+
+    // 设置地址
+    struct sockaddr_in address;
+
+    // 任意地址
+    address.sin_addr.s_addr = INADDR_ANY;
+
+    // 使用internet协议族
+    address.sin_family = AF_INET;
+
+    // 设置端口
+    // 把主机字节序转化为网络字节序
+    address.sin_port = htons(port);
+
+    // 端口复用
+    int reuse = 1;
+    // 设置端口复用
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    // 绑定, 监听
+    if (bind(listenfd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listenfd, backlog) < 0)
+    {
+        printf("cannot listen on port %d: %s\n", port, strerror(errno));
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+// 在unix socket上监听, '@'开头的是抽象地址(不在文件系统里, 进程退出就消失), 失败返回-1
+// 文件系统里的路径上已经有socket文件时先删掉, 上次没有正常退出会留下它
+int open_unix_listen(const std::string &path, int backlog)
+{
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.data(), path.size());
+    socklen_t len = offsetof(struct sockaddr_un, sun_path) + path.size();
+    struct stat st;
+    if (path[0] == '@')
+    {
+        address.sun_path[0] = '\0';
+    }
+    else if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path.c_str());
+    }
+    if (bind(listenfd, (struct sockaddr *)&address, len) < 0 || listen(listenfd, backlog) < 0)
+    {
+        printf("cannot listen on %s: %s\n", path.c_str(), strerror(errno));
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+// 连接数超过限制: 新连接的发送缓冲区是空的, 一次非阻塞写就能放下, 写不进去也不等
+void reject_connection(int connfd)
+{
+    response_piece date = date_header();
+    struct iovec iov[3] = {
+        {(void *)status_429.data, status_429.size},
+        {(void *)date.data, (size_t)date.len},
+        {(void *)error_429_close.data, error_429_close.size},
+    };
+    writev(connfd, iov, 3);
+}
+
+// 默认值 <- 配置文件 <- 命令行, 出错时打印原因并返回false
+static bool build_config(const char *path, const std::vector<std::string> &overrides, server_config &config)
+{
+    std::string err;
+    if (path && !config.load(path, err))
+    {
+        printf("%s\n", err.c_str());
+        return false;
+    }
+    for (size_t i = 0; i < overrides.size(); ++i)
+    {
+        if (!config.set(overrides[i], err))
+        {
+            printf("%s\n", err.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// 资源包路径为空时卸下资源包, 回到从doc_root读文件
+static bool load_pack(const std::string &path)
+{
+    std::shared_ptr<asset_pack> pack;
+    if (!path.empty() && !(pack = asset_pack::open(path.c_str())))
+    {
+        return false;
+    }
+    asset_pack::install(pack);
+    return true;
+}
+
+// 在主线程里拼JSON和写文件, 工作线程照常记录
+static void write_trace()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "trace-%d.json", (int)getpid());
+    std::string json = trace_dump();
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        printf("cannot write %s\n", path);
+        return;
+    }
+    fwrite(json.data(), json.size(), 1, f);
+    fclose(f);
+    printf("request trace written to %s\n", path);
+    fflush(stdout);
+}
+
 int main(int argc, char *argv[])
 {
+    // -f 配置文件, -o key=value 覆盖其中一项, 可用的键见 config.cpp; 下面几个选项是常用键的简写
+    // -p 资源包: 静态文件从mkpack生成的包里取
+    // -x/-X 前缀=上游[,上游...]: 反向代理, -X转发时去掉前缀; -b lc 改用最少连接(默认轮转), 对后面的-x/-X有效
+    // -r 速率[/突发]: 每个客户端IP每秒的请求数; -c 连接数: 每个客户端IP的并发连接数上限
+    // -m reactor|rtc|single|coro: 并发模型, 见 http_conn::MODEL
+    // -u 路径: 另外在unix socket上监听, 见配置项unix_socket
+    const char *config_path = NULL;
+    std::vector<std::string> overrides;
+    BALANCE balance = BALANCE_ROUND_ROBIN;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:o:p:x:X:b:r:c:m:u:")) != -1)
+    {
+        const char *slash;
+        if (opt == 'f')
+        {
+            config_path = optarg;
+        }
+        else if (opt == 'o')
+        {
+            overrides.push_back(optarg);
+        }
+        else if (opt == 'p' || opt == 'c' || opt == 'm' || opt == 'u')
+        {
+            overrides.push_back(std::string(opt == 'p' ? "pack=" : opt == 'c' ? "conns=" : opt == 'm' ? "model=" : "unix_socket=")
+                                + optarg);
+        }
+        else if (opt == 'r')
+        {
+            slash = strchr(optarg, '/');
+            overrides.push_back("rate=" + std::string(optarg, slash ? slash - optarg : strlen(optarg)));
+            if (slash)
+            {
+                overrides.push_back(std::string("burst=") + (slash + 1));
+            }
+        }
+        else if (opt == 'b' && (strcmp(optarg, "rr") == 0 || strcmp(optarg, "lc") == 0))
+        {
+            balance = optarg[0] == 'l' ? BALANCE_LEAST_CONN : BALANCE_ROUND_ROBIN;
+        }
+        else if ((opt == 'x' || opt == 'X') && add_proxy(optarg, opt == 'X', balance))
+        {
+            continue;
+        }
+        else
+        {
+            argc = 0;
+            break;
+        }
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
+
     //没有输入端口参数
-    if (argc <= 1)
+    // 可选的TLS端口, 需要同时给出证书和私钥(PEM)
+    if (argc <= 1 || (argc > 2 && argc != 5))
+    {
+        printf("usage: %s [-f config_file] [-o key=value] [-p pack_file] [-b rr|lc] [-x|-X prefix=ip:port,...] [-r rate[/burst]] [-c conns_per_ip] "
+               "[-m reactor|rtc|single|coro] [-u unix_socket] "
+               "port_number [tls_port cert_file key_file]\n", basename(argv[0]));
+        return 1;
+    }
+
+    std::shared_ptr<server_config> config = std::make_shared<server_config>();
+    if (!build_config(config_path, overrides, *config))
+    {
+        return 1;
+    }
+    install_config(config);
+    // 下面这些只在启动时生效
+    if (!http_conn::open_root(config->doc_root.c_str()))
     {
-        printf("usage: %s port_number\n", basename(argv[0]));
+        printf("cannot open doc_root %s\n", config->doc_root.c_str());
         return 1;
     }
+    http_conn::m_read_buffer_size = config->read_buffer;
+    http_conn::m_write_buffer_size = config->write_buffer;
+    http_conn::m_model = config->model == "single" ? http_conn::MODEL_SINGLE_THREAD
+                       : config->model == "rtc" ? http_conn::MODEL_RUN_TO_COMPLETION
+                       : config->model == "coro" ? http_conn::MODEL_COROUTINE : http_conn::MODEL_REACTOR;
+    const int max_fd = config->max_fd;
+    // 软限制常常只有1024, 到不了max_fd个连接时accept就会EMFILE; 在硬限制以内提上去
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < (rlim_t)max_fd)
+    {
+        nofile.rlim_cur = nofile.rlim_max < (rlim_t)max_fd ? nofile.rlim_max : (rlim_t)max_fd;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
 
     int port = atoi(argv[1]);
     // 处理sigpipe信号
@@ -47,12 +288,42 @@ int main(int argc, char *argv[])
     // 所以需要忽略该信号
     addsig(SIGPIPE, SIG_IGN);
     //signal(SIGPIPE,SIG_IGN);
+    addsig(SIGTERM, stop_handler);
+    addsig(SIGINT, stop_handler);
+    addsig(SIGUSR1, stats_handler);
+    addsig(SIGUSR2, trace_handler);
+    addsig(SIGHUP, reload_handler);
+
+    if (argc == 5 && !tls_conn::init_context(argv[3], argv[4]))
+    {
+        printf("cannot load certificate %s / key %s\n", argv[3], argv[4]);
+        return 1;
+    }
+
+    limiter.configure(config->rate, config->burst > 0 ? config->burst : config->rate, config->conns);
+
+    if (!load_pack(config->pack))
+    {
+        return 1;
+    }
+    if (!capture.open(config->capture))
+    {
+        return 1;
+    }
+    access_log.configure(config->access_log, config->log_segment);
+    content_cache.configure((size_t)config->cache_size << 20);
+    http_conn::m_idle_timeout = config->idle_timeout;
+    sse_events.configure(config->sse_queue, config->sse_policy == "disconnect");
 
     // 创建线程池,捕获错误
+    // 单线程模型和协程模型不需要线程池
     threadpool<http_conn> *pool = NULL;
     try
     {
-        pool = new threadpool<http_conn>;
+        if (http_conn::m_model != http_conn::MODEL_SINGLE_THREAD && http_conn::m_model != http_conn::MODEL_COROUTINE)
+        {
+            pool = new threadpool<http_conn>(config->threads, config->max_requests);
+        }
     }
     catch (...)
     {
@@ -60,50 +331,73 @@ int main(int argc, char *argv[])
         printf("Something Wrong\n");
         return 1;
     }
+    // 冷文件的预取线程, 见 prefetch.h
+    if (config->io_threads > 0)
+    {
+        http_conn::m_prefetch_pool = new threadpool<prefetch_request>(config->io_threads, config->max_requests, POOL_PREFETCH);
+        http_conn::m_prefetched = new ready_queue<http_conn>;
+    }
 
 
-    http_conn *users = new http_conn[MAX_FD];
-
-    // 创建socket, 使用ipv4, tcp流传输, 默认参数
-    // 这里相当于接入口的文件描述符
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-
-    int ret = 0;
-
-    // 设置地址
-    struct sockaddr_in address;
-
-    // 任意地址
-    address.sin_addr.s_addr = INADDR_ANY;
-
-    // 使用internet协议族
-    address.sin_family = AF_INET;
+    http_conn *users = new http_conn[max_fd];
 
-    // 设置端口
-    // 把主机字节序转化为网络字节序
-    address.sin_port = htons(port);
+    // 动态内容的路由, 在工作线程开始处理请求之前注册好
+    router routes;
+    register_builtin_routes(routes);
+    register_proxy_routes(routes);
+    routes.compile();
+    http_conn::m_router = &routes;
 
-    // 端口复用
-    int reuse = 1;
-    // 设置端口复用
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    // 绑定
-    ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
-    // 监听
-    ret = listen(listenfd, 5);
+    int listenfd = open_listen(port, config->backlog);
+    // TLS端口, 没有配置时为-1
+    int tls_listenfd = -1;
+    if (listenfd < 0 || (tls_conn::enabled() && (tls_listenfd = open_listen(atoi(argv[2]), config->backlog)) < 0))
+    {
+        return 1;
+    }
+    // 同一台机器上的代理从unix socket进来, 不走回环的TCP协议栈; 没有配置时为-1
+    int unix_listenfd = -1;
+    if (!config->unix_socket.empty() && (unix_listenfd = open_unix_listen(config->unix_socket, config->backlog)) < 0)
+    {
+        return 1;
+    }
 
     // 创建epoll对象，和事件数组
-    epoll_event events[MAX_EVENT_NUMBER];
+    std::vector<epoll_event> events(config->max_events);
     int epollfd = epoll_create(5);
     
     // 添加到epoll对象中
     addfd(epollfd, listenfd, false);
+    if (tls_listenfd >= 0)
+    {
+        addfd(epollfd, tls_listenfd, false);
+    }
+    if (unix_listenfd >= 0)
+    {
+        addfd(epollfd, unix_listenfd, false);
+    }
     http_conn::m_epollfd = epollfd;
+    // 反应堆模式: 工作线程处理完的连接经过完成队列交还主线程
+    int ready_fd = -1;
+    std::vector<http_conn *> ready;
+    if (http_conn::m_model == http_conn::MODEL_REACTOR)
+    {
+        http_conn::m_ready = new ready_queue<http_conn>;
+        ready_fd = http_conn::m_ready->fd();
+        addfd(epollfd, ready_fd, false);
+    }
+    int prefetched_fd = -1;
+    std::vector<http_conn *> prefetched;
+    if (http_conn::m_prefetched)
+    {
+        prefetched_fd = http_conn::m_prefetched->fd();
+        addfd(epollfd, prefetched_fd, false);
+    }
 
-    while (true)
+    while (!stop_server)
     {
-        // 等待一个EPOLL事件
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        // 等待一个EPOLL事件, 协程模型下有连接在等待超时的时候最多等到最早的截止时间
+        int number = epoll_wait(epollfd, events.data(), events.size(), http_conn::next_timeout());
 
         // EPOLL炸了
         // EINTR如果在进行系统调用时发生信号，许多系统调用将报告错误代码。
@@ -115,6 +409,26 @@ int main(int argc, char *argv[])
             printf("epoll failure\n");
             break;
         }
+        if (dump_stats)
+        {
+            dump_stats = 0;
+            tls_conn::print_stats();
+            print_proxy_stats();
+            limiter.print_stats();
+            capture.print_stats();
+            capture.flush();
+            access_log.print_stats();
+            if (content_cache.enabled())
+            {
+                fputs(content_cache.stats().c_str(), stdout);
+            }
+            fflush(stdout);
+        }
+        if (dump_trace)
+        {
+            dump_trace = 0;
+            write_trace();
+        }
         // 循环EPOLL的所有处理
         for (int i = 0; i < number; i++)
         {
@@ -123,27 +437,108 @@ int main(int argc, char *argv[])
             // 当前发生事件的文件描述符
 
             // 有连接请求
-            if (sockfd == listenfd)
+            if (sockfd == listenfd || sockfd == tls_listenfd || sockfd == unix_listenfd)
             {
-                // 创建连接
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
+                bool local = sockfd == unix_listenfd;
+                // 监听socket是边沿触发的, 一次事件里要把排队的连接都取完, 否则并发建立的连接会滞留在队列里
+                while (true)
+                {
+                    // 创建连接
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof(client_address);
+                    int connfd = local ? accept(sockfd, NULL, NULL)
+                                       : accept(sockfd, (struct sockaddr *)&client_address, &client_addrlength);
 
-                // 出现了问题
-                if (connfd < 0)
+                    // 出现了问题
+                    if (connfd < 0)
+                    {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        {
+                            printf("errno is: %d\n", errno);
+                        }
+                        break;
+                    }
+                    // unix socket的对端没有IP, 地址记为127.0.0.1, 是谁由SO_PEERCRED给出(对端connect时的pid/uid/gid)
+                    struct ucred cred;
+                    if (local)
+                    {
+                        socklen_t cred_len = sizeof(cred);
+                        if (getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
+                        {
+                            close(connfd);
+                            continue;
+                        }
+                        memset(&client_address, 0, sizeof(client_address));
+                        client_address.sin_family = AF_INET;
+                        client_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                    }
+                    WS_PROBE2(accept, connfd, ntohl(client_address.sin_addr.s_addr));
+                    // 用户数量太多了, 或者fd超出了连接表
+                    if (http_conn::m_user_count >= max_fd || connfd >= max_fd)
+                    {
+                        close(connfd);
+                        continue;
+                    }
+                    // 这个IP的连接数到了上限: 明文连接直接写一个429再关闭, TLS连接只能直接关闭
+                    // unix socket上是本机的代理, 替很多客户端转发, 不按IP限流
+                    int slot = local ? client_limiter::NO_SLOT : limiter.acquire_conn(client_address.sin_addr.s_addr);
+                    if (slot == client_limiter::LIMITED)
+                    {
+                        if (sockfd == listenfd)
+                        {
+                            reject_connection(connfd);
+                        }
+                        close(connfd);
+                        continue;
+                    }
+                    // 初始化这个连接的文件描述符
+                    users[connfd].init(connfd, client_address, sockfd == tls_listenfd, slot, local ? &cred : NULL);
+                    // 协程模型: 明文连接由协程处理, TLS连接走状态机
+                    if (http_conn::m_model == http_conn::MODEL_COROUTINE && sockfd != tls_listenfd)
+                    {
+                        users[connfd].start();
+                    }
+                }
+            }
+            // 工作线程生成好了响应, 直接写, 写不完的由write注册EPOLLOUT
+            else if (sockfd == ready_fd)
+            {
+                http_conn::m_ready->drain(ready);
+                for (size_t j = 0; j < ready.size(); ++j)
                 {
-                    printf("errno is: %d\n", errno);
-                    continue;
+                    if (!ready[j]->write())
+                    {
+                        ready[j]->close_conn();
+                    }
                 }
-                // 用户数量太多了
-                if (http_conn::m_user_count >= MAX_FD)
+            }
+            // 预取线程把冷文件的下一段读进了页缓存
+            else if (sockfd == prefetched_fd)
+            {
+                http_conn::m_prefetched->drain(prefetched);
+                for (size_t j = 0; j < prefetched.size(); ++j)
                 {
-                    close(connfd);
-                    continue;
+                    prefetched[j]->prefetched();
+                }
+            }
+            // 代理在等待的上游socket有数据(或者关闭了), 交给对应的客户端连接继续发送响应体
+            else if (sockfd & UPSTREAM_EVENT)
+            {
+                http_conn &conn = users[sockfd & ~UPSTREAM_EVENT];
+                if (conn.has_coro())
+                {
+                    conn.resume(events[i].events);
                 }
-                // 初始化这个连接的文件描述符
-                users[connfd].init(connfd, client_address);
+                else if (!conn.write())
+                {
+                    conn.close_conn();
+                }
+            }
+            // 协程模型: 挂起的协程在等这个事件, 出错和关闭也交给它在读写时发现
+            else if (users[sockfd].has_coro())
+            {
+                users[sockfd].fired();
+                users[sockfd].resume(events[i].events);
             }
             // 出现了问题
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
@@ -153,11 +548,34 @@ int main(int argc, char *argv[])
             // 出现了可读事件
             else if (events[i].events & EPOLLIN)
             {
+                users[sockfd].fired();
+                // 一次完成模式: 读也交给工作线程
+                if (http_conn::m_model == http_conn::MODEL_RUN_TO_COMPLETION)
+                {
+                    users[sockfd].trace(TRACE_ENQUEUE);
+                    if (!pool->append(users + sockfd))
+                    {
+                        users[sockfd].close_conn();
+                    }
+                    continue;
+                }
                 // 读取所有数据到缓冲区
                 if (users[sockfd].read())
                 {
+                    // 超过速率限制的请求在这里就回复429, 不占用线程池
+                    if (!users[sockfd].admit_request())
+                    {
+                        continue;
+                    }
+                    // 单线程模型: 就地解析并写出响应
+                    if (!pool)
+                    {
+                        users[sockfd].process();
+                        continue;
+                    }
                     // 加入请求队列, 等待线程池取出
                     // 这里线程做的事情是, 解析请求并且生成响应,放入写缓冲区
+                    users[sockfd].trace(TRACE_ENQUEUE);
                     if(pool->append(users + sockfd)==false)
                         users[sockfd].close_conn();
                 }
@@ -170,6 +588,7 @@ int main(int argc, char *argv[])
             // 出现了可写事件
             else if (events[i].events & EPOLLOUT)
             {
+                users[sockfd].fired();
                 // 写入socket
                 if (!users[sockfd].write())
                 {
@@ -177,11 +596,80 @@ int main(int argc, char *argv[])
                 }
             }
         }
+        http_conn::expire_waits(users);
+        // 放在处理完这一批事件之后, 事件数组可以放心地改变大小
+        // 配置有错时整个保持不变; 资源包打不开时继续用旧包(mkpack先写临时文件再rename, 打开的总是完整的新包)
+        if (reload_config)
+        {
+            reload_config = 0;
+            std::shared_ptr<server_config> next = std::make_shared<server_config>();
+            if (build_config(config_path, overrides, *next))
+            {
+                std::string kept = next->keep_restart_only(*config);
+                if (!kept.empty())
+                {
+                    printf("restart required for %s, keeping current values\n", kept.c_str());
+                }
+                if (pool)
+                {
+                    pool->set_thread_number(next->threads);
+                    pool->set_max_requests(next->max_requests);
+                }
+                limiter.configure(next->rate, next->burst > 0 ? next->burst : next->rate, next->conns);
+                if (next->backlog != config->backlog)
+                {
+                    // 对已经在监听的socket再调用一次listen只是修改backlog
+                    listen(listenfd, next->backlog);
+                    if (tls_listenfd >= 0)
+                    {
+                        listen(tls_listenfd, next->backlog);
+                    }
+                    if (unix_listenfd >= 0)
+                    {
+                        listen(unix_listenfd, next->backlog);
+                    }
+                }
+                events.resize(next->max_events);
+                if (!load_pack(next->pack))
+                {
+                    next->pack = config->pack;
+                }
+                if (!capture.open(next->capture))
+                {
+                    next->capture.clear();
+                }
+                access_log.configure(next->access_log, next->log_segment);
+                content_cache.configure((size_t)next->cache_size << 20);
+                http_conn::m_idle_timeout = next->idle_timeout;
+                sse_events.configure(next->sse_queue, next->sse_policy == "disconnect");
+                config = next;
+                install_config(config);
+                printf("configuration reloaded\n");
+            }
+            fflush(stdout);
+        }
     }
 
     close(epollfd);
     close(listenfd);
+    if (tls_listenfd >= 0)
+    {
+        close(tls_listenfd);
+    }
+    if (unix_listenfd >= 0)
+    {
+        close(unix_listenfd);
+        if (config->unix_socket[0] != '@')
+        {
+            unlink(config->unix_socket.c_str());
+        }
+    }
+    // 关掉抓取文件, 缓冲的记录写出去; 工作线程之后再记录也只是被忽略
+    capture.open("");
     delete[] users;
     delete pool;
+    delete http_conn::m_ready;
+    delete http_conn::m_prefetch_pool;
+    delete http_conn::m_prefetched;
     return 0;
 }
\ No newline at end of file
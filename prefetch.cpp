@@ -0,0 +1,45 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "headers/prefetch.h"
+#include "headers/http_conn.h"
+
+static size_t page_size()
+{
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+bool pages_resident(const void *addr, size_t len)
+{
+    size_t page = page_size();
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+    size_t pages = ((uintptr_t)addr + len - start + page - 1) / page;
+    unsigned char vec[PREFETCH_WINDOW / 4096 + 2];
+    if (pages > sizeof(vec) || mincore((void *)start, pages * page, vec) < 0)
+    {
+        return true;
+    }
+    for (size_t i = 0; i < pages; ++i)
+    {
+        if (!(vec[i] & 1))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void prefetch_request::process()
+{
+    size_t page = page_size();
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+    size_t span = (uintptr_t)addr + len - start;
+    // MADV_POPULATE_READ(5.14)读完才返回, 文件被截短时返回错误而不是SIGBUS;
+    // 老内核上退回MADV_WILLNEED, 只是提交预读, 之后的writev可能仍要等一部分
+    if (madvise((void *)start, span, MADV_POPULATE_READ) < 0)
+    {
+        madvise((void *)start, span, MADV_WILLNEED);
+    }
+    http_conn::m_prefetched->push(conn);
+}
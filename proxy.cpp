@@ -0,0 +1,752 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "headers/proxy.h"
+#include "headers/router.h"
+
+static const int CONNECT_TIMEOUT_MS = 3000;
+static const int IO_TIMEOUT_MS = 30000;     // 工作线程里等上游的上限, 超时回复502
+
+// 请求方法, 下标和http_conn::METHOD一致
+static const char *const method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT"};
+
+// 逐跳的头部只对一段连接有效, 两个方向都不转发
+static bool hop_by_hop(const char *name, size_t len)
+{
+    static const char *const names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade", "HTTP2-Settings", "Expect"};
+    for (const char *n : names)
+    {
+        if (strlen(n) == len && strncasecmp(name, n, len) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 等待fd可读或可写, 超时或出错返回false
+static bool wait_fd(int fd, short events, int timeout_ms)
+{
+    struct pollfd p = {fd, events, 0};
+    int ret;
+    while ((ret = poll(&p, 1, timeout_ms)) < 0 && errno == EINTR)
+    {
+    }
+    return ret > 0;
+}
+
+upstream_group::upstream_group(const std::string &prefix, bool strip, BALANCE balance)
+    : m_prefix(prefix), m_strip(strip), m_balance(balance), m_next(0)
+{
+}
+
+bool upstream_group::add_server(const char *host_port)
+{
+    const char *colon = strrchr(host_port, ':');
+    if (!colon)
+    {
+        return false;
+    }
+    std::string host(host_port, colon - host_port);
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    std::unique_ptr<upstream_server> s(new upstream_server);
+    memset(&s->addr, 0, sizeof(s->addr));
+    s->addr.sin_family = AF_INET;
+    s->addr.sin_port = htons(port);
+    if (*end != '\0' || port <= 0 || port > 65535 || inet_pton(AF_INET, host.c_str(), &s->addr.sin_addr) != 1)
+    {
+        return false;
+    }
+    s->name = host_port;
+    s->active = 0;
+    s->requests = 0;
+    s->connects = 0;
+    s->failures = 0;
+    m_servers.push_back(std::move(s));
+    return true;
+}
+
+upstream_server *upstream_group::pick(unsigned attempt, unsigned &start)
+{
+    size_t n = m_servers.size();
+    if (attempt == 0)
+    {
+        if (m_balance == BALANCE_LEAST_CONN)
+        {
+            // 正在进行的请求最少的一台, 一样多时从轮转的位置开始找, 避免总是压在第一台上
+            unsigned base = m_next.fetch_add(1, std::memory_order_relaxed);
+            start = base % n;
+            for (size_t i = 1; i < n; ++i)
+            {
+                size_t k = (base + i) % n;
+                if (m_servers[k]->active.load(std::memory_order_relaxed) < m_servers[start]->active.load(std::memory_order_relaxed))
+                {
+                    start = k;
+                }
+            }
+        }
+        else
+        {
+            start = m_next.fetch_add(1, std::memory_order_relaxed) % n;
+        }
+    }
+    return m_servers[(start + attempt) % n].get();
+}
+
+upstream_pool *upstream_pool::local()
+{
+    // 线程退出时不回收: 工作线程和进程同生命周期
+    static thread_local upstream_pool *pool = new upstream_pool;
+    return pool;
+}
+
+upstream_pool::~upstream_pool()
+{
+    for (upstream_conn *c : m_idle)
+    {
+        close(c->fd);
+        delete c;
+    }
+}
+
+upstream_conn *upstream_pool::acquire(upstream_server *server, bool &reused)
+{
+    m_lock.lock();
+    // 从最近还回来的开始找, 它们最不可能已经被上游因为空闲而关掉
+    for (size_t i = m_idle.size(); i-- > 0;)
+    {
+        upstream_conn *c = m_idle[i];
+        if (c->server != server)
+        {
+            continue;
+        }
+        m_idle.erase(m_idle.begin() + i);
+        // 上游已经关闭(读到0)或者发来了多余的数据, 这个连接都不能用了
+        char probe;
+        ssize_t n = recv(c->fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            m_lock.unlock();
+            reused = true;
+            return c;
+        }
+        close(c->fd);
+        delete c;
+    }
+    m_lock.unlock();
+
+    reused = false;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    int ret = connect(fd, (const struct sockaddr *)&server->addr, sizeof(server->addr));
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (ret < 0 && (errno != EINPROGRESS || !wait_fd(fd, POLLOUT, CONNECT_TIMEOUT_MS)
+                    || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0))
+    {
+        close(fd);
+        return NULL;
+    }
+    server->connects++;
+    upstream_conn *c = new upstream_conn;
+    c->fd = fd;
+    c->server = server;
+    c->pool = this;
+    return c;
+}
+
+void upstream_pool::release(upstream_conn *conn, bool reusable)
+{
+    m_lock.lock();
+    if (reusable && m_idle.size() < (size_t)MAX_IDLE)
+    {
+        m_idle.push_back(conn);
+        conn = NULL;
+    }
+    m_lock.unlock();
+    if (conn)
+    {
+        close(conn->fd);
+        delete conn;
+    }
+}
+
+// 分块响应体只需要找到结尾, 数据不用保存
+class null_consumer : public body_consumer
+{
+public:
+    bool on_data(const char *data, size_t len) { return true; }
+    int on_end(char *out, int cap) { return 0; }
+};
+
+static null_consumer null_sink;
+
+proxy_exchange::proxy_exchange(upstream_group *group)
+    : m_group(group), m_conn(NULL), m_reused(false), m_has_body(false), m_chunked_request(false),
+      m_epollfd(-1), m_upstream_keep(false), m_mode(BODY_NONE), m_left(0), m_state(SENDING),
+      m_buf(NULL), m_buf_start(0), m_buf_len(0), m_pipe_len(0)
+{
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+proxy_exchange::~proxy_exchange()
+{
+    release();
+    delete[] m_buf;
+    if (m_pipe[0] >= 0)
+    {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+}
+
+// 只有响应完整转发、上游没有要求关闭、也没有多出来的数据时连接才放回池里
+void proxy_exchange::release()
+{
+    if (!m_conn)
+    {
+        return;
+    }
+    if (m_epollfd >= 0)
+    {
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_conn->fd, 0);
+        m_epollfd = -1;
+    }
+    m_conn->server->active--;
+    bool reusable = m_state == DONE && m_upstream_keep && m_buf_len == 0 && m_pipe_len == 0;
+    m_conn->pool->release(m_conn, reusable);
+    m_conn = NULL;
+}
+
+// 选一台上游并连接, 连不上就按顺序换下一台
+bool proxy_exchange::connect_upstream()
+{
+    unsigned start = 0;
+    for (unsigned attempt = 0; attempt < m_group->size(); ++attempt)
+    {
+        upstream_server *s = m_group->pick(attempt, start);
+        m_conn = upstream_pool::local()->acquire(s, m_reused);
+        if (m_conn)
+        {
+            s->active++;
+            s->requests++;
+            return true;
+        }
+        s->failures++;
+    }
+    return false;
+}
+
+bool proxy_exchange::send_all(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(m_conn->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN || !wait_fd(m_conn->fd, POLLOUT, IO_TIMEOUT_MS))
+            {
+                return false;
+            }
+            continue;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool proxy_exchange::begin(const request_view &req)
+{
+    // 请求行: 路径按原样转发, strip时把前缀换成'/'
+    m_request = method_names[req.method];
+    m_request += ' ';
+    if (m_group->strip())
+    {
+        m_request += '/';
+        m_request.append(req.rest, req.rest_len);
+    }
+    else
+    {
+        m_request.append(req.path, req.path_len);
+    }
+    if (req.query)
+    {
+        m_request += '?';
+        m_request += req.query;
+    }
+    m_request += " HTTP/1.1\r\n";
+
+    // 请求头: 解析时每行的\r\n被换成了\0\0
+    // 客户端带来的X-Forwarded-For不直接转发, 和对端地址合并成一行, 上游只看到一个这样的头
+    std::string forwarded;
+    const char *p = req.headers;
+    while (p < req.headers_end)
+    {
+        if (*p == '\0')
+        {
+            ++p;
+            continue;
+        }
+        const char *colon = strchr(p, ':');
+        if (colon && colon - p == 15 && strncasecmp(p, "X-Forwarded-For", 15) == 0)
+        {
+            const char *value = colon + 1 + strspn(colon + 1, " \t");
+            if (*value)
+            {
+                forwarded += value;
+                forwarded += ", ";
+            }
+        }
+        else if (colon && !hop_by_hop(p, colon - p))
+        {
+            m_request += p;
+            m_request += "\r\n";
+        }
+        p += strlen(p);
+    }
+    char ip[INET_ADDRSTRLEN] = "";
+    if (req.peer)
+    {
+        inet_ntop(AF_INET, &req.peer->sin_addr, ip, sizeof(ip));
+    }
+    m_request += "X-Forwarded-For: ";
+    m_request += forwarded;
+    m_request += ip;
+    m_request += "\r\nConnection: keep-alive\r\n\r\n";
+
+    m_has_body = req.content_length > 0 || req.chunked;
+    m_chunked_request = req.chunked;
+    m_buf = new char[BUFFER_SIZE];
+    return connect_upstream() && send_all(m_request.data(), m_request.size());
+}
+
+bool proxy_exchange::send_body(const char *data, size_t len)
+{
+    if (!m_chunked_request)
+    {
+        return send_all(data, len);
+    }
+    // 客户端的分块已经被解码, 每段重新编成一块
+    char size[24];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+    return len == 0 || (send_all(size, n) && send_all(data, len) && send_all("\r\n", 2));
+}
+
+bool proxy_exchange::finish_request()
+{
+    if (m_chunked_request && !send_all("0\r\n\r\n", 5))
+    {
+        return false;
+    }
+    if (read_head())
+    {
+        return true;
+    }
+    // 复用的连接可能刚好被上游关掉了; 没有请求体的请求换一个新连接重发一次
+    if (!m_reused || m_has_body)
+    {
+        return false;
+    }
+    m_state = SENDING;
+    m_upstream_keep = false;
+    m_conn->server->failures++;
+    release();
+    return connect_upstream() && send_all(m_request.data(), m_request.size()) && read_head();
+}
+
+// 读完整的响应头, 跳过1xx. 响应头放不进缓冲区时失败
+bool proxy_exchange::read_head()
+{
+    m_buf_start = 0;
+    m_buf_len = 0;
+    while (true)
+    {
+        if (m_buf_len == BUFFER_SIZE)
+        {
+            return false;
+        }
+        ssize_t n = recv(m_conn->fd, m_buf + m_buf_len, BUFFER_SIZE - m_buf_len, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR || (errno == EAGAIN && wait_fd(m_conn->fd, POLLIN, IO_TIMEOUT_MS)))
+            {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0)
+        {
+            return false;
+        }
+        m_buf_len += n;
+        char *end = (char *)memmem(m_buf, m_buf_len, "\r\n\r\n", 4);
+        if (!end)
+        {
+            continue;
+        }
+        int head_len = end + 4 - m_buf;
+        if (m_buf_len >= 12 && m_buf[9] == '1' && memcmp(m_buf, "HTTP/1.", 7) == 0)
+        {
+            // 100 Continue之类的临时响应, 客户端没有发Expect, 不转发
+            memmove(m_buf, m_buf + head_len, m_buf_len - head_len);
+            m_buf_len -= head_len;
+            continue;
+        }
+        return parse_head(head_len);
+    }
+}
+
+// 解析上游的响应头, 生成发给客户端的响应头(不含Connection和最后的空行)
+bool proxy_exchange::parse_head(int head_len)
+{
+    std::string head(m_buf, head_len - 2);
+    m_buf_start = head_len;
+    m_buf_len -= head_len;
+
+    size_t eol = head.find("\r\n");
+    if (head.compare(0, 7, "HTTP/1.") != 0 || eol < 12 || head[8] != ' ')
+    {
+        return false;
+    }
+    int status = atoi(head.c_str() + 9);
+    m_upstream_keep = head[7] == '1';
+    bool chunked = false;
+    long long length = -1;
+    m_head = "HTTP/1.1";
+    m_head.append(head, 8, eol - 8);
+    m_head += "\r\n";
+
+    std::string cl_line;
+    for (size_t pos = eol + 2; pos < head.size();)
+    {
+        size_t next = head.find("\r\n", pos);
+        if (next == std::string::npos)
+        {
+            break;
+        }
+        const char *line = head.c_str() + pos;
+        size_t len = next - pos;
+        pos = next + 2;
+        const char *colon = (const char *)memchr(line, ':', len);
+        if (!colon)
+        {
+            return false;
+        }
+        std::string value(colon + 1, line + len);
+        value.erase(0, value.find_first_not_of(" \t"));
+        size_t name_len = colon - line;
+        if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0)
+        {
+            if (strcasecmp(value.c_str(), "close") == 0)
+            {
+                m_upstream_keep = false;
+            }
+            else if (strcasecmp(value.c_str(), "keep-alive") == 0)
+            {
+                m_upstream_keep = true;
+            }
+            continue;
+        }
+        if (hop_by_hop(line, name_len))
+        {
+            continue;
+        }
+        if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0)
+        {
+            // 重复的Content-Length值相同时合并成一个, 不同时说不清响应在哪结束, 按502处理
+            char *end;
+            long long n = strtoll(value.c_str(), &end, 10);
+            if (n < 0 || *end != '\0' || (length >= 0 && n != length))
+            {
+                return false;
+            }
+            length = n;
+            // 和分块同时出现时以分块为准, 先不写
+            cl_line.assign(line, len);
+            continue;
+        }
+        if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)
+        {
+            size_t n = value.size();
+            chunked = n >= 7 && strcasecmp(value.c_str() + n - 7, "chunked") == 0;
+        }
+        m_head.append(line, len);
+        m_head += "\r\n";
+    }
+
+    // 解析器不接受HEAD, 这里不用考虑HEAD的响应
+    if (status == 204 || status == 304)
+    {
+        m_mode = BODY_NONE;
+    }
+    else if (chunked)
+    {
+        m_mode = BODY_CHUNKED;
+        m_decoder.reset();
+    }
+    else if (length >= 0)
+    {
+        m_mode = length > 0 ? BODY_LENGTH : BODY_NONE;
+        m_left = length;
+    }
+    else
+    {
+        // 长度由上游关闭连接决定, 客户端那边也只能这样结束
+        m_mode = BODY_EOF;
+        m_upstream_keep = false;
+    }
+    if (!chunked && length >= 0)
+    {
+        m_head += cl_line;
+        m_head += "\r\n";
+    }
+    m_state = m_mode == BODY_NONE ? DONE : BODY;
+    return true;
+}
+
+const std::string &proxy_exchange::client_head(bool &keep_alive)
+{
+    if (m_mode == BODY_EOF)
+    {
+        keep_alive = false;
+    }
+    m_head += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    return m_head;
+}
+
+proxy_exchange::PUMP proxy_exchange::next(const char *&data, int &len)
+{
+    data = NULL;
+    len = 0;
+    if (m_state == DONE)
+    {
+        return PUMP_DONE;
+    }
+    if (m_buf_len == 0)
+    {
+        int cap = BUFFER_SIZE;
+        if (m_mode == BODY_LENGTH && m_left < cap)
+        {
+            cap = m_left;
+        }
+        ssize_t n = recv(m_conn->fd, m_buf, cap, 0);
+        if (n < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? PUMP_WAIT_UPSTREAM : PUMP_ERROR;
+        }
+        if (n == 0)
+        {
+            if (m_mode != BODY_EOF)
+            {
+                // 响应体还没完整, 只能断开客户端连接让它知道
+                return PUMP_ERROR;
+            }
+            m_state = DONE;
+            return PUMP_DONE;
+        }
+        m_buf_start = 0;
+        m_buf_len = n;
+    }
+
+    size_t take = m_buf_len;
+    if (m_mode == BODY_LENGTH)
+    {
+        if ((long long)take >= m_left)
+        {
+            take = m_left;
+            m_state = DONE;
+        }
+        m_left -= take;
+    }
+    else if (m_mode == BODY_CHUNKED)
+    {
+        size_t used = 0;
+        chunked_decoder::RESULT r = m_decoder.feed(m_buf + m_buf_start, m_buf_len, used, &null_sink);
+        if (r == chunked_decoder::BAD_CHUNK || r == chunked_decoder::CONSUMER_ERROR)
+        {
+            return PUMP_ERROR;
+        }
+        if (r == chunked_decoder::DONE)
+        {
+            m_state = DONE;
+        }
+        take = used;
+    }
+    data = m_buf + m_buf_start;
+    len = take;
+    m_buf_start += take;
+    m_buf_len -= take;
+    return PUMP_DATA;
+}
+
+proxy_exchange::PUMP proxy_exchange::splice_to(int client_fd)
+{
+    // 已经读进缓冲区的部分先按普通方式发完
+    if (m_buf_len > 0 || (m_mode != BODY_LENGTH && m_mode != BODY_EOF))
+    {
+        return PUMP_DATA;
+    }
+    if (m_pipe[0] < 0)
+    {
+        if ((m_mode == BODY_LENGTH && m_left < SPLICE_THRESHOLD) || pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        {
+            return PUMP_DATA;
+        }
+    }
+    while (true)
+    {
+        if (m_pipe_len > 0)
+        {
+            ssize_t n = splice(m_pipe[0], NULL, client_fd, NULL, m_pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+            {
+                return errno == EAGAIN ? PUMP_WAIT_CLIENT : PUMP_ERROR;
+            }
+            m_pipe_len -= n;
+            continue;
+        }
+        if (m_state == DONE)
+        {
+            return PUMP_DONE;
+        }
+        size_t want = 1 << 20;
+        if (m_mode == BODY_LENGTH && m_left < (long long)want)
+        {
+            want = m_left;
+        }
+        ssize_t n = splice(m_conn->fd, NULL, m_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0)
+        {
+            return errno == EAGAIN ? PUMP_WAIT_UPSTREAM : PUMP_ERROR;
+        }
+        if (n == 0)
+        {
+            if (m_mode != BODY_EOF)
+            {
+                return PUMP_ERROR;
+            }
+            m_state = DONE;
+            continue;
+        }
+        m_pipe_len += n;
+        if (m_mode == BODY_LENGTH && (m_left -= n) == 0)
+        {
+            m_state = DONE;
+        }
+    }
+}
+
+void proxy_exchange::wait_upstream(int epollfd, int client_fd)
+{
+    epoll_event event;
+    event.data.fd = client_fd | UPSTREAM_EVENT;
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    if (m_epollfd < 0)
+    {
+        m_epollfd = epollfd;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, m_conn->fd, &event);
+    }
+    else
+    {
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, m_conn->fd, &event);
+    }
+}
+
+// 启动时由main注册, 之后只读
+static std::vector<upstream_group *> proxy_groups;
+
+bool add_proxy(const char *spec, bool strip, BALANCE balance)
+{
+    const char *eq = strchr(spec, '=');
+    if (!eq || spec[0] != '/' || eq == spec)
+    {
+        return false;
+    }
+    upstream_group *g = new upstream_group(std::string(spec, eq - spec), strip, balance);
+    std::string list(eq + 1);
+    size_t pos = 0;
+    while (pos <= list.size())
+    {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos)
+        {
+            comma = list.size();
+        }
+        if (!g->add_server(list.substr(pos, comma - pos).c_str()))
+        {
+            delete g;
+            return false;
+        }
+        pos = comma + 1;
+    }
+    proxy_groups.push_back(g);
+    return true;
+}
+
+// 前缀路由匹配到的就是某个组的前缀, 按长度和内容找回这个组
+static ROUTE_RESULT proxy_handler(const request_view &req, handler_response &resp)
+{
+    size_t prefix_len = req.path_len - req.rest_len;
+    upstream_group *group = NULL;
+    for (upstream_group *g : proxy_groups)
+    {
+        if (g->prefix().size() == prefix_len && memcmp(g->prefix().data(), req.path, prefix_len) == 0)
+        {
+            group = g;
+        }
+    }
+    if (!group)
+    {
+        return ROUTE_ERROR;
+    }
+    proxy_exchange *exchange = new proxy_exchange(group);
+    resp.proxy = exchange;
+    if (!exchange->begin(req))
+    {
+        return ROUTE_BAD_GATEWAY;
+    }
+    if (req.content_length > 0 || req.chunked)
+    {
+        resp.consumer = new proxy_body(exchange);
+    }
+    return ROUTE_OK;
+}
+
+void register_proxy_routes(router &r)
+{
+    for (upstream_group *g : proxy_groups)
+    {
+        r.add_prefix(g->prefix().c_str(), ROUTE_GET | ROUTE_POST | ROUTE_PUT, proxy_handler);
+    }
+}
+
+void print_proxy_stats()
+{
+    for (upstream_group *g : proxy_groups)
+    {
+        for (size_t i = 0; i < g->size(); ++i)
+        {
+            upstream_server *s = g->server(i);
+            printf("proxy %s -> %s: requests %llu, connects %llu, failures %llu, active %d\n",
+                   g->prefix().c_str(), s->name.c_str(), (unsigned long long)s->requests.load(),
+                   (unsigned long long)s->connects.load(), (unsigned long long)s->failures.load(), s->active.load());
+        }
+    }
+}
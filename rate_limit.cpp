@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <time.h>
+#include "headers/rate_limit.h"
+
+client_limiter limiter;
+
+client_limiter::client_limiter()
+    : m_slots(NULL), m_enabled(false), m_rate(0), m_burst(0), m_max_conns(0), m_epoch(0),
+      m_conn_rejects(0), m_request_rejects(0), m_table_full(0)
+{
+}
+
+// 粗粒度时钟走vDSO, 不进内核, 毫秒精度对令牌桶足够了
+uint64_t client_limiter::now_ms() const
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 - m_epoch;
+}
+
+uint64_t client_limiter::full_bucket(uint64_t now) const
+{
+    return (m_burst << 40) | (now & TIME_MASK);
+}
+
+void client_limiter::configure(double rate, double burst, int max_conns)
+{
+    // 配置检查保证rate为0或者不小于1
+    m_rate = rate >= 1 ? (uint64_t)(rate + 0.5) : 0;
+    // 容量至少一个令牌, 不能超过24位
+    m_burst = (uint64_t)((burst > 1 ? burst : 1) * 1000);
+    if (m_burst >= (1ull << 24))
+    {
+        m_burst = (1ull << 24) - 1;
+    }
+    m_max_conns = max_conns > 0 ? max_conns : 0;
+    m_enabled = m_rate > 0 || m_max_conns > 0;
+    // SIGHUP时会再次调用: 表只分配一次, 时间起点也不能变, 否则已有的令牌桶时间对不上
+    if (m_enabled && !m_slots)
+    {
+        m_slots = new slot[1u << SLOT_BITS];
+        for (uint32_t i = 0; i < (1u << SLOT_BITS); ++i)
+        {
+            m_slots[i].ip = 0;
+            m_slots[i].conns = 0;
+            m_slots[i].bucket = 0;
+        }
+        m_epoch = now_ms();
+    }
+}
+
+int client_limiter::acquire_conn(uint32_t ip)
+{
+    if (!m_enabled)
+    {
+        return NO_SLOT;
+    }
+    uint64_t now = now_ms();
+    uint32_t mask = (1u << SLOT_BITS) - 1;
+    uint32_t home = (ip * 2654435761u) >> (32 - SLOT_BITS);
+    int victim = NO_SLOT;
+    for (int i = 0; i < MAX_PROBE; ++i)
+    {
+        uint32_t idx = (home + i) & mask;
+        slot &s = m_slots[idx];
+        uint32_t cur = s.ip.load(std::memory_order_acquire);
+        if (cur == ip)
+        {
+            // 上限只在accept的线程里检查, 这里不会和另一次acquire竞争
+            if (m_max_conns && s.conns.load(std::memory_order_relaxed) >= m_max_conns)
+            {
+                m_conn_rejects.fetch_add(1, std::memory_order_relaxed);
+                return LIMITED;
+            }
+            s.conns.fetch_add(1, std::memory_order_relaxed);
+            return idx;
+        }
+        // 空槽, 或者没有连接并且很久没用过的槽
+        if (victim == NO_SLOT && (cur == 0 || (s.conns.load(std::memory_order_relaxed) == 0
+                                               && now - (s.bucket.load(std::memory_order_relaxed) & TIME_MASK) > AGE_MS)))
+        {
+            victim = idx;
+            if (cur == 0)
+            {
+                // 空槽之后不会再有这个IP
+                break;
+            }
+        }
+    }
+    if (victim == NO_SLOT)
+    {
+        m_table_full.fetch_add(1, std::memory_order_relaxed);
+        return NO_SLOT;
+    }
+    slot &s = m_slots[victim];
+    s.conns.store(1, std::memory_order_relaxed);
+    s.bucket.store(full_bucket(now), std::memory_order_relaxed);
+    s.ip.store(ip, std::memory_order_release);
+    return victim;
+}
+
+void client_limiter::release_conn(int slot)
+{
+    if (slot >= 0)
+    {
+        m_slots[slot].conns.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+bool client_limiter::take_token(int slot)
+{
+    if (slot < 0 || m_rate == 0)
+    {
+        return true;
+    }
+    std::atomic<uint64_t> &bucket = m_slots[slot].bucket;
+    uint64_t now = now_ms();
+    uint64_t old = bucket.load(std::memory_order_relaxed);
+    while (true)
+    {
+        uint64_t tokens = old >> 40;
+        uint64_t last = old & TIME_MASK;
+        // 经过的毫秒数 * 每秒的令牌数 = 补充的千分之一令牌数
+        uint64_t elapsed = now > last ? now - last : 0;
+        // 空闲很久时桶早就满了, 先截断免得乘法溢出
+        if (elapsed > m_burst)
+        {
+            elapsed = m_burst;
+        }
+        tokens += elapsed * m_rate;
+        if (tokens > m_burst)
+        {
+            tokens = m_burst;
+        }
+        if (tokens < 1000)
+        {
+            m_request_rejects.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        uint64_t next = ((tokens - 1000) << 40) | (now & TIME_MASK);
+        if (bucket.compare_exchange_weak(old, next, std::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+}
+
+void client_limiter::print_stats() const
+{
+    if (m_enabled)
+    {
+        printf("rate limit: %llu connections and %llu requests rejected, %llu untracked (table full)\n",
+               (unsigned long long)m_conn_rejects.load(), (unsigned long long)m_request_rejects.load(),
+               (unsigned long long)m_table_full.load());
+    }
+}
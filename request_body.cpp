@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include "headers/request_body.h"
+
+bool discard_consumer::on_data(const char *data, size_t len)
+{
+    m_bytes += len;
+    uint64_t h = m_hash;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h = (h ^ (uint8_t)data[i]) * 1099511628211ull;
+    }
+    m_hash = h;
+    return true;
+}
+
+int discard_consumer::on_end(char *out, int cap)
+{
+    int n = snprintf(out, cap, "received %llu bytes, fnv1a %016llx\n",
+                     (unsigned long long)m_bytes, (unsigned long long)m_hash);
+    return n < cap ? n : -1;
+}
+
+void chunked_decoder::reset()
+{
+    m_state = SIZE;
+    m_chunk_left = 0;
+    m_size_digits = 0;
+    m_trailer_bytes = 0;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+chunked_decoder::RESULT chunked_decoder::feed(const char *data, size_t len, size_t &consumed, body_consumer *consumer)
+{
+    size_t pos = 0;
+    while (pos < len && m_state != FINISHED)
+    {
+        // 块数据整段交给消费者, 其余状态逐字节解析
+        if (m_state == DATA)
+        {
+            size_t n = len - pos;
+            if (n > m_chunk_left)
+            {
+                n = m_chunk_left;
+            }
+            if (!consumer->on_data(data + pos, n))
+            {
+                consumed = pos;
+                return CONSUMER_ERROR;
+            }
+            pos += n;
+            m_chunk_left -= n;
+            if (m_chunk_left == 0)
+            {
+                m_state = DATA_CR;
+            }
+            continue;
+        }
+
+        char c = data[pos++];
+        switch (m_state)
+        {
+        case SIZE:
+        {
+            int v = hex_value(c);
+            if (v >= 0)
+            {
+                // 15位十六进制已经远超任何合理的上传, 再多就可能溢出
+                if (++m_size_digits > 15)
+                {
+                    return BAD_CHUNK;
+                }
+                m_chunk_left = (m_chunk_left << 4) | v;
+                break;
+            }
+            if (m_size_digits == 0)
+            {
+                return BAD_CHUNK;
+            }
+            if (c == ';' || c == ' ' || c == '\t')
+            {
+                m_state = SIZE_EXT;
+            }
+            else if (c == '\r')
+            {
+                m_state = SIZE_LF;
+            }
+            else
+            {
+                return BAD_CHUNK;
+            }
+            break;
+        }
+        case SIZE_EXT:
+            // 块扩展没有定义任何语义, 跳过
+            if (++m_trailer_bytes > MAX_TRAILER)
+            {
+                return BAD_CHUNK;
+            }
+            if (c == '\r')
+            {
+                m_state = SIZE_LF;
+            }
+            break;
+        case SIZE_LF:
+            if (c != '\n')
+            {
+                return BAD_CHUNK;
+            }
+            // 长度为0的块表示结束, 后面是trailer
+            m_state = m_chunk_left ? DATA : TRAILER_START;
+            m_trailer_bytes = 0;
+            break;
+        case DATA_CR:
+            if (c != '\r')
+            {
+                return BAD_CHUNK;
+            }
+            m_state = DATA_LF;
+            break;
+        case DATA_LF:
+            if (c != '\n')
+            {
+                return BAD_CHUNK;
+            }
+            m_state = SIZE;
+            m_size_digits = 0;
+            break;
+        case TRAILER_START:
+            // 空行结束整个请求体, 否则是一行trailer
+            m_state = c == '\r' ? END_LF : TRAILER_LINE;
+            break;
+        case TRAILER_LINE:
+            if (++m_trailer_bytes > MAX_TRAILER)
+            {
+                return BAD_CHUNK;
+            }
+            if (c == '\r')
+            {
+                m_state = TRAILER_LF;
+            }
+            break;
+        case TRAILER_LF:
+            if (c != '\n')
+            {
+                return BAD_CHUNK;
+            }
+            m_state = TRAILER_START;
+            break;
+        case END_LF:
+            if (c != '\n')
+            {
+                return BAD_CHUNK;
+            }
+            m_state = FINISHED;
+            break;
+        default:
+            return BAD_CHUNK;
+        }
+    }
+    consumed = pos;
+    return m_state == FINISHED ? DONE : NEED_MORE;
+}
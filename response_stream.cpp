@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <string.h>
+#include "headers/response_stream.h"
+
+// 块头最长是8位十六进制长度加CRLF, 块尾是CRLF
+static const int CHUNK_HEAD = 10;
+static const int CHUNK_TAIL = 2;
+
+chunked_writer::chunked_writer(body_producer *producer)
+    : m_producer(producer), m_buf(new char[BUFFER_SIZE]), m_start(0), m_len(0), m_finished(false)
+{
+}
+
+chunked_writer::~chunked_writer()
+{
+    delete m_producer;
+    delete[] m_buf;
+}
+
+bool chunked_writer::refill()
+{
+    int n = m_producer->produce(m_buf + CHUNK_HEAD, BUFFER_SIZE - CHUNK_HEAD - CHUNK_TAIL);
+    if (n < 0)
+    {
+        return false;
+    }
+    if (n > 0)
+    {
+        // 长度从数据前面倒着写, 省掉一次移动
+        static const char hex[] = "0123456789abcdef";
+        char *p = m_buf + CHUNK_HEAD;
+        *--p = '\n';
+        *--p = '\r';
+        for (unsigned v = n; v; v >>= 4)
+        {
+            *--p = hex[v & 15];
+        }
+        memcpy(m_buf + CHUNK_HEAD + n, "\r\n", CHUNK_TAIL);
+        m_start = p - m_buf;
+        m_len = CHUNK_HEAD + n + CHUNK_TAIL - m_start;
+        return true;
+    }
+    // 最后一块: "0\r\n", trailer, 空行
+    memcpy(m_buf, "0\r\n", 3);
+    int t = m_producer->trailers(m_buf + 3, BUFFER_SIZE - 3 - 2);
+    if (t < 0)
+    {
+        return false;
+    }
+    memcpy(m_buf + 3 + t, "\r\n", 2);
+    m_start = 0;
+    m_len = 3 + t + 2;
+    m_finished = true;
+    return true;
+}
+
+int pattern_producer::produce(char *buf, int cap)
+{
+    static const char pattern[] = "abcdefghijklmnopqrstuvwxyz0123456789\n";
+    static const int PATTERN_LEN = sizeof(pattern) - 1;
+    uint64_t left = m_total - m_sent;
+    int n = left < (uint64_t)cap ? (int)left : cap;
+    uint64_t h = m_hash;
+    for (int i = 0; i < n; ++i)
+    {
+        buf[i] = pattern[(m_sent + i) % PATTERN_LEN];
+        h = (h ^ (uint8_t)buf[i]) * 1099511628211ull;
+    }
+    m_hash = h;
+    m_sent += n;
+    return n;
+}
+
+int pattern_producer::trailers(char *buf, int cap)
+{
+    int n = snprintf(buf, cap, "X-Checksum: fnv1a %016llx\r\n", (unsigned long long)m_hash);
+    return n < cap ? n : -1;
+}
@@ -0,0 +1,123 @@
+#include <string.h>
+#include <strings.h>
+#include <deque>
+#include "headers/router.h"
+
+const char *request_view::header(const char *name) const
+{
+    size_t n = strlen(name);
+    const char *p = headers;
+    while (p < headers_end)
+    {
+        if (*p == '\0')
+        {
+            ++p;
+            continue;
+        }
+        if (strncasecmp(p, name, n) == 0 && p[n] == ':')
+        {
+            p += n + 1;
+            return p + strspn(p, " \t");
+        }
+        p += strlen(p);
+    }
+    return NULL;
+}
+
+router::router()
+{
+    m_build.push_back(build_node{std::map<char, int>(), -1, -1});
+}
+
+void router::add_exact(const char *path, unsigned methods, route_handler handler)
+{
+    add(path, methods, handler, false);
+}
+
+void router::add_prefix(const char *prefix, unsigned methods, route_handler handler)
+{
+    add(prefix, methods, handler, true);
+}
+
+void router::add(const char *path, unsigned methods, route_handler handler, bool prefix)
+{
+    int cur = 0;
+    for (const char *p = path; *p; ++p)
+    {
+        std::map<char, int>::iterator it = m_build[cur].kids.find(*p);
+        if (it != m_build[cur].kids.end())
+        {
+            cur = it->second;
+            continue;
+        }
+        int next = m_build.size();
+        m_build.push_back(build_node{std::map<char, int>(), -1, -1});
+        m_build[cur].kids[*p] = next;
+        cur = next;
+    }
+    route r = {handler, methods, strlen(path)};
+    m_routes.push_back(r);
+    // 同一个路径重复注册时后注册的生效
+    (prefix ? m_build[cur].prefix : m_build[cur].exact) = m_routes.size() - 1;
+}
+
+// 按层次展开, 同一个节点的出边相邻, 节点本身也大致按访问顺序排列
+void router::compile()
+{
+    m_nodes.assign(m_build.size(), node());
+    m_edge_char.clear();
+    m_edge_target.clear();
+
+    std::vector<int> order(m_build.size(), -1);
+    std::deque<int> queue;
+    queue.push_back(0);
+    order[0] = 0;
+    int next_id = 1;
+    while (!queue.empty())
+    {
+        int b = queue.front();
+        queue.pop_front();
+        node &n = m_nodes[order[b]];
+        n.first_edge = m_edge_char.size();
+        n.edge_count = m_build[b].kids.size();
+        n.exact = m_build[b].exact;
+        n.prefix = m_build[b].prefix;
+        for (std::map<char, int>::const_iterator it = m_build[b].kids.begin(); it != m_build[b].kids.end(); ++it)
+        {
+            order[it->second] = next_id++;
+            m_edge_char.push_back(it->first);
+            m_edge_target.push_back(order[it->second]);
+            queue.push_back(it->second);
+        }
+    }
+}
+
+const route *router::match(const char *path, size_t len) const
+{
+    if (m_nodes.empty())
+    {
+        return NULL;
+    }
+    int best = m_nodes[0].prefix;
+    uint32_t cur = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        const node &n = m_nodes[cur];
+        const char *edges = m_edge_char.data() + n.first_edge;
+        const char *hit = n.edge_count ? (const char *)memchr(edges, path[i], n.edge_count) : NULL;
+        if (!hit)
+        {
+            return best >= 0 ? &m_routes[best] : NULL;
+        }
+        cur = m_edge_target[n.first_edge + (hit - edges)];
+        if (m_nodes[cur].prefix >= 0)
+        {
+            best = m_nodes[cur].prefix;
+        }
+    }
+    if (m_nodes[cur].exact >= 0)
+    {
+        return &m_routes[m_nodes[cur].exact];
+    }
+    return best >= 0 ? &m_routes[best] : NULL;
+}
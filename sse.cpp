@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <algorithm>
+#include "headers/http_conn.h"
+#include "headers/sse.h"
+
+sse_hub sse_events;
+
+void sse_subscriber::advance(size_t n)
+{
+    while (n > 0)
+    {
+        size_t left = queue.front()->size() - offset;
+        if (n < left)
+        {
+            offset += n;
+            return;
+        }
+        n -= left;
+        queue.pop_front();
+        offset = 0;
+    }
+}
+
+void sse_channel::subscribe(sse_subscriber *s)
+{
+    m_lock.lock();
+    m_subs.push_back(s);
+    m_lock.unlock();
+    sse_events.m_subscribers++;
+}
+
+void sse_channel::unsubscribe(sse_subscriber *s)
+{
+    m_lock.lock();
+    std::vector<sse_subscriber *>::iterator it = std::find(m_subs.begin(), m_subs.end(), s);
+    if (it != m_subs.end())
+    {
+        // 顺序无所谓, 和最后一个交换再删
+        *it = m_subs.back();
+        m_subs.pop_back();
+    }
+    m_lock.unlock();
+    sse_events.m_subscribers--;
+}
+
+// 每一行前面加 "data: ", 事件以空行结束
+// 客户端把\r\n、\n和单独的\r都当作换行, 三种都要拆开, 否则发布的内容可以在一行里夹带 id:/event:/retry: 字段
+static std::string *encode(uint64_t id, const char *data, size_t len)
+{
+    std::string *e = new std::string;
+    e->reserve(len + 32);
+    char head[32];
+    int n = snprintf(head, sizeof(head), "id: %llu\n", (unsigned long long)id);
+    e->append(head, n);
+    const char *end = data + len;
+    do
+    {
+        const char *nl = data;
+        while (nl < end && *nl != '\n' && *nl != '\r')
+        {
+            ++nl;
+        }
+        e->append("data: ", 6);
+        e->append(data, nl - data);
+        e->push_back('\n');
+        data = nl + (nl + 1 < end && nl[0] == '\r' && nl[1] == '\n' ? 2 : 1);
+    } while (data < end);
+    e->push_back('\n');
+    return e;
+}
+
+int sse_channel::publish(const char *data, size_t len)
+{
+    size_t limit = sse_events.m_queue_limit.load(std::memory_order_relaxed);
+    bool disconnect = sse_events.m_disconnect.load(std::memory_order_relaxed);
+    uint64_t dropped = 0;
+    uint64_t disconnected = 0;
+
+    m_lock.lock();
+    sse_buffer ev(encode(++m_last_id, data, len));
+    int n = m_subs.size();
+    for (int i = 0; i < n; ++i)
+    {
+        sse_subscriber *s = m_subs[i];
+        s->lock.lock();
+        if (!s->overflow)
+        {
+            if (s->queue.size() >= limit)
+            {
+                if (disconnect)
+                {
+                    s->overflow = true;
+                    s->queue.clear();
+                    s->offset = 0;
+                    ++disconnected;
+                }
+                else
+                {
+                    // 已经发了一部分的那个不能丢; 队列里只有它时丢掉新的这个
+                    size_t oldest = s->offset > 0 ? 1 : 0;
+                    if (oldest < s->queue.size())
+                    {
+                        s->queue.erase(s->queue.begin() + oldest);
+                    }
+                    ++dropped;
+                }
+            }
+            if (!s->overflow && s->queue.size() < limit)
+            {
+                s->queue.push_back(ev);
+            }
+        }
+        // 在锁里注册: 连接发空队列后也是在锁里注册EPOLLRDHUP, 两边不会互相覆盖
+        if (s->idle && (s->overflow || !s->queue.empty()))
+        {
+            s->idle = false;
+            s->conn->sse_wake();
+        }
+        s->lock.unlock();
+    }
+    m_lock.unlock();
+
+    sse_events.m_events++;
+    sse_events.m_dropped += dropped;
+    sse_events.m_disconnected += disconnected;
+    return n;
+}
+
+void sse_hub::configure(int queue_limit, bool disconnect)
+{
+    m_queue_limit = queue_limit;
+    m_disconnect = disconnect;
+}
+
+// 已经释放的频道留在名字表里的空项, 调用者持有m_lock
+void sse_hub::purge()
+{
+    std::map<std::string, std::weak_ptr<sse_channel>>::iterator it = m_channels.begin();
+    while (it != m_channels.end())
+    {
+        if (it->second.expired())
+        {
+            it = m_channels.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+std::shared_ptr<sse_channel> sse_hub::channel(const std::string &name, bool create)
+{
+    m_lock.lock();
+    std::shared_ptr<sse_channel> c;
+    std::map<std::string, std::weak_ptr<sse_channel>>::iterator it = m_channels.find(name);
+    if (it != m_channels.end())
+    {
+        c = it->second.lock();
+    }
+    if (!c && create)
+    {
+        if (it == m_channels.end() && m_channels.size() >= MAX_CHANNELS)
+        {
+            purge();
+        }
+        if (it != m_channels.end() || m_channels.size() < MAX_CHANNELS)
+        {
+            c = std::make_shared<sse_channel>();
+            m_channels[name] = c;
+        }
+    }
+    m_lock.unlock();
+    return c;
+}
+
+std::string sse_hub::stats()
+{
+    m_lock.lock();
+    purge();
+    size_t channels = m_channels.size();
+    m_lock.unlock();
+    if (channels == 0 && m_events.load() == 0)
+    {
+        return "";
+    }
+    char buf[160];
+    int n = snprintf(buf, sizeof(buf), "sse: %zu channels, %d subscribers, %llu events, %llu dropped, %llu disconnected\n",
+                     channels, m_subscribers.load(), (unsigned long long)m_events.load(),
+                     (unsigned long long)m_dropped.load(), (unsigned long long)m_disconnected.load());
+    return std::string(buf, n);
+}
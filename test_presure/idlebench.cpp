@@ -0,0 +1,430 @@
+// 空闲连接的规模测试: 分步建立N个keep-alive连接, 每个连接发一个请求、读完响应之后就不再发送.
+// 每一步建完之后在随机挑出的空闲连接上依次发一批请求(少量的活跃请求), 打印一行:
+//   conns      当前的空闲连接数
+//   accept/s   这一步的建连接速率(从connect到读完第一个响应)
+//   rss        服务器的RSS(/proc/<pid>/status 的 VmRSS)
+//   tcp_mem    内核里TCP socket收发队列占的内存(/proc/net/sockstat 的 mem), 空闲连接没有排队的数据时接近0
+//   slab       内核slab(/proc/meminfo 的 Slab), socket、file、epoll项等结构体都在这里
+//   B/conn     相对开始时, 服务器RSS、TCP内存和slab平均每个连接增加了多少. 回环上客户端那一端的内核内存也算在里面
+//   p50/p99    活跃请求的延迟
+//
+//   idlebench -P 服务器pid [-n 连接数] [-s 每步连接数] [-a 源地址数] [-q 每步活跃请求数] [-u 路径] [-m 上限] host:port
+//
+// 默认 -n 10000 -s 1000 -a 1 -q 200 -u /index.html. -a k 时轮流绑定 127.0.0.1 ~ 127.0.0.k 作为源地址,
+// 每个源地址各有一套临时端口, 一个地址最多约28000个连接. 客户端和服务器都需要足够的 ulimit -n(这里会把软限制提到硬限制)
+// -m 给出服务器RSS每个连接增加的字节数上限, 最后一步超过时以1退出, 用来发现每连接内存的回归
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// 同时在建的连接数, 再多服务器的listen队列会丢SYN
+static const int MAX_PENDING = 128;
+
+struct conn
+{
+    int fd;
+    bool idle;              // 第一个响应已经读完
+    std::string in;         // 正在读的响应
+};
+
+static sockaddr_in server_addr;
+static std::string request;
+static int epfd;
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// /proc/<pid>/status 里的VmRSS, 字节
+static long long server_rss(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return -1;
+    }
+    char line[256];
+    long long kb = -1;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (strncmp(line, "VmRSS:", 6) == 0)
+        {
+            kb = atoll(line + 6);
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+// /proc/meminfo 里的Slab, 字节
+static long long kernel_slab()
+{
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (!f)
+    {
+        return -1;
+    }
+    char line[256];
+    long long kb = -1;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (strncmp(line, "Slab:", 5) == 0)
+        {
+            kb = atoll(line + 5);
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+// /proc/net/sockstat 里 "TCP: ... mem N" 的页数, 换成字节
+static long long tcp_mem()
+{
+    FILE *f = fopen("/proc/net/sockstat", "r");
+    if (!f)
+    {
+        return -1;
+    }
+    char line[256];
+    long long pages = -1;
+    while (fgets(line, sizeof(line), f))
+    {
+        const char *m = strstr(line, " mem ");
+        if (strncmp(line, "TCP:", 4) == 0 && m)
+        {
+            pages = atoll(m + 5);
+            break;
+        }
+    }
+    fclose(f);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// 响应读完了没有: 响应头之后还要有Content-Length字节
+static bool response_complete(const std::string &in)
+{
+    size_t end = in.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+        return false;
+    }
+    size_t len = 0;
+    size_t pos = 0;
+    while ((pos = in.find("\r\n", pos)) != std::string::npos && pos < end)
+    {
+        pos += 2;
+        if (strncasecmp(in.c_str() + pos, "Content-Length:", 15) == 0)
+        {
+            len = strtoull(in.c_str() + pos + 15, NULL, 10);
+        }
+    }
+    return in.size() >= end + 4 + len;
+}
+
+static bool start_connect(conn &c, int index, int addrs)
+{
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c.fd < 0)
+    {
+        perror("socket");
+        return false;
+    }
+    if (addrs > 1)
+    {
+        // 端口到connect时才按(源地址, 目的地址)选, 每个源地址都能用满临时端口
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        sockaddr_in src = {};
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000001 + index % addrs);
+        if (bind(c.fd, (sockaddr *)&src, sizeof(src)) < 0)
+        {
+            perror("bind");
+            return false;
+        }
+    }
+    if (connect(c.fd, (sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS)
+    {
+        perror("connect");
+        return false;
+    }
+    c.idle = false;
+    epoll_event e;
+    e.events = EPOLLOUT;
+    e.data.u32 = index;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &e);
+    return true;
+}
+
+// 连接上了就发请求, 之后读响应; 读完返回1, 出错返回-1
+static int on_event(conn &c, uint32_t ev, int index)
+{
+    if (ev & (EPOLLERR | EPOLLHUP))
+    {
+        return -1;
+    }
+    if (ev & EPOLLOUT)
+    {
+        if (send(c.fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+        {
+            return -1;
+        }
+        epoll_event e;
+        e.events = EPOLLIN;
+        e.data.u32 = index;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &e);
+        return 0;
+    }
+    char buf[16384];
+    while (true)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EAGAIN)
+        {
+            return 0;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        c.in.append(buf, n);
+        if (response_complete(c.in))
+        {
+            // 空闲连接不再需要事件, 从epoll里拿掉; 活跃请求阻塞地收发
+            c.in.clear();
+            c.in.shrink_to_fit();
+            c.idle = true;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, NULL);
+            return 1;
+        }
+    }
+}
+
+// 在一个空闲连接上发一个请求并等响应读完, 返回延迟(微秒), 出错返回-1
+static long long active_request(conn &c)
+{
+    uint64_t start = now_us();
+    if (send(c.fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+    {
+        return -1;
+    }
+    char buf[16384];
+    std::string in;
+    while (!response_complete(in))
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EAGAIN)
+        {
+            struct timespec ts = {0, 20000};
+            nanosleep(&ts, NULL);
+            if (now_us() - start > 5000000)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        in.append(buf, n);
+    }
+    return now_us() - start;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s -P server_pid [-n conns] [-s step] [-a source_addrs] [-q active_per_step] [-u path] "
+                    "[-m max_bytes_per_conn] host:port\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int pid = 0;
+    int total = 10000;
+    int step = 1000;
+    int addrs = 1;
+    int active = 200;
+    long long max_per_conn = 0;
+    const char *path = "/index.html";
+    int opt;
+    while ((opt = getopt(argc, argv, "P:n:s:a:q:u:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'P':
+            pid = atoi(optarg);
+            break;
+        case 'n':
+            total = atoi(optarg);
+            break;
+        case 's':
+            step = atoi(optarg);
+            break;
+        case 'a':
+            addrs = atoi(optarg);
+            break;
+        case 'q':
+            active = atoi(optarg);
+            break;
+        case 'u':
+            path = optarg;
+            break;
+        case 'm':
+            max_per_conn = atoll(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || pid <= 0 || total <= 0 || step <= 0 || addrs <= 0 || addrs > 254 || active < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string target = argv[optind];
+    size_t colon = target.rfind(':');
+    if (colon == std::string::npos)
+    {
+        fprintf(stderr, "bad address %s\n", target.c_str());
+        return 1;
+    }
+    std::string host = target.substr(0, colon);
+    addrinfo hints = {}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), target.c_str() + colon + 1, &hints, &res) != 0)
+    {
+        fprintf(stderr, "cannot resolve %s\n", target.c_str());
+        return 1;
+    }
+    memcpy(&server_addr, res->ai_addr, sizeof(server_addr));
+    freeaddrinfo(res);
+    request = "GET " + std::string(path) + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: keep-alive\r\n\r\n";
+
+    // 每个连接一个fd, 再留一些给epoll和/proc
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if ((long long)total + 32 > (long long)rl.rlim_cur)
+    {
+        total = rl.rlim_cur - 32;
+        fprintf(stderr, "open files limited to %llu, ramping to %d connections\n", (unsigned long long)rl.rlim_cur, total);
+    }
+
+    std::vector<conn> conns(total);
+    epfd = epoll_create1(0);
+    std::vector<epoll_event> events(1024);
+    long long rss0 = server_rss(pid);
+    long long tcp0 = tcp_mem();
+    long long slab0 = kernel_slab();
+    if (rss0 < 0)
+    {
+        fprintf(stderr, "cannot read /proc/%d/status\n", pid);
+        return 1;
+    }
+    printf("baseline: server rss %.1f MB, tcp_mem %.1f MB, slab %.1f MB\n", rss0 / 1048576.0, tcp0 / 1048576.0,
+           slab0 / 1048576.0);
+    printf("%8s %9s %8s %10s %8s %10s %10s %11s %8s %8s\n", "conns", "accept/s", "rss MB", "tcp_mem MB", "slab MB",
+           "rss B/conn", "tcp B/conn", "slab B/conn", "p50 ms", "p99 ms");
+    srand(time(NULL));
+
+    long long per_conn = 0;
+    int opened = 0;
+    while (opened < total)
+    {
+        int goal = std::min(total, opened + step);
+        int next = opened;
+        int done = opened;
+        int pending = 0;
+        uint64_t start = now_us();
+        while (done < goal)
+        {
+            while (next < goal && pending < MAX_PENDING)
+            {
+                if (!start_connect(conns[next], next, addrs))
+                {
+                    return 1;
+                }
+                ++next;
+                ++pending;
+            }
+            int n = epoll_wait(epfd, events.data(), events.size(), 5000);
+            if (n == 0)
+            {
+                fprintf(stderr, "stalled at %d connections\n", done);
+                return 1;
+            }
+            for (int i = 0; i < n; ++i)
+            {
+                int index = events[i].data.u32;
+                int r = on_event(conns[index], events[i].events, index);
+                if (r < 0)
+                {
+                    fprintf(stderr, "connection %d failed after %d connections\n", index, done);
+                    return 1;
+                }
+                if (r > 0)
+                {
+                    ++done;
+                    --pending;
+                }
+            }
+        }
+        double rate = (goal - opened) / ((now_us() - start) / 1e6);
+        opened = goal;
+
+        // 活跃请求: 随机挑空闲连接, 一个一个地发
+        std::vector<long long> lat;
+        for (int i = 0; i < active; ++i)
+        {
+            long long us = active_request(conns[rand() % opened]);
+            if (us < 0)
+            {
+                fprintf(stderr, "active request failed at %d connections\n", opened);
+                return 1;
+            }
+            lat.push_back(us);
+        }
+        std::sort(lat.begin(), lat.end());
+        double p50 = lat.empty() ? 0 : lat[lat.size() / 2] / 1000.0;
+        double p99 = lat.empty() ? 0 : lat[lat.size() * 99 / 100] / 1000.0;
+
+        long long rss = server_rss(pid);
+        long long tcp = tcp_mem();
+        long long slab = kernel_slab();
+        per_conn = (rss - rss0) / opened;
+        printf("%8d %9.0f %8.1f %10.1f %8.1f %10lld %10lld %11lld %8.3f %8.3f\n", opened, rate, rss / 1048576.0,
+               tcp / 1048576.0, slab / 1048576.0, per_conn, (tcp - tcp0) / opened, (slab - slab0) / opened, p50, p99);
+        fflush(stdout);
+    }
+    if (max_per_conn > 0 && per_conn > max_per_conn)
+    {
+        printf("FAIL: %lld bytes of server rss per connection, limit %lld\n", per_conn, max_per_conn);
+        return 1;
+    }
+    return 0;
+}
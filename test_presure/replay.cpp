@@ -0,0 +1,537 @@
+// 重放服务器抓取(配置项capture)的请求, 保持原来的时间间隔和连接复用关系
+//
+//   replay [-s 倍速] [-c 线程数] [-n 请求数] host:port capture_file
+//   replay -d capture_file              把记录打印成文本, 不发送
+//
+// -s 2 以两倍速重放, -s 0 不等待, 尽快发完. 抓取时的每个连接对应重放时的一个连接,
+// 连接按序号分到各个线程, 一个线程里的请求依次发送; 前一个响应太慢时后面的请求会晚于计划发出, 这个延迟单独统计.
+// TLS端口上抓到的请求也用明文发送
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "../headers/capture.h"
+
+// 和 http_conn::METHOD 的顺序一致
+static const char *const method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT"};
+
+struct request
+{
+    capture_record rec;
+    std::string path;
+    std::string etag;
+};
+
+struct worker
+{
+    pthread_t thread;
+    std::vector<const request *> requests;  // 按时间排好
+    std::vector<uint32_t> latency_us;
+    std::map<int, uint64_t> status;         // 状态码 -> 次数, 0表示连接出错
+    uint64_t lag_total_us;
+    uint64_t lag_max_us;
+    uint64_t connects;
+};
+
+static sockaddr_in server_addr;
+static std::string host_header;
+static double speed = 1;
+static uint64_t replay_start;
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool load(const char *file, std::vector<request> &out, uint64_t &start_us)
+{
+    FILE *f = fopen(file, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "cannot open %s: %s\n", file, strerror(errno));
+        return false;
+    }
+    capture_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0)
+    {
+        fprintf(stderr, "%s is not a capture file\n", file);
+        fclose(f);
+        return false;
+    }
+    start_us = header.start_us;
+    request r;
+    char buf[65536];
+    while (fread(&r.rec, sizeof(r.rec), 1, f) == 1)
+    {
+        // 服务器停止时最后一条记录可能只写了一半
+        if (fread(buf, 1, r.rec.path_len + r.rec.etag_len, f) != (size_t)(r.rec.path_len + r.rec.etag_len))
+        {
+            break;
+        }
+        r.path.assign(buf, r.rec.path_len);
+        r.etag.assign(buf + r.rec.path_len, r.rec.etag_len);
+        out.push_back(r);
+    }
+    fclose(f);
+    // 各个工作线程写记录时取时间和写文件之间有先后, 相邻的记录可能差几微秒的顺序
+    std::stable_sort(out.begin(), out.end(),
+                     [](const request &a, const request &b) { return a.rec.time_us < b.rec.time_us; });
+    return true;
+}
+
+static void dump(const std::vector<request> &reqs, uint64_t start_us)
+{
+    time_t t = start_us / 1000000;
+    printf("# captured at %s", ctime(&t));
+    printf("# time_ms conn method path flags body etag\n");
+    for (size_t i = 0; i < reqs.size(); ++i)
+    {
+        const capture_record &r = reqs[i].rec;
+        printf("%.3f %u %s %s %s%s%s%s %u %s\n", r.time_us / 1000.0, r.conn,
+               r.method < 8 ? method_names[r.method] : "?", reqs[i].path.c_str(),
+               r.flags & CAPTURE_GZIP ? "g" : "-", r.flags & CAPTURE_KEEP_ALIVE ? "k" : "-",
+               r.flags & CAPTURE_CHUNKED ? "c" : "-", r.flags & CAPTURE_TLS ? "t" : "-",
+               r.body_len, reqs[i].etag.empty() ? "-" : reqs[i].etag.c_str());
+    }
+}
+
+static int connect_server()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_request(int fd, const request &r)
+{
+    const capture_record &rec = r.rec;
+    std::string head = std::string(rec.method < 8 ? method_names[rec.method] : "GET") + " " + r.path + " HTTP/1.1\r\n";
+    head += "Host: " + host_header + "\r\n";
+    if (rec.flags & CAPTURE_GZIP)
+    {
+        head += "Accept-Encoding: gzip\r\n";
+    }
+    if (!r.etag.empty())
+    {
+        head += "If-None-Match: " + r.etag + "\r\n";
+    }
+    head += rec.flags & CAPTURE_KEEP_ALIVE ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    if (rec.flags & CAPTURE_CHUNKED)
+    {
+        // 分块请求体的长度没有记录, 发一个空的请求体
+        head += "Transfer-Encoding: chunked\r\n\r\n0\r\n\r\n";
+        return send_all(fd, head.data(), head.size());
+    }
+    if (rec.body_len > 0)
+    {
+        head += "Content-Length: " + std::to_string(rec.body_len) + "\r\n";
+    }
+    head += "\r\n";
+    if (!send_all(fd, head.data(), head.size()))
+    {
+        return false;
+    }
+    static const std::string filler(65536, 'x');
+    for (uint64_t left = rec.body_len; left > 0;)
+    {
+        size_t n = left < filler.size() ? left : filler.size();
+        if (!send_all(fd, filler.data(), n))
+        {
+            return false;
+        }
+        left -= n;
+    }
+    return true;
+}
+
+// 读完一个响应, 返回状态码, 出错返回0; keep表示连接还能继续用
+class response_reader
+{
+public:
+    int read(int fd, bool head_request, bool &keep);
+
+private:
+    bool fill(int fd);
+    bool skip(int fd, uint64_t n);
+    bool line(int fd, std::string &out);
+
+    std::string m_buf;      // 已经收到还没处理的字节
+};
+
+bool response_reader::fill(int fd)
+{
+    char tmp[65536];
+    ssize_t n;
+    do
+    {
+        n = recv(fd, tmp, sizeof(tmp), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+    {
+        return false;
+    }
+    m_buf.append(tmp, n);
+    return true;
+}
+
+bool response_reader::skip(int fd, uint64_t n)
+{
+    while (m_buf.size() < n)
+    {
+        n -= m_buf.size();
+        m_buf.clear();
+        if (!fill(fd))
+        {
+            return false;
+        }
+    }
+    m_buf.erase(0, n);
+    return true;
+}
+
+bool response_reader::line(int fd, std::string &out)
+{
+    size_t pos;
+    while ((pos = m_buf.find("\r\n")) == std::string::npos)
+    {
+        if (!fill(fd))
+        {
+            return false;
+        }
+    }
+    out.assign(m_buf, 0, pos);
+    m_buf.erase(0, pos + 2);
+    return true;
+}
+
+int response_reader::read(int fd, bool head_request, bool &keep)
+{
+    size_t end;
+    while ((end = m_buf.find("\r\n\r\n")) == std::string::npos)
+    {
+        if (!fill(fd))
+        {
+            return 0;
+        }
+    }
+    std::string head = m_buf.substr(0, end + 2);
+    m_buf.erase(0, end + 4);
+    int status = 0;
+    if (sscanf(head.c_str(), "HTTP/1.%*d %d", &status) != 1)
+    {
+        return 0;
+    }
+    long long length = -1;
+    bool chunked = false;
+    keep = true;
+    for (size_t p = head.find("\r\n") + 2; p < head.size(); p = head.find("\r\n", p) + 2)
+    {
+        const char *h = head.c_str() + p;
+        std::string value = head.substr(p, head.find("\r\n", p) - p);
+        if (strncasecmp(h, "Content-Length:", 15) == 0)
+        {
+            length = atoll(h + 15);
+        }
+        else if (strncasecmp(h, "Transfer-Encoding:", 18) == 0 && value.find("chunked") != std::string::npos)
+        {
+            chunked = true;
+        }
+        else if (strncasecmp(h, "Connection:", 11) == 0 && strncasecmp(h + 11 + strspn(h + 11, " "), "close", 5) == 0)
+        {
+            keep = false;
+        }
+    }
+    if (head_request || status == 304 || status == 204 || status / 100 == 1)
+    {
+        return status;
+    }
+    if (chunked)
+    {
+        std::string size_line;
+        while (true)
+        {
+            if (!line(fd, size_line))
+            {
+                return 0;
+            }
+            uint64_t n = strtoull(size_line.c_str(), NULL, 16);
+            if (n == 0)
+            {
+                // 最后一块之后可能有trailer, 读到空行为止
+                while (line(fd, size_line) && !size_line.empty())
+                {
+                }
+                return status;
+            }
+            if (!skip(fd, n + 2))
+            {
+                return 0;
+            }
+        }
+    }
+    if (length >= 0)
+    {
+        return skip(fd, length) ? status : 0;
+    }
+    // 没有长度, 读到连接关闭
+    while (fill(fd))
+    {
+        m_buf.clear();
+    }
+    m_buf.clear();
+    keep = false;
+    return status;
+}
+
+struct replay_conn
+{
+    int fd = -1;
+    response_reader reader;
+};
+
+static void *run(void *arg)
+{
+    worker *w = (worker *)arg;
+    std::map<uint32_t, replay_conn> conns;
+    // 每个连接最后一个请求的位置, 发完就关闭
+    std::map<uint32_t, size_t> last;
+    for (size_t i = 0; i < w->requests.size(); ++i)
+    {
+        last[w->requests[i]->rec.conn] = i;
+    }
+    for (size_t i = 0; i < w->requests.size(); ++i)
+    {
+        const request &r = *w->requests[i];
+        uint64_t due = replay_start + (speed > 0 ? (uint64_t)(r.rec.time_us / speed) : 0);
+        uint64_t now = now_us();
+        if (now < due)
+        {
+            usleep(due - now);
+            now = now_us();
+        }
+        else
+        {
+            w->lag_total_us += now - due;
+            w->lag_max_us = std::max(w->lag_max_us, now - due);
+        }
+
+        int status = 0;
+        bool keep = false;
+        // 复用的连接可能已经被服务器关掉了, 换一个新连接重试一次
+        for (int attempt = 0; attempt < 2 && status == 0; ++attempt)
+        {
+            replay_conn &c = conns[r.rec.conn];
+            bool reused = c.fd >= 0;
+            if (!reused)
+            {
+                c.fd = connect_server();
+                c.reader = response_reader();
+                ++w->connects;
+            }
+            if (c.fd >= 0 && send_request(c.fd, r))
+            {
+                status = c.reader.read(c.fd, r.rec.method == 2, keep);
+            }
+            if (status == 0 || !keep || !(r.rec.flags & CAPTURE_KEEP_ALIVE) || last[r.rec.conn] == i)
+            {
+                if (c.fd >= 0)
+                {
+                    close(c.fd);
+                }
+                conns.erase(r.rec.conn);
+            }
+            if (!reused)
+            {
+                break;
+            }
+        }
+        w->latency_us.push_back(now_us() - now);
+        w->status[status]++;
+    }
+    return NULL;
+}
+
+static bool parse_address(const char *s)
+{
+    const char *colon = strrchr(s, ':');
+    if (!colon)
+    {
+        return false;
+    }
+    std::string host(s, colon - s);
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), colon + 1, &hints, &res) != 0)
+    {
+        return false;
+    }
+    memcpy(&server_addr, res->ai_addr, sizeof(server_addr));
+    freeaddrinfo(res);
+    host_header = s;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 64;
+    long long limit = -1;
+    bool dump_only = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:n:d")) != -1)
+    {
+        if (opt == 's' && (speed = atof(optarg)) >= 0)
+        {
+            continue;
+        }
+        else if (opt == 'c' && (threads = atoi(optarg)) > 0)
+        {
+            continue;
+        }
+        else if (opt == 'n' && (limit = atoll(optarg)) >= 0)
+        {
+            continue;
+        }
+        else if (opt == 'd')
+        {
+            dump_only = true;
+        }
+        else
+        {
+            argc = 0;
+            break;
+        }
+    }
+    if (dump_only ? argc - optind != 1 : argc - optind != 2)
+    {
+        fprintf(stderr, "usage: %s [-s speed] [-c threads] [-n requests] host:port capture_file\n"
+                        "       %s -d capture_file\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (!dump_only && !parse_address(argv[optind]))
+    {
+        fprintf(stderr, "bad address %s\n", argv[optind]);
+        return 1;
+    }
+    std::vector<request> reqs;
+    uint64_t captured_at;
+    if (!load(argv[argc - 1], reqs, captured_at))
+    {
+        return 1;
+    }
+    if (limit >= 0 && (size_t)limit < reqs.size())
+    {
+        reqs.resize(limit);
+    }
+    if (dump_only)
+    {
+        dump(reqs, captured_at);
+        return 0;
+    }
+    if (reqs.empty())
+    {
+        fprintf(stderr, "no requests in %s\n", argv[argc - 1]);
+        return 1;
+    }
+
+    // 从第一个请求开始计时, 跳过抓取开始时的空闲
+    uint64_t first = reqs[0].rec.time_us;
+    for (size_t i = 0; i < reqs.size(); ++i)
+    {
+        reqs[i].rec.time_us -= first;
+    }
+    // 同一个抓取连接上的请求必须在同一个线程里依次发送
+    std::vector<worker> workers(threads);
+    for (size_t i = 0; i < reqs.size(); ++i)
+    {
+        workers[reqs[i].rec.conn % threads].requests.push_back(&reqs[i]);
+    }
+    replay_start = now_us();
+    for (int i = 0; i < threads; ++i)
+    {
+        workers[i].lag_total_us = workers[i].lag_max_us = workers[i].connects = 0;
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+    std::vector<uint32_t> latency;
+    std::map<int, uint64_t> status;
+    uint64_t lag_total = 0, lag_max = 0, connects = 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+        latency.insert(latency.end(), workers[i].latency_us.begin(), workers[i].latency_us.end());
+        for (std::map<int, uint64_t>::iterator it = workers[i].status.begin(); it != workers[i].status.end(); ++it)
+        {
+            status[it->first] += it->second;
+        }
+        lag_total += workers[i].lag_total_us;
+        lag_max = std::max(lag_max, workers[i].lag_max_us);
+        connects += workers[i].connects;
+    }
+    double elapsed = (now_us() - replay_start) / 1e6;
+    double span = reqs.back().rec.time_us / 1e6;
+
+    std::sort(latency.begin(), latency.end());
+    uint64_t failed = status.count(0) ? status[0] : 0;
+    printf("Requests: %zu replayed in %.2fs (captured over %.2fs), %llu failed, %llu connections\n",
+           reqs.size(), elapsed, span, (unsigned long long)failed, (unsigned long long)connects);
+    printf("Throughput: %.0f requests/sec\n", reqs.size() / (elapsed > 0 ? elapsed : 1));
+    printf("Latency: p50=%.2fms p90=%.2fms p99=%.2fms max=%.2fms\n", latency[latency.size() / 2] / 1000.0,
+           latency[latency.size() * 9 / 10] / 1000.0, latency[latency.size() * 99 / 100] / 1000.0,
+           latency.back() / 1000.0);
+    printf("Schedule lag: mean=%.2fms max=%.2fms\n", lag_total / 1000.0 / reqs.size(), lag_max / 1000.0);
+    printf("Status:");
+    for (std::map<int, uint64_t>::iterator it = status.begin(); it != status.end(); ++it)
+    {
+        if (it->first)
+        {
+            printf(" %d=%llu", it->first, (unsigned long long)it->second);
+        }
+    }
+    printf("\n");
+    return failed ? 2 : 0;
+}
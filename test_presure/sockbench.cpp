@@ -0,0 +1,255 @@
+// 同一个服务器在TCP回环和unix socket上的吞吐量对比: 对每个目标各开c个keep-alive连接, 每个连接发一个请求、
+// 读完响应再发下一个, 持续t秒, 打印每秒请求数和延迟. 两种目标用同一个客户端, 差别只在socket的类型上
+//
+//   sockbench [-c 连接数] [-t 秒] [-u 路径] 目标...
+//
+// 目标是 host:port, unix:/路径 或者 unix:@抽象地址. 默认 -c 32 -t 5 -u /index.html
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct target
+{
+    std::string name;
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    int family;
+};
+
+struct conn
+{
+    int fd;
+    uint64_t sent_at;       // 当前请求发出的时间
+    std::string in;
+};
+
+static std::string request;
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool parse_target(const char *s, target &t)
+{
+    t.name = s;
+    memset(&t.addr, 0, sizeof(t.addr));
+    if (strncmp(s, "unix:", 5) == 0)
+    {
+        // '@'开头的是抽象地址, sun_path以'\0'开头, 长度不含结尾的'\0'
+        const char *path = s + 5;
+        size_t len = strlen(path);
+        sockaddr_un *un = (sockaddr_un *)&t.addr;
+        if (len == 0 || len >= sizeof(un->sun_path))
+        {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path, len);
+        if (path[0] == '@')
+        {
+            un->sun_path[0] = '\0';
+        }
+        t.addr_len = offsetof(sockaddr_un, sun_path) + len;
+        t.family = AF_UNIX;
+        return true;
+    }
+    std::string host = s;
+    size_t colon = host.rfind(':');
+    if (colon == std::string::npos)
+    {
+        return false;
+    }
+    addrinfo hints = {}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.substr(0, colon).c_str(), host.c_str() + colon + 1, &hints, &res) != 0)
+    {
+        return false;
+    }
+    memcpy(&t.addr, res->ai_addr, res->ai_addrlen);
+    t.addr_len = res->ai_addrlen;
+    t.family = AF_INET;
+    freeaddrinfo(res);
+    return true;
+}
+
+// 响应读完了没有: 响应头之后还要有Content-Length字节, 返回整个响应的长度, 没读完时返回0
+static size_t response_length(const std::string &in)
+{
+    size_t end = in.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+        return 0;
+    }
+    size_t len = 0;
+    size_t pos = 0;
+    while ((pos = in.find("\r\n", pos)) != std::string::npos && pos < end)
+    {
+        pos += 2;
+        if (strncasecmp(in.c_str() + pos, "Content-Length:", 15) == 0)
+        {
+            len = strtoull(in.c_str() + pos + 15, NULL, 10);
+        }
+    }
+    return in.size() >= end + 4 + len ? end + 4 + len : 0;
+}
+
+static bool send_request(conn &c)
+{
+    c.sent_at = now_us();
+    return send(c.fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size();
+}
+
+// 对一个目标跑t秒, 出错返回false
+static bool run(const target &t, int clients, int seconds)
+{
+    int epfd = epoll_create1(0);
+    std::vector<conn> conns(clients);
+    for (int i = 0; i < clients; ++i)
+    {
+        // 先阻塞地连上, 计时从所有连接建好之后开始
+        conn &c = conns[i];
+        c.fd = socket(t.family, SOCK_STREAM, 0);
+        if (c.fd < 0 || connect(c.fd, (const sockaddr *)&t.addr, t.addr_len) < 0)
+        {
+            fprintf(stderr, "%s: connect: %s\n", t.name.c_str(), strerror(errno));
+            return false;
+        }
+        if (t.family == AF_INET)
+        {
+            int one = 1;
+            setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        epoll_event e;
+        e.events = EPOLLIN;
+        e.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &e);
+    }
+    std::vector<uint32_t> lat;
+    lat.reserve(1 << 20);
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t)seconds * 1000000;
+    for (int i = 0; i < clients; ++i)
+    {
+        if (!send_request(conns[i]))
+        {
+            fprintf(stderr, "%s: send failed\n", t.name.c_str());
+            return false;
+        }
+    }
+    std::vector<epoll_event> events(clients);
+    char buf[65536];
+    bool ok = true;
+    uint64_t now = start;
+    while (ok && now < end)
+    {
+        int n = epoll_wait(epfd, events.data(), events.size(), 1000);
+        now = now_us();
+        for (int i = 0; i < n && ok; ++i)
+        {
+            conn &c = conns[events[i].data.u32];
+            ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+            if (r <= 0)
+            {
+                fprintf(stderr, "%s: connection closed by server\n", t.name.c_str());
+                ok = false;
+                break;
+            }
+            c.in.append(buf, r);
+            size_t len = response_length(c.in);
+            if (len == 0)
+            {
+                continue;
+            }
+            c.in.erase(0, len);
+            lat.push_back(now - c.sent_at);
+            if (now < end && !send_request(c))
+            {
+                ok = false;
+            }
+        }
+    }
+    uint64_t elapsed = now_us() - start;
+    for (int i = 0; i < clients; ++i)
+    {
+        close(conns[i].fd);
+    }
+    close(epfd);
+    if (!ok)
+    {
+        return false;
+    }
+    std::sort(lat.begin(), lat.end());
+    double p50 = lat.empty() ? 0 : lat[lat.size() / 2] / 1000.0;
+    double p99 = lat.empty() ? 0 : lat[lat.size() * 99 / 100] / 1000.0;
+    printf("%-32s %10zu requests %10.0f req/s  p50 %.3f ms  p99 %.3f ms\n", t.name.c_str(), lat.size(),
+           lat.size() / (elapsed / 1e6), p50, p99);
+    fflush(stdout);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int clients = 32;
+    int seconds = 5;
+    const char *path = "/index.html";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:u:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'u':
+            path = optarg;
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind >= argc || clients <= 0 || seconds <= 0)
+    {
+        fprintf(stderr, "usage: %s [-c conns] [-t seconds] [-u path] host:port|unix:/path|unix:@name...\n", argv[0]);
+        return 1;
+    }
+    request = "GET " + std::string(path) + " HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n";
+    std::vector<target> targets(argc - optind);
+    for (int i = optind; i < argc; ++i)
+    {
+        if (!parse_target(argv[i], targets[i - optind]))
+        {
+            fprintf(stderr, "bad target %s\n", argv[i]);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < targets.size(); ++i)
+    {
+        if (!run(targets[i], clients, seconds))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
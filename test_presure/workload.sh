@@ -0,0 +1,467 @@
+#!/usr/bin/env bash
+# 启动服务器并对 resources/ 跑一组固定的请求
+#
+#   workload.sh check <app> <port>   检查各类请求的响应码, 有不符合的就返回非0
+#   workload.sh train <app> <port>   PGO训练: 同样的请求 + 一段webbench压测, 覆盖热点路径
+#   workload.sh bench <app> <port>   只跑webbench, 输出吞吐量; 有sockbench时再对比TCP回环和unix socket
+#   workload.sh idle <app> <port>    空闲连接规模测试: 用idlebench分步建立空闲的keep-alive连接, 每步输出服务器内存和活跃请求延迟
+#
+# 环境变量: WEBBENCH(webbench路径), BENCH_CLIENTS, BENCH_TIME,
+#           PACK(mkpack生成的资源包, 设置后服务器用 -p 加载, 并额外检查304和gzip)
+#           MODEL(并发模型 reactor|rtc|single|coro, 传给 -m), REPLAY(重放工具路径)
+#           SOCKBENCH(sockbench路径), IDLEBENCH(idlebench路径), IDLE_CONNS, IDLE_STEP, IDLE_ADDRS(源地址个数), IDLE_MAX_BYTES(每连接RSS上限, 0不检查)
+
+set -u
+
+MODE=${1:?usage: workload.sh check|train|bench|idle <app> <port>}
+APP=${2:?missing app}
+PORT=${3:?missing port}
+WEBBENCH=${WEBBENCH:-build/webbench}
+BENCH_CLIENTS=${BENCH_CLIENTS:-200}
+BENCH_TIME=${BENCH_TIME:-10}
+BASE="http://127.0.0.1:$PORT"
+# TLS监听在 PORT+1, 证书临时生成; 没有openssl命令行工具时跳过TLS的检查
+TLS_PORT=$((PORT + 1))
+TLS_BASE="https://127.0.0.1:$TLS_PORT"
+# 反向代理: 同一个程序在 PORT+2 上再起一份当作上游, /backend/ 转发过去; /down/ 指向没有监听的端口
+BACKEND_PORT=$((PORT + 2))
+# 限流: PORT+3 上的实例每个IP每秒1个请求(突发3个), 最多1个连接
+LIMIT_PORT=$((PORT + 3))
+LIMIT_BASE="http://127.0.0.1:$LIMIT_PORT"
+SOCKBENCH=${SOCKBENCH:-build/sockbench}
+
+failed=0
+
+TLS_ARGS=()
+CERT_DIR=$(mktemp -d)
+if command -v openssl > /dev/null \
+    && openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 -subj /CN=localhost \
+        -keyout "$CERT_DIR/key.pem" -out "$CERT_DIR/cert.pem" > /dev/null 2>&1; then
+    TLS_ARGS=("$TLS_PORT" "$CERT_DIR/cert.pem" "$CERT_DIR/key.pem")
+fi
+
+PACK_ARGS=()
+if [ -n "${PACK:-}" ]; then
+    PACK_ARGS=(-p "$PACK")
+fi
+# 主实例从配置文件读线程数, 检查时改写文件再SIGHUP; 同时把收到的请求抓取下来, 最后用replay重放一遍
+CONFIG_FILE="$CERT_DIR/server.conf"
+# 主实例同时在unix socket上监听
+UNIX_SOCKET="$CERT_DIR/server.sock"
+CAPTURE_FILE="$CERT_DIR/traffic.cap"
+REPLAY=${REPLAY:-build/replay}
+LOG_DIR="$CERT_DIR/logs"
+LOGDECODE=${LOGDECODE:-build/logdecode}
+mkdir -p "$LOG_DIR"
+printf 'threads = 4\ncapture = %s\naccess_log = %s\ncache_size = 16\nadmin_routes = local\n' "$CAPTURE_FILE" "$LOG_DIR" > "$CONFIG_FILE"
+IDLEBENCH=${IDLEBENCH:-build/idlebench}
+IDLE_CONNS=${IDLE_CONNS:-10000}
+if [ "$MODE" = idle ]; then
+    # 默认的listen队列只有5, 一次建几百个连接会丢SYN; 连接表要放得下所有连接
+    printf 'backlog = 4096\nmax_fd = %d\n' $((IDLE_CONNS > 64512 ? IDLE_CONNS + 1024 : 65536)) >> "$CONFIG_FILE"
+fi
+MODEL_ARGS=()
+if [ -n "${MODEL:-}" ]; then
+    MODEL_ARGS=(-m "$MODEL")
+fi
+PROXY_ARGS=(-X "/backend/=127.0.0.1:$BACKEND_PORT" -X "/down/=127.0.0.1:1")
+
+# 服务器每解析一行都会打印, 这里丢掉
+"$APP" "$BACKEND_PORT" > /dev/null 2>&1 &
+BACKEND_PID=$!
+"$APP" "${MODEL_ARGS[@]}" -r 1/3 -c 1 "$LIMIT_PORT" > /dev/null 2>&1 &
+LIMIT_PID=$!
+"$APP" -f "$CONFIG_FILE" -u "$UNIX_SOCKET" "${MODEL_ARGS[@]}" "${PACK_ARGS[@]}" "${PROXY_ARGS[@]}" "$PORT" "${TLS_ARGS[@]}" > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID $BACKEND_PID $LIMIT_PID 2>/dev/null; rm -rf "$CERT_DIR"' EXIT
+
+# 等服务器开始监听
+for _ in $(seq 1 50); do
+    if curl -s -o /dev/null "$BASE/index.html" && curl -s -o /dev/null "http://127.0.0.1:$BACKEND_PORT/index.html" \
+        && (exec 3<>/dev/tcp/127.0.0.1/$LIMIT_PORT) 2> /dev/null; then
+        break
+    fi
+    sleep 0.1
+done
+
+# expect <期望的状态码> <curl参数...>
+expect() {
+    local want=$1
+    shift
+    local got
+    got=$(curl -s -o /dev/null -w '%{http_code}' "$@")
+    if [ "$got" != "$want" ]; then
+        echo "FAIL: curl $* -> $got, want $want"
+        failed=1
+    fi
+}
+
+# same_body <本地文件> <curl参数...>  下载内容必须和文件一致
+same_body() {
+    local file=$1
+    shift
+    if ! curl -s "$@" | cmp -s - "$file"; then
+        echo "FAIL: curl $* differs from $file"
+        failed=1
+    fi
+}
+
+# contains <文本> <curl参数...>  响应体里必须包含这段文本
+contains() {
+    local want=$1
+    shift
+    if ! curl -s "$@" | grep -qF "$want"; then
+        echo "FAIL: curl $* does not contain '$want'"
+        failed=1
+    fi
+}
+
+# raw <期望的状态行前缀> <原始请求>  发送curl构造不出来的请求
+raw() {
+    local want=$1
+    local got
+    got=$(printf "%b" "$2" | timeout 2 bash -c "exec 3<>/dev/tcp/127.0.0.1/$PORT; cat >&3; head -n 1 <&3" | tr -d '\r')
+    if [ "${got#"$want"}" = "$got" ]; then
+        echo "FAIL: raw request -> '$got', want '$want'"
+        failed=1
+    fi
+}
+
+requests() {
+    expect 200 "$BASE/index.html"
+    expect 200 "$BASE/images/image1.jpg"
+    expect 200200 -H 'Connection: keep-alive' -o /dev/null "$BASE/index.html" "$BASE/images/image1.jpg"
+    expect 404 "$BASE/no_such_file.html"
+    expect 400 "$BASE/images"
+    # h2c: 先验知识 和 Upgrade: h2c
+    expect 200 --http2-prior-knowledge "$BASE/index.html"
+    expect 404 --http2-prior-knowledge "$BASE/no_such_file.html"
+    # 升级时curl报告的状态码是101, 所以比较内容
+    same_body resources/images/image1.jpg --http2 "$BASE/images/image1.jpg"
+    # 路由的响应在流上回复不了, 忽略Upgrade按HTTP/1.1回复
+    contains "requests: " --http2 "$BASE/status"
+    raw "HTTP/1.1 400" "GET /index.html HTTP/1.0\r\n\r\n"
+    raw "HTTP/1.1 400" "BREW /index.html HTTP/1.1\r\n\r\n"
+    # 请求体: Content-Length 和 chunked 都按片段流式交给消费者
+    local size
+    size=$(stat -c %s resources/images/image1.jpg)
+    contains "received $size bytes" --data-binary @resources/images/image1.jpg "$BASE/upload"
+    contains "received $size bytes" -H 'Transfer-Encoding: chunked' --data-binary @resources/images/image1.jpg "$BASE/upload"
+    raw "HTTP/1.1 200" "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3;x=1\r\nabc\r\n0\r\nX-Sum: 1\r\n\r\n"
+    raw "HTTP/1.1 400" "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n"
+    expect 400 -X POST "$BASE/upload"
+    # 请求头占满读缓冲区时请求体没有地方放
+    expect 431 -H "X-Pad: $(printf 'a%.0s' $(seq 1 1800))" -d hello "$BASE/upload"
+    # 路由: 处理函数生成的响应, 方法不匹配时405, 没有匹配的路由回落到静态文件
+    contains "users:" "$BASE/status"
+    expect 405 --data x "$BASE/status"
+    expect 405 --data x "$BASE/index.html"
+    expect 404 "$BASE/stream/abc"
+    # 分块响应: 生成的内容边生成边发, 最后带trailer
+    contains "X-Checksum: fnv1a" --raw "$BASE/stream/100000"
+    expect 200200 -H 'Connection: keep-alive' -o /dev/null "$BASE/stream/70000" "$BASE/index.html"
+    proxy_requests
+    if [ ${#TLS_ARGS[@]} -gt 0 ]; then
+        tls_requests
+    fi
+    if [ ${#PACK_ARGS[@]} -gt 0 ]; then
+        pack_requests
+    fi
+}
+
+proxy_requests() {
+    local size
+    size=$(stat -c %s resources/images/image1.jpg)
+    expect 200 "$BASE/backend/index.html"
+    expect 404 "$BASE/backend/no_such_file.html"
+    expect 200200 -H 'Connection: keep-alive' -o /dev/null "$BASE/backend/index.html" "$BASE/backend/images/image1.jpg"
+    same_body resources/images/image1.jpg "$BASE/backend/images/image1.jpg"
+    contains "received $size bytes" --data-binary @resources/images/image1.jpg "$BASE/backend/upload"
+    contains "received $size bytes" -H 'Transfer-Encoding: chunked' --data-binary @resources/images/image1.jpg "$BASE/backend/upload"
+    contains "X-Checksum: fnv1a" --raw "$BASE/backend/stream/100000"
+    expect 502 "$BASE/down/index.html"
+}
+
+# 只在check模式跑一次: 令牌用完之后要等一秒才恢复
+limit_requests() {
+    local codes=""
+    for _ in 1 2 3 4; do
+        codes+=$(curl -s -o /dev/null -w '%{http_code}' "$LIMIT_BASE/index.html")
+    done
+    if [ "$codes" != "200200200429" ]; then
+        echo "FAIL: rate limit -> $codes, want 200200200429"
+        failed=1
+    fi
+    sleep 1
+    # 占着一个连接时第二个连接在accept时就被拒绝
+    exec 3<>/dev/tcp/127.0.0.1/$LIMIT_PORT
+    expect 429 "$LIMIT_BASE/index.html"
+    exec 3>&-
+}
+
+capture_requests() {
+    if [ ! -x "$REPLAY" ]; then
+        return
+    fi
+    # SIGUSR1时把缓冲的记录写到文件里
+    kill -USR1 $SERVER_PID
+    sleep 0.3
+    if ! "$REPLAY" -d "$CAPTURE_FILE" | grep -q ' GET /index.html '; then
+        echo "FAIL: capture file has no GET /index.html"
+        failed=1
+    fi
+    if ! "$REPLAY" -s 0 -c 8 -n 200 "127.0.0.1:$PORT" "$CAPTURE_FILE" > /dev/null; then
+        echo "FAIL: replay of captured traffic had connection errors"
+        failed=1
+    fi
+}
+
+access_log_requests() {
+    if [ ! -x "$LOGDECODE" ]; then
+        return
+    fi
+    # 段文件是共享映射, 不用等服务器写出
+    if ! "$LOGDECODE" -r resources "$LOG_DIR"/access-*.log | grep -q ' GET /index.html 200 '; then
+        echo "FAIL: access log has no GET /index.html 200"
+        failed=1
+    fi
+    if ! "$LOGDECODE" -c "$LOG_DIR"/access-*.log | grep -q ',404,'; then
+        echo "FAIL: access log has no 404"
+        failed=1
+    fi
+}
+
+path_requests() {
+    # 资源包模式下不访问文件系统
+    if [ -n "${PACK:-}" ]; then
+        return
+    fi
+    expect 403 --path-as-is "$BASE/../Makefile"
+    expect 403 --path-as-is "$BASE/images/../../README.md"
+    expect 200 --path-as-is "$BASE/images/../index.html"
+    expect 414 "$BASE/$(printf 'a%.0s' $(seq 1 1100))"
+}
+
+cache_requests() {
+    # 资源包模式下静态文件不经过缓存
+    if [ -n "${PACK:-}" ]; then
+        return
+    fi
+    # 前面的请求里同一个文件取过多次, 第二次起从缓存里发
+    same_body resources/images/image1.jpg "$BASE/images/image1.jpg"
+    same_body resources/images/image1.jpg "$BASE/images/image1.jpg"
+    if ! curl -s "$BASE/status" | grep -q 'cache: hits=[1-9]'; then
+        echo "FAIL: file cache has no hits"
+        failed=1
+    fi
+}
+
+ws_requests() {
+    # RFC 6455 里的示例key, Sec-WebSocket-Accept应该是 s3pPLMBiTxaQ9kYGzzhZRbK+xOo=
+    local hs="GET /ws/echo HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n"
+    raw "HTTP/1.1 101" "$hs"
+    raw "HTTP/1.1 400" "GET /ws/echo HTTP/1.1\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 13\r\n\r\n"
+    # 握手后紧跟一条分成两帧的掩码文本消息和关闭帧(掩码全0), 服务器回显之后回关闭帧并断开
+    local out="$CERT_DIR/ws.out"
+    printf "%b" "$hs\x01\x82\x00\x00\x00\x00he\x80\x83\x00\x00\x00\x00llo\x88\x82\x00\x00\x00\x00\x03\xe8" \
+        | timeout 3 bash -c "exec 3<>/dev/tcp/127.0.0.1/$PORT; cat >&3; cat <&3" > "$out"
+    if ! grep -aq 's3pPLMBiTxaQ9kYGzzhZRbK+xOo=' "$out" || ! grep -aq 'llo' "$out" \
+        || [ "$(tail -c 4 "$out" | od -An -tx1 | tr -d ' ')" != 880203e8 ]; then
+        echo "FAIL: websocket echo"
+        failed=1
+    fi
+}
+
+sse_requests() {
+    # 两个订阅者都应该收到同样的事件, 多行数据每行一个data:
+    local out1="$CERT_DIR/sse1.out" out2="$CERT_DIR/sse2.out"
+    timeout 2 curl -sN "$BASE/events/check" > "$out1" &
+    local sub1=$!
+    timeout 2 curl -sN "$BASE/events/check" > "$out2" &
+    local sub2=$!
+    sleep 0.5
+    contains "delivered to 2 subscribers" --data-binary $'hello\nevents' "$BASE/events/check"
+    # 单独的\r和\r\n也是换行, 不能借此插入别的字段
+    contains "delivered to 2 subscribers" --data-binary $'a\rretry: 1\r\nb' "$BASE/events/check"
+    contains "delivered to 0 subscribers" --data x "$BASE/events/nobody"
+    wait $sub1 $sub2
+    local f
+    for f in "$out1" "$out2"; do
+        if [ "$(cat "$f")" != $'id: 1\ndata: hello\ndata: events\n\nid: 2\ndata: a\ndata: retry: 1\ndata: b' ]; then
+            echo "FAIL: event stream $f: $(cat "$f")"
+            failed=1
+        fi
+    done
+    # 订阅者都断开后频道随之释放
+    sleep 0.3
+    contains "sse: 0 channels" "$BASE/status"
+}
+
+unix_requests() {
+    expect 200 --unix-socket "$UNIX_SOCKET" "http://localhost/index.html"
+    expect 404 --unix-socket "$UNIX_SOCKET" "http://localhost/no_such_file.html"
+    expect 200200 --unix-socket "$UNIX_SOCKET" -o /dev/null "http://localhost/index.html" "http://localhost/images/image1.jpg"
+    same_body resources/images/image1.jpg --unix-socket "$UNIX_SOCKET" "http://localhost/images/image1.jpg"
+    # 访问日志里这些请求标着unix
+    if [ -x "$LOGDECODE" ] && ! "$LOGDECODE" "$LOG_DIR"/access-*.log | grep -q ' 200 .* unix$'; then
+        echo "FAIL: access log has no request marked unix"
+        failed=1
+    fi
+}
+
+trace_requests() {
+    # 前面的请求都已经写完, 每个至少有一段从解析完到生成好响应
+    contains '"name":"request"' "$BASE/trace"
+    contains '"name":"parsed -> ready"' "$BASE/trace"
+}
+
+idle_requests() {
+    # 空闲超时只在协程模型里
+    if [ "${MODEL:-}" != coro ]; then
+        return
+    fi
+    echo 'idle_timeout = 1' >> "$CONFIG_FILE"
+    kill -HUP $SERVER_PID
+    sleep 0.3
+    # 连上之后什么也不发, 超时后服务器关闭连接, cat读到EOF退出
+    exec 3<>/dev/tcp/127.0.0.1/$PORT
+    if ! timeout 3 cat <&3 > /dev/null; then
+        echo "FAIL: idle connection was not closed"
+        failed=1
+    fi
+    exec 3>&-
+    expect 200 "$BASE/index.html"
+}
+
+config_requests() {
+    contains "threads = 4" "$BASE/config"
+    printf 'threads = 2\nmax_requests = 500\nadmin_routes = local\n' > "$CONFIG_FILE"
+    kill -HUP $SERVER_PID
+    sleep 0.3
+    contains "threads = 2" "$BASE/config"
+    contains "max_requests = 500" "$BASE/config"
+    expect 200 "$BASE/index.html"
+    # 管理路由默认不开放
+    printf 'threads = 2\n' > "$CONFIG_FILE"
+    kill -HUP $SERVER_PID
+    sleep 0.3
+    expect 404 "$BASE/config"
+    expect 404 "$BASE/trace"
+}
+
+pack_requests() {
+    local etag
+    etag=$(curl -s -o /dev/null -D - "$BASE/index.html" | tr -d '\r' | sed -n 's/^ETag: //p')
+    if [ -z "$etag" ]; then
+        echo "FAIL: no ETag from pack"
+        failed=1
+    fi
+    expect 304 -H "If-None-Match: $etag" "$BASE/index.html"
+    expect 200 -H 'If-None-Match: "0"' "$BASE/index.html"
+    # 预压缩的版本解压后和原文件一致
+    same_body resources/index.html --compressed "$BASE/index.html"
+    contains "Content-Encoding: gzip" -o /dev/null -D - -H 'Accept-Encoding: gzip' "$BASE/index.html"
+    # HTTP/2的流也从包里取
+    same_body resources/index.html --http2-prior-knowledge "$BASE/index.html"
+}
+
+tls_requests() {
+    expect 200 -k "$TLS_BASE/index.html"
+    expect 404 -k "$TLS_BASE/no_such_file.html"
+    expect 200200 -k -H 'Connection: keep-alive' -o /dev/null "$TLS_BASE/index.html" "$TLS_BASE/images/image1.jpg"
+    same_body resources/images/image1.jpg -k "$TLS_BASE/images/image1.jpg"
+    # 会话复用: s_client -reconnect 会用同一个会话再连5次
+    local reused
+    reused=$(echo | timeout 5 openssl s_client -connect "127.0.0.1:$TLS_PORT" -tls1_2 -reconnect 2>/dev/null | grep -c '^Reused')
+    if [ "$reused" -eq 0 ]; then
+        echo "FAIL: TLS session was not resumed"
+        failed=1
+    fi
+}
+
+bench() {
+    if [ ! -x "$WEBBENCH" ]; then
+        echo "webbench not found at $WEBBENCH"
+        failed=1
+        return
+    fi
+    echo "== $APP (${MODEL:-reactor})"
+    local before after
+    before=$(curl -s "$BASE/status")
+    "$WEBBENCH" -2 -c "$BENCH_CLIENTS" -t "$BENCH_TIME" "$BASE/index.html" 2>&1 | grep -E 'Speed|Requests'
+    after=$(curl -s "$BASE/status")
+    # /status 里的累计计数, 前后相减得到这一轮压测里每个请求的epoll_ctl和唤醒次数
+    printf '%s\n%s\n' "$before" "$after" | awk -F': ' '
+        { if ($1 in first) last[$1] = $2; else first[$1] = $2 }
+        END {
+            n = last["requests"] - first["requests"]
+            if (n > 0)
+                printf "epoll_ctl/request=%.2f wakeups/request=%.2f\n",
+                       (last["epoll_ctl"] - first["epoll_ctl"]) / n, (last["wakeups"] - first["wakeups"]) / n
+        }'
+    # 同一个服务器, 同样的keep-alive请求, 只是走TCP回环还是unix socket
+    if [ -x "$SOCKBENCH" ]; then
+        "$SOCKBENCH" -c 32 -t "$BENCH_TIME" "127.0.0.1:$PORT" "unix:$UNIX_SOCKET" || failed=1
+    fi
+}
+
+idle() {
+    if [ ! -x "$IDLEBENCH" ]; then
+        echo "idlebench not found at $IDLEBENCH"
+        failed=1
+        return
+    fi
+    echo "== $APP (${MODEL:-reactor})"
+    local max_args=()
+    if [ "${IDLE_MAX_BYTES:-0}" -gt 0 ]; then
+        max_args=(-m "$IDLE_MAX_BYTES")
+    fi
+    "$IDLEBENCH" -P $SERVER_PID -n "$IDLE_CONNS" -s "${IDLE_STEP:-1000}" -a "${IDLE_ADDRS:-1}" "${max_args[@]}" \
+        "127.0.0.1:$PORT" || failed=1
+}
+
+case "$MODE" in
+    check)
+        requests
+        limit_requests
+        capture_requests
+        trace_requests
+        ws_requests
+        sse_requests
+        unix_requests
+        path_requests
+        cache_requests
+        access_log_requests
+        idle_requests
+        config_requests
+        ;;
+    train)
+        requests
+        for _ in $(seq 1 20); do
+            requests
+        done
+        BENCH_TIME=3 bench
+        ;;
+    bench)
+        bench
+        ;;
+    idle)
+        idle
+        ;;
+    *)
+        echo "unknown mode $MODE"
+        failed=1
+        ;;
+esac
+
+# SIGTERM让服务器正常退出, PGO插桩版本在退出时才会写出profile
+kill -TERM $SERVER_PID $BACKEND_PID $LIMIT_PID
+wait $SERVER_PID $BACKEND_PID $LIMIT_PID
+trap - EXIT
+rm -rf "$CERT_DIR"
+
+if [ $failed -ne 0 ]; then
+    exit 1
+fi
+[ "$MODE" = check ] && echo "all checks passed"
+exit 0
@@ -0,0 +1,424 @@
+// WebSocket压测: 开很多个连接, 握手之后每个连接不停地发一条消息、等回显收齐再发下一条
+//
+//   wsbench [-c 连接数] [-s 消息字节数] [-t 秒数] [-p 路径] host:port
+//
+// 默认 -c 10000 -s 64 -t 10 -p /ws/echo. 单线程epoll, 所有连接都握手完成之后一起开始发并计时,
+// 输出每秒往返的消息数和回显的字节速率. 连接数较多时注意 ulimit -n(客户端和服务器各需要一个fd),
+// 服务器的listen backlog也要调大(-o backlog=4096), 否则握手阶段丢SYN, 建连接很慢
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include "../headers/websocket.h"
+
+// 同时在连接和握手的上限: 服务器的listen backlog很小, 一下子全连上去会丢SYN, 重传要等1秒
+static const int MAX_PENDING = 64;
+
+enum STATE
+{
+    CONNECTING,
+    HANDSHAKE,
+    OPEN,
+    DEAD,
+};
+
+struct client
+{
+    int fd;
+    STATE state;
+    std::string in;         // 握手时的响应头, 或者还没解析完的帧头
+    size_t out_pos;         // 当前这条消息已经发出的字节数
+    uint64_t left;          // 正在接收的帧还差多少负载
+    bool fin;               // 正在接收的帧是消息的最后一帧
+    size_t received;        // 这条消息已经收到的负载
+    std::string frame;      // 要发送的帧(已加掩码), 每次发同一帧
+};
+
+static sockaddr_in server_addr;
+static std::string handshake;
+static size_t msg_size = 64;
+static std::vector<client> clients;
+static int epfd;
+static int pending;
+static uint64_t messages;
+static uint64_t failures;
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void set_events(client &c, uint32_t ev, int op)
+{
+    epoll_event e;
+    e.events = ev;
+    e.data.u64 = &c - clients.data();
+    epoll_ctl(epfd, op, c.fd, &e);
+}
+
+static bool start_connect(client &c)
+{
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c.fd < 0)
+    {
+        perror("socket");
+        return false;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c.fd, (sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS)
+    {
+        perror("connect");
+        close(c.fd);
+        return false;
+    }
+    c.state = CONNECTING;
+    c.out_pos = 0;
+    ++pending;
+    set_events(c, EPOLLOUT, EPOLL_CTL_ADD);
+    return true;
+}
+
+static void fail(client &c)
+{
+    if (c.state == CONNECTING || c.state == HANDSHAKE)
+    {
+        --pending;
+    }
+    c.state = DEAD;
+    close(c.fd);
+    ++failures;
+}
+
+// 发c.frame剩下的部分, 写不动了就等EPOLLOUT
+static bool send_frame(client &c)
+{
+    while (c.out_pos < c.frame.size())
+    {
+        ssize_t n = send(c.fd, c.frame.data() + c.out_pos, c.frame.size() - c.out_pos, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                set_events(c, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+                return true;
+            }
+            return false;
+        }
+        c.out_pos += n;
+    }
+    set_events(c, EPOLLIN, EPOLL_CTL_MOD);
+    return true;
+}
+
+// 解析回显的帧: 服务器按收到的片段回显, 一条消息可能分成多帧; 帧头攒在in里, 负载只计数不保存
+static bool on_data(client &c, const char *p, size_t n)
+{
+    while (n > 0)
+    {
+        if (c.left > 0)
+        {
+            size_t k = c.left < n ? c.left : n;
+            c.left -= k;
+            c.received += k;
+            p += k;
+            n -= k;
+        }
+        else
+        {
+            // 先凑齐2字节, 再按长度字段凑齐扩展长度
+            size_t header = 2;
+            if (c.in.size() >= 2)
+            {
+                uint8_t b1 = c.in[1] & 0x7f;
+                header += b1 == 126 ? 2 : b1 == 127 ? 8 : 0;
+            }
+            size_t k = header - c.in.size() < n ? header - c.in.size() : n;
+            c.in.append(p, k);
+            p += k;
+            n -= k;
+            if (c.in.size() < header || (header == 2 && (c.in[1] & 0x7f) >= 126))
+            {
+                continue;
+            }
+            uint8_t b0 = c.in[0];
+            if ((b0 & 0x0f) >= WS_CLOSE)
+            {
+                // 服务器不该在压测中途关闭或者发ping
+                return false;
+            }
+            uint64_t len = 0;
+            for (size_t i = 2; i < header; ++i)
+            {
+                len = len << 8 | (uint8_t)c.in[i];
+            }
+            c.left = header == 2 ? (uint8_t)c.in[1] & 0x7f : len;
+            c.fin = (b0 & 0x80) != 0;
+            c.in.clear();
+        }
+        if (c.left == 0 && c.fin && c.in.empty())
+        {
+            // 一条消息收齐了, 接着发下一条; 这时不该还有别的数据
+            if (c.received != msg_size || n > 0)
+            {
+                return false;
+            }
+            ++messages;
+            c.received = 0;
+            c.fin = false;
+            c.out_pos = 0;
+            return send_frame(c);
+        }
+    }
+    return true;
+}
+
+static void on_event(client &c, uint32_t ev)
+{
+    if (c.state == CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (ev & (EPOLLERR | EPOLLHUP)))
+        {
+            fail(c);
+            return;
+        }
+        c.state = HANDSHAKE;
+        // 握手请求很短, 一次就能写完
+        if (send(c.fd, handshake.data(), handshake.size(), MSG_NOSIGNAL) != (ssize_t)handshake.size())
+        {
+            fail(c);
+            return;
+        }
+        set_events(c, EPOLLIN, EPOLL_CTL_MOD);
+        return;
+    }
+    if (c.state == OPEN && (ev & EPOLLOUT) && !send_frame(c))
+    {
+        fail(c);
+        return;
+    }
+    if (!(ev & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+    {
+        return;
+    }
+    char buf[65536];
+    while (true)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+        if (n <= 0)
+        {
+            fail(c);
+            return;
+        }
+        if (c.state == OPEN)
+        {
+            if (!on_data(c, buf, n))
+            {
+                fail(c);
+                return;
+            }
+            continue;
+        }
+        // 握手: 等到响应头结束, 之后的字节已经是帧
+        c.in.append(buf, n);
+        size_t end = c.in.find("\r\n\r\n");
+        if (end == std::string::npos)
+        {
+            continue;
+        }
+        if (c.in.compare(0, 12, "HTTP/1.1 101") != 0)
+        {
+            fail(c);
+            return;
+        }
+        --pending;
+        bool rest = c.in.size() > end + 4;
+        c.in.clear();
+        c.state = OPEN;
+        c.left = 0;
+        c.fin = false;
+        c.received = 0;
+        if (rest)
+        {
+            fail(c);
+        }
+        // 等所有连接都握手完成再一起开始发, 先连上的不会抢走服务器, 让后面的连接排队
+        return;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int conns = 10000;
+    int seconds = 10;
+    const char *path = "/ws/echo";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:t:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 's':
+            msg_size = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'p':
+            path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c conns] [-s msg_bytes] [-t seconds] [-p path] host:port\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || conns <= 0 || seconds <= 0)
+    {
+        fprintf(stderr, "usage: %s [-c conns] [-s msg_bytes] [-t seconds] [-p path] host:port\n", argv[0]);
+        return 1;
+    }
+    std::string target = argv[optind];
+    size_t colon = target.rfind(':');
+    if (colon == std::string::npos)
+    {
+        fprintf(stderr, "bad address %s\n", target.c_str());
+        return 1;
+    }
+    std::string host = target.substr(0, colon);
+    addrinfo hints = {}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), target.c_str() + colon + 1, &hints, &res) != 0)
+    {
+        fprintf(stderr, "cannot resolve %s\n", target.c_str());
+        return 1;
+    }
+    memcpy(&server_addr, res->ai_addr, sizeof(server_addr));
+    freeaddrinfo(res);
+
+    handshake = "GET " + std::string(path) + " HTTP/1.1\r\nHost: " + host
+        + "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+          "Sec-WebSocket-Version: 13\r\n\r\n";
+
+    // 每个连接一帧, 掩码各不相同, 加掩码用和服务器相同的ws_mask
+    std::string payload(msg_size, 'x');
+    for (size_t i = 0; i < msg_size; ++i)
+    {
+        payload[i] = 'a' + i % 26;
+    }
+    srand(time(NULL));
+    clients.resize(conns);
+    for (int i = 0; i < conns; ++i)
+    {
+        std::string &f = clients[i].frame;
+        f += (char)(0x80 | WS_BINARY);
+        if (msg_size < 126)
+        {
+            f += (char)(0x80 | msg_size);
+        }
+        else if (msg_size < 65536)
+        {
+            f += (char)(0x80 | 126);
+            f += (char)(msg_size >> 8);
+            f += (char)msg_size;
+        }
+        else
+        {
+            f += (char)(0x80 | 127);
+            for (int k = 7; k >= 0; --k)
+            {
+                f += (char)((uint64_t)msg_size >> (8 * k));
+            }
+        }
+        uint8_t key[4];
+        for (int k = 0; k < 4; ++k)
+        {
+            key[k] = rand();
+        }
+        f.append((const char *)key, 4);
+        size_t off = f.size();
+        f += payload;
+        ws_mask(&f[off], msg_size, key, 0);
+        clients[i].state = DEAD;
+    }
+
+    epfd = epoll_create1(0);
+    std::vector<epoll_event> events(1024);
+    int next = 0;
+    int open_count = 0;
+    uint64_t start = 0;
+    uint64_t connect_start = now_us();
+    uint64_t deadline = 0;
+    while (true)
+    {
+        while (next < conns && pending < MAX_PENDING)
+        {
+            if (!start_connect(clients[next++]))
+            {
+                return 1;
+            }
+        }
+        if (!start && next == conns && pending == 0)
+        {
+            for (int i = 0; i < conns; ++i)
+            {
+                open_count += clients[i].state == OPEN;
+            }
+            start = now_us();
+            deadline = start + (uint64_t)seconds * 1000000;
+            for (int i = 0; i < conns; ++i)
+            {
+                if (clients[i].state == OPEN && !send_frame(clients[i]))
+                {
+                    fail(clients[i]);
+                }
+            }
+            printf("%d/%d connections open in %.2f s\n", open_count, conns, (start - connect_start) / 1e6);
+            fflush(stdout);
+            if (open_count == 0)
+            {
+                return 1;
+            }
+        }
+        if (start && now_us() >= deadline)
+        {
+            break;
+        }
+        int n = epoll_wait(epfd, events.data(), events.size(), 100);
+        for (int i = 0; i < n; ++i)
+        {
+            client &c = clients[events[i].data.u64];
+            if (c.state != DEAD)
+            {
+                on_event(c, events[i].events);
+            }
+        }
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    printf("messages: %llu in %.2f s, %.0f msgs/sec, %.2f MB/s echoed, %llu failed connections\n",
+           (unsigned long long)messages, elapsed, messages / elapsed, messages * (double)msg_size / elapsed / 1e6,
+           (unsigned long long)failures);
+    return 0;
+}
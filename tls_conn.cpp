@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <openssl/err.h>
+#include "headers/tls_conn.h"
+
+SSL_CTX *tls_conn::m_ctx = NULL;
+
+// 握手统计, 多个工作线程同时更新
+static std::atomic<uint64_t> stat_handshakes(0);     // 完成的握手
+static std::atomic<uint64_t> stat_resumed(0);        // 其中复用会话的
+static std::atomic<uint64_t> stat_failed(0);         // 失败的握手
+static std::atomic<uint64_t> stat_handshake_ns(0);   // SSL_accept里花掉的时间, 不含等待网络的时间
+static std::atomic<uint64_t> stat_ktls_send(0);      // 发送方向启用了kTLS的连接
+static std::atomic<uint64_t> stat_ktls_recv(0);      // 接收方向启用了kTLS的连接
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+bool tls_conn::init_context(const char *cert_file, const char *key_file)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+    {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // 握手完成后尝试把密钥交给内核
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    // writev按块调用SSL_write, 允许部分写入, 重试时缓冲区地址可以变化
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    // 服务端会话缓存(TLS1.2的session id)和会话票据(TLS1.3)都打开, 用于会话复用
+    static const unsigned char sid_ctx[] = "webserver";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    m_ctx = ctx;
+    return true;
+}
+
+void tls_conn::print_stats()
+{
+    uint64_t n = stat_handshakes.load();
+    printf("tls: handshakes=%lu resumed=%lu failed=%lu avg_handshake_us=%.1f ktls_send=%lu ktls_recv=%lu\n",
+           (unsigned long)n, (unsigned long)stat_resumed.load(), (unsigned long)stat_failed.load(),
+           n ? stat_handshake_ns.load() / 1000.0 / n : 0.0,
+           (unsigned long)stat_ktls_send.load(), (unsigned long)stat_ktls_recv.load());
+    fflush(stdout);
+}
+
+tls_conn::tls_conn() : m_ssl(NULL), m_fd(-1), m_established(false), m_ktls_send(false), m_ktls_recv(false)
+{
+}
+
+tls_conn::~tls_conn()
+{
+    if (m_ssl)
+    {
+        // 不等对端的close_notify, 连接马上就要关闭了
+        SSL_set_quiet_shutdown(m_ssl, 1);
+        SSL_free(m_ssl);
+    }
+}
+
+bool tls_conn::attach(int fd)
+{
+    m_ssl = SSL_new(m_ctx);
+    if (!m_ssl || SSL_set_fd(m_ssl, fd) != 1)
+    {
+        return false;
+    }
+    SSL_set_accept_state(m_ssl);
+    m_fd = fd;
+    return true;
+}
+
+tls_conn::HANDSHAKE_RESULT tls_conn::handshake()
+{
+    uint64_t start = now_ns();
+    int ret = SSL_accept(m_ssl);
+    stat_handshake_ns += now_ns() - start;
+    if (ret == 1)
+    {
+        m_established = true;
+        m_ktls_send = BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+        m_ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(m_ssl));
+        stat_handshakes++;
+        if (SSL_session_reused(m_ssl))
+        {
+            stat_resumed++;
+        }
+        if (m_ktls_send)
+        {
+            stat_ktls_send++;
+        }
+        if (m_ktls_recv)
+        {
+            stat_ktls_recv++;
+        }
+        return HS_DONE;
+    }
+    switch (SSL_get_error(m_ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        return HS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return HS_WANT_WRITE;
+    default:
+        ERR_clear_error();
+        stat_failed++;
+        return HS_ERROR;
+    }
+}
+
+bool tls_conn::has_pending() const
+{
+    return SSL_has_pending(m_ssl);
+}
+
+int tls_conn::read(char *buf, int len)
+{
+    if (m_ktls_recv)
+    {
+        // 内核只把应用数据交给recv, 遇到告警等控制记录会返回EIO, 按连接出错处理
+        return recv(m_fd, buf, len, 0);
+    }
+    int ret = SSL_read(m_ssl, buf, len);
+    if (ret > 0)
+    {
+        return ret;
+    }
+    switch (SSL_get_error(m_ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        ERR_clear_error();
+        errno = EIO;
+        return -1;
+    }
+}
+
+int tls_conn::writev(const struct iovec *iov, int iovcnt)
+{
+    if (m_ktls_send)
+    {
+        return ::writev(m_fd, iov, iovcnt);
+    }
+    // 没有kTLS只能逐块加密; 返回已经写出的字节数, 一个字节都没写出时才报告EAGAIN
+    int total = 0;
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        if (iov[i].iov_len == 0)
+        {
+            continue;
+        }
+        int ret = SSL_write(m_ssl, iov[i].iov_base, iov[i].iov_len);
+        if (ret > 0)
+        {
+            total += ret;
+            if ((size_t)ret < iov[i].iov_len)
+            {
+                return total;
+            }
+            continue;
+        }
+        int err = SSL_get_error(m_ssl, ret);
+        if (total > 0)
+        {
+            return total;
+        }
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        ERR_clear_error();
+        errno = EPIPE;
+        return -1;
+    }
+    return total;
+}
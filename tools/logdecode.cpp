@@ -0,0 +1,184 @@
+// 把二进制访问日志(配置项access_log)转成文本或CSV
+//
+//   logdecode [-c] [-r doc_root] access-*.log
+//
+// 多个段文件(不同线程、不同序号)的记录按时间合并输出. 路径在日志里只有哈希,
+// -r 给出网站目录时用其中的文件名还原, 认不出的输出成 #哈希
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "../headers/access_log.h"
+
+struct decoded
+{
+    uint64_t time_us;           // 墙上时间
+    access_record r;
+};
+
+static const char *methods[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT"};
+
+static std::map<uint32_t, std::string> names;
+
+static void add_name(const std::string &path)
+{
+    names[access_path_hash(path.data(), path.size())] = path;
+}
+
+// 目录下的每个文件和目录都可能是请求路径
+static void walk(const std::string &root, const std::string &rel)
+{
+    DIR *d = opendir((root + rel).c_str());
+    if (!d)
+    {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+        std::string path = rel + "/" + ent->d_name;
+        struct stat st;
+        if (stat((root + path).c_str(), &st) < 0)
+        {
+            continue;
+        }
+        add_name(path);
+        if (S_ISDIR(st.st_mode))
+        {
+            add_name(path + "/");
+            walk(root, path);
+        }
+    }
+    closedir(d);
+}
+
+static bool read_segment(const char *path, std::vector<decoded> &out)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    access_log_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, ACCESS_LOG_MAGIC, sizeof(h.magic)) != 0
+        || h.record_size != sizeof(access_record) || h.ticks_per_us <= 0)
+    {
+        fprintf(stderr, "%s: not an access log segment\n", path);
+        fclose(f);
+        return false;
+    }
+    decoded d;
+    // 段没有写满时尾部是0
+    while (fread(&d.r, sizeof(d.r), 1, f) == 1 && d.r.tsc != 0)
+    {
+        double offset = ((double)d.r.tsc - (double)h.start_tsc) / h.ticks_per_us;
+        d.time_us = h.start_us + (int64_t)offset;
+        out.push_back(d);
+    }
+    fclose(f);
+    return true;
+}
+
+static std::string path_name(uint32_t hash)
+{
+    if (hash == 0)
+    {
+        return "-";
+    }
+    std::map<uint32_t, std::string>::const_iterator it = names.find(hash);
+    if (it != names.end())
+    {
+        return it->second;
+    }
+    char buf[16];
+    snprintf(buf, sizeof(buf), "#%08x", hash);
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    bool csv = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "cr:")) != -1)
+    {
+        if (opt == 'c')
+        {
+            csv = true;
+        }
+        else if (opt == 'r')
+        {
+            add_name("/");
+            walk(optarg, "");
+        }
+        else
+        {
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind < 1)
+    {
+        fprintf(stderr, "usage: %s [-c] [-r doc_root] segment...\n", argv[0]);
+        return 1;
+    }
+    // 内置的路由
+    const char *builtin[] = {"/status", "/config", "/trace", "/upload"};
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); ++i)
+    {
+        add_name(builtin[i]);
+    }
+
+    std::vector<decoded> all;
+    bool ok = true;
+    for (int i = optind; i < argc; ++i)
+    {
+        ok = read_segment(argv[i], all) && ok;
+    }
+    std::stable_sort(all.begin(), all.end(),
+                     [](const decoded &a, const decoded &b) { return a.time_us < b.time_us; });
+
+    if (csv)
+    {
+        printf("time_us,client,method,path,status,bytes,latency_us,conn,keep_alive,tls,gzip,unix\n");
+    }
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+        const access_record &r = all[i].r;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &r.ip, ip, sizeof(ip));
+        const char *method = r.method < sizeof(methods) / sizeof(methods[0]) ? methods[r.method] : "?";
+        std::string path = path_name(r.path_hash);
+        if (csv)
+        {
+            printf("%llu,%s,%s,%s,%u,%u,%u,%u,%d,%d,%d,%d\n", (unsigned long long)all[i].time_us, ip, method,
+                   path.c_str(), r.status, r.bytes, r.latency_us, r.conn, (r.flags & ACCESS_KEEP_ALIVE) != 0,
+                   (r.flags & ACCESS_TLS) != 0, (r.flags & ACCESS_GZIP) != 0, (r.flags & ACCESS_UNIX) != 0);
+            continue;
+        }
+        // 2026-10-19T08:30:01.123456Z 127.0.0.1 GET /index.html 200 470 85us conn=3 keep-alive
+        time_t sec = all[i].time_us / 1000000;
+        struct tm tm;
+        gmtime_r(&sec, &tm);
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+        printf("%s.%06lluZ %s %s %s %u %u %uus conn=%u%s%s%s%s\n", when,
+               (unsigned long long)(all[i].time_us % 1000000), ip, method, path.c_str(), r.status, r.bytes,
+               r.latency_us, r.conn, r.flags & ACCESS_KEEP_ALIVE ? " keep-alive" : "",
+               r.flags & ACCESS_TLS ? " tls" : "", r.flags & ACCESS_GZIP ? " gzip" : "",
+               r.flags & ACCESS_UNIX ? " unix" : "");
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,289 @@
+// 把网站根目录打成资源包, 服务器用 -p 加载
+//
+//   mkpack <doc_root> <out.pack>
+//
+// 先写到 out.pack.tmp 再rename, 正在运行的服务器收到SIGHUP后原子地换成新包
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "../headers/asset_pack.h"
+
+struct input_file
+{
+    std::string path;           // 请求路径, 以'/'开头
+    std::string body;
+    std::string gzip;
+    bool dir;
+};
+
+static const char *mime_type(const std::string &path)
+{
+    static const char *const types[][2] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"},
+        {".js", "application/javascript"}, {".json", "application/json"}, {".txt", "text/plain"},
+        {".svg", "image/svg+xml"}, {".xml", "application/xml"}, {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"}, {".png", "image/png"}, {".gif", "image/gif"},
+        {".ico", "image/x-icon"}, {".webp", "image/webp"}, {".woff2", "font/woff2"},
+        {".pdf", "application/pdf"}, {".wasm", "application/wasm"},
+    };
+    size_t dot = path.rfind('.');
+    if (dot != std::string::npos)
+    {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i)
+        {
+            if (strcasecmp(path.c_str() + dot, types[i][0]) == 0)
+            {
+                return types[i][1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+static bool read_file(const std::string &file, std::string &out)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        out.append(buf, n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+// gzip只在能省下至少10%时保留, 图片之类已经压缩过的格式通常达不到
+static void compress(input_file &f)
+{
+    if (f.body.size() < 256)
+    {
+        return;
+    }
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15+16: 带gzip头
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return;
+    }
+    std::string out(deflateBound(&zs, f.body.size()), '\0');
+    zs.next_in = (Bytef *)f.body.data();
+    zs.avail_in = f.body.size();
+    zs.next_out = (Bytef *)&out[0];
+    zs.avail_out = out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    size_t len = zs.total_out;
+    deflateEnd(&zs);
+    if (ret == Z_STREAM_END && len < f.body.size() / 10 * 9)
+    {
+        out.resize(len);
+        f.gzip.swap(out);
+    }
+}
+
+static bool walk(const std::string &root, const std::string &rel, std::vector<input_file> &files)
+{
+    std::string dir = root + rel;
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+    {
+        fprintf(stderr, "cannot open %s\n", dir.c_str());
+        return false;
+    }
+    bool ok = true;
+    struct dirent *ent;
+    while (ok && (ent = readdir(d)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+        std::string path = rel + "/" + ent->d_name;
+        struct stat st;
+        if (stat((root + path).c_str(), &st) < 0)
+        {
+            continue;
+        }
+        // 和文件系统模式一样, 其他人不可读的文件不打包, 请求时是404
+        if (!(st.st_mode & S_IROTH))
+        {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            input_file f;
+            f.path = path;
+            f.dir = true;
+            files.push_back(f);
+            ok = walk(root, path, files);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            input_file f;
+            f.path = path;
+            f.dir = false;
+            if (!read_file(root + path, f.body))
+            {
+                fprintf(stderr, "cannot read %s\n", (root + path).c_str());
+                ok = false;
+                break;
+            }
+            compress(f);
+            files.push_back(f);
+        }
+    }
+    closedir(d);
+    return ok;
+}
+
+static uint64_t align_up(uint64_t v)
+{
+    return (v + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s doc_root out.pack\n", argv[0]);
+        return 1;
+    }
+    std::string root = argv[1];
+    while (root.size() > 1 && root[root.size() - 1] == '/')
+    {
+        root.erase(root.size() - 1);
+    }
+    std::vector<input_file> files;
+    if (!walk(root, "", files))
+    {
+        return 1;
+    }
+
+    pack_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.version = PACK_VERSION;
+    header.count = files.size();
+    // 装载因子不超过一半
+    header.slot_count = 1;
+    while (header.slot_count < files.size() * 2 + 1)
+    {
+        header.slot_count <<= 1;
+    }
+    header.entries_off = sizeof(pack_header);
+    header.slots_off = header.entries_off + files.size() * sizeof(pack_entry);
+
+    std::vector<pack_entry> entries(files.size());
+    std::vector<uint32_t> slots(header.slot_count, 0);
+    std::string strings;
+    uint64_t strings_off = header.slots_off + slots.size() * sizeof(uint32_t);
+    char buf[512];
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        const input_file &f = files[i];
+        pack_entry &e = entries[i];
+        memset(&e, 0, sizeof(e));
+        e.hash = pack_hash(f.path.data(), f.path.size());
+        e.flags = f.dir ? PACK_DIR : 0;
+        e.path_off = strings_off + strings.size();
+        e.path_len = f.path.size();
+        strings += f.path;
+
+        snprintf(buf, sizeof(buf), "\"%016llx\"", (unsigned long long)pack_hash(f.body.data(), f.body.size()));
+        std::string etag = buf;
+        e.etag_off = strings_off + strings.size();
+        e.etag_len = etag.size();
+        strings += etag;
+
+        // 有gzip版本时两个版本都要带Vary, 让缓存按Accept-Encoding区分
+        const char *vary = f.gzip.empty() ? "" : "Vary: Accept-Encoding\r\n";
+        snprintf(buf, sizeof(buf), "Content-Length: %zu\r\nContent-Type: %s\r\nETag: %s\r\n%s",
+                 f.body.size(), mime_type(f.path), etag.c_str(), vary);
+        e.headers_off = strings_off + strings.size();
+        e.headers_len = strlen(buf);
+        strings += buf;
+        if (!f.gzip.empty())
+        {
+            snprintf(buf, sizeof(buf), "Content-Length: %zu\r\nContent-Type: %s\r\nContent-Encoding: gzip\r\nETag: %s\r\n%s",
+                     f.gzip.size(), mime_type(f.path), etag.c_str(), vary);
+            e.gzip_headers_off = strings_off + strings.size();
+            e.gzip_headers_len = strlen(buf);
+            strings += buf;
+        }
+
+        uint32_t mask = header.slot_count - 1;
+        uint32_t s = e.hash & mask;
+        while (slots[s] != 0)
+        {
+            s = (s + 1) & mask;
+        }
+        slots[s] = i + 1;
+    }
+
+    // 文件内容页对齐, 发送时直接从映射里writev
+    uint64_t off = align_up(strings_off + strings.size());
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        entries[i].body_off = off;
+        entries[i].body_len = files[i].body.size();
+        off = align_up(off + files[i].body.size());
+        if (!files[i].gzip.empty())
+        {
+            entries[i].gzip_off = off;
+            entries[i].gzip_len = files[i].gzip.size();
+            off = align_up(off + files[i].gzip.size());
+        }
+    }
+    header.total_size = off;
+
+    std::string tmp = std::string(argv[2]) + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (!out)
+    {
+        fprintf(stderr, "cannot create %s\n", tmp.c_str());
+        return 1;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(entries.data(), sizeof(pack_entry), entries.size(), out);
+    fwrite(slots.data(), sizeof(uint32_t), slots.size(), out);
+    fwrite(strings.data(), 1, strings.size(), out);
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        fseek(out, entries[i].body_off, SEEK_SET);
+        fwrite(files[i].body.data(), 1, files[i].body.size(), out);
+        if (!files[i].gzip.empty())
+        {
+            fseek(out, entries[i].gzip_off, SEEK_SET);
+            fwrite(files[i].gzip.data(), 1, files[i].gzip.size(), out);
+        }
+    }
+    // 最后一页补齐, 文件大小等于total_size
+    bool ok = fflush(out) == 0 && ftruncate(fileno(out), off) == 0 && fsync(fileno(out)) == 0;
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), argv[2]) < 0)
+    {
+        fprintf(stderr, "cannot write %s\n", argv[2]);
+        unlink(tmp.c_str());
+        return 1;
+    }
+    size_t gz = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        gz += !files[i].gzip.empty();
+    }
+    printf("%s: %zu entries (%zu gzip), %llu bytes\n", argv[2], files.size(), gz, (unsigned long long)off);
+    return 0;
+}
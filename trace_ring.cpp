@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <vector>
+#include "headers/trace_ring.h"
+#include "headers/locker.h"
+
+static const char *stage_names[TRACE_STAGES] = {
+    "accept", "first_read", "enqueue", "dequeue", "parsed", "ready", "first_write", "last_write"};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 周期计数的起点, 导出时和单调时钟比一下得出频率, 启动时不用专门等待校准
+static const uint64_t start_tsc = trace_clock();
+static const uint64_t start_ns = now_ns();
+
+// 所有线程的环, 只在线程第一次记录和导出时加锁
+static locker rings_lock;
+static std::vector<trace_ring *> rings;
+
+trace_ring &trace_local()
+{
+    static thread_local trace_ring *ring = NULL;
+    if (!ring)
+    {
+        rings_lock.lock();
+        ring = new trace_ring(rings.size());
+        rings.push_back(ring);
+        rings_lock.unlock();
+    }
+    return *ring;
+}
+
+void trace_ring::dump(std::string &out, bool &first, double ticks_per_us, uint64_t base) const
+{
+    uint64_t head = m_head.load(std::memory_order_acquire);
+    uint64_t begin = head > SIZE ? head - SIZE : 0;
+    char buf[320];
+    for (uint64_t i = begin; i < head; ++i)
+    {
+        trace_record r = m_records[i & (SIZE - 1)];
+        // 复制期间写者可能已经绕回来覆盖了这一条(正在写的那一条也算), 这样的记录丢掉;
+        // 栅栏保证复制的读不会被挪到下面重新读m_head之后, 和push里的release栅栏配对
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (i + SIZE <= m_head.load(std::memory_order_relaxed))
+        {
+            continue;
+        }
+
+        // 按时间排序经过的阶段; 一次完成模式下入队在读之前, 顺序和枚举不一样
+        int order[TRACE_STAGES];
+        int n = 0;
+        for (int s = 0; s < TRACE_STAGES; ++s)
+        {
+            if (!r.tsc[s] || r.tsc[s] < base)
+            {
+                continue;
+            }
+            int j = n++;
+            while (j > 0 && r.tsc[order[j - 1]] > r.tsc[s])
+            {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = s;
+        }
+        if (n < 2)
+        {
+            continue;
+        }
+
+        double start = (r.tsc[order[0]] - base) / ticks_per_us;
+        double end = (r.tsc[order[n - 1]] - base) / ticks_per_us;
+        int len = snprintf(buf, sizeof(buf),
+                           "%s{\"name\":\"request\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                           "\"args\":{\"fd\":%d,\"code\":%u,\"method\":%u,\"bytes\":%u,\"thread\":%d}}",
+                           first ? "" : ",\n", r.conn, start, end - start, r.fd, r.code, r.method, r.bytes, m_tid);
+        out.append(buf, len);
+        first = false;
+        for (int k = 1; k < n; ++k)
+        {
+            double from = (r.tsc[order[k - 1]] - base) / ticks_per_us;
+            double to = (r.tsc[order[k]] - base) / ticks_per_us;
+            len = snprintf(buf, sizeof(buf),
+                           ",\n{\"name\":\"%s -> %s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                           stage_names[order[k - 1]], stage_names[order[k]], r.conn, from, to - from);
+            out.append(buf, len);
+        }
+    }
+}
+
+double trace_ticks_per_us()
+{
+    uint64_t tsc = trace_clock();
+    uint64_t ns = now_ns();
+    return ns > start_ns && tsc > start_tsc ? (double)(tsc - start_tsc) * 1000 / (ns - start_ns) : 1000;
+}
+
+std::string trace_dump()
+{
+    double ticks_per_us = trace_ticks_per_us();
+
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool first = true;
+    rings_lock.lock();
+    std::vector<trace_ring *> all = rings;
+    rings_lock.unlock();
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+        all[i]->dump(out, first, ticks_per_us, start_tsc);
+    }
+    out += "\n]}\n";
+    return out;
+}
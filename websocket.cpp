@@ -0,0 +1,252 @@
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include "headers/websocket.h"
+
+void ws_accept_key(const char *key, size_t len, char out[WS_ACCEPT_LEN])
+{
+    static const char GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    std::string s(key, len);
+    s += GUID;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char *)s.data(), s.size(), digest);
+    // EVP_EncodeBlock会在末尾多写一个'\0'
+    unsigned char b64[WS_ACCEPT_LEN + 1];
+    EVP_EncodeBlock(b64, digest, SHA_DIGEST_LENGTH);
+    memcpy(out, b64, WS_ACCEPT_LEN);
+}
+
+ws_session::ws_session(ws_handler *handler, char *buf, size_t size, size_t used)
+    : m_handler(handler), m_in(buf), m_in_size(size), m_in_start(0), m_in_end(used), m_in_payload(false), m_left(0),
+      m_phase(0), m_frame_fin(false), m_msg_opcode(0), m_msg_started(false), m_out_pos(0), m_close_sent(false),
+      m_close_received(false)
+{
+}
+
+ws_session::~ws_session()
+{
+    delete m_handler;
+}
+
+void ws_session::start()
+{
+    m_handler->on_open(*this);
+}
+
+void ws_session::send_frame(int opcode, const char *data, size_t len, bool fin)
+{
+    if (m_close_sent)
+    {
+        return;
+    }
+    // 服务器发出的帧不加掩码
+    char h[10];
+    size_t n = 0;
+    h[n++] = (char)((fin ? 0x80 : 0) | opcode);
+    if (len < 126)
+    {
+        h[n++] = (char)len;
+    }
+    else if (len < 65536)
+    {
+        h[n++] = 126;
+        h[n++] = (char)(len >> 8);
+        h[n++] = (char)len;
+    }
+    else
+    {
+        h[n++] = 127;
+        for (int i = 7; i >= 0; --i)
+        {
+            h[n++] = (char)((uint64_t)len >> (8 * i));
+        }
+    }
+    m_out.append(h, n);
+    m_out.append(data, len);
+}
+
+void ws_session::close(int code)
+{
+    char payload[2] = {(char)(code >> 8), (char)code};
+    send_frame(WS_CLOSE, payload, sizeof(payload), true);
+    m_close_sent = true;
+}
+
+void ws_session::consume(size_t n)
+{
+    m_out_pos += n;
+    if (m_out_pos == m_out.size())
+    {
+        m_out.clear();
+        m_out_pos = 0;
+    }
+}
+
+// 协议错误: 回关闭帧, 不再处理之后的输入
+bool ws_session::fail(int code)
+{
+    if (!m_close_received)
+    {
+        m_close_received = true;
+        close(code);
+        m_handler->on_close(*this, code);
+    }
+    return false;
+}
+
+bool ws_session::handle_control(int opcode, const char *payload, size_t len)
+{
+    switch (opcode)
+    {
+    case WS_PING:
+        send(WS_PONG, payload, len);
+        return true;
+    case WS_PONG:
+        return true;
+    case WS_CLOSE:
+    {
+        if (len == 1)
+        {
+            return fail(WS_CLOSE_PROTOCOL_ERROR);
+        }
+        // 没有状态码时按1005(没有给出)报告
+        int code = len >= 2 ? ((uint8_t)payload[0] << 8 | (uint8_t)payload[1]) : 1005;
+        m_close_received = true;
+        // 回一个带同样状态码的关闭帧, 已经主动关闭过时不再回
+        if (!m_close_sent)
+        {
+            send_frame(WS_CLOSE, payload, len >= 2 ? 2 : 0, true);
+            m_close_sent = true;
+        }
+        m_handler->on_close(*this, code);
+        return true;
+    }
+    default:
+        return fail(WS_CLOSE_PROTOCOL_ERROR);
+    }
+}
+
+bool ws_session::on_input()
+{
+    while (!m_close_received)
+    {
+        char *p = m_in + m_in_start;
+        size_t avail = m_in_end - m_in_start;
+        if (m_in_payload)
+        {
+            // 负载有多少交多少, 不等这一帧收齐
+            size_t n = m_left < avail ? m_left : avail;
+            if (n == 0 && m_left > 0)
+            {
+                break;
+            }
+            ws_mask(p, n, m_key, m_phase);
+            m_phase += n;
+            m_left -= n;
+            m_in_start += n;
+            int opcode = m_msg_opcode;
+            bool last = m_left == 0 && m_frame_fin;
+            if (m_left == 0)
+            {
+                m_in_payload = false;
+                if (m_frame_fin)
+                {
+                    m_msg_opcode = 0;
+                }
+            }
+            // 空的中间帧没有什么可交付的
+            if (n > 0 || last)
+            {
+                bool first = !m_msg_started;
+                m_msg_started = true;
+                m_handler->on_data(*this, opcode, p, n, first, last);
+            }
+            continue;
+        }
+
+        // 帧头: 2字节, 再加2或8字节的扩展长度和4字节的掩码
+        if (avail < 2)
+        {
+            break;
+        }
+        uint8_t b0 = p[0];
+        uint8_t b1 = p[1];
+        // 客户端发来的帧必须加掩码; 没有协商扩展, RSV位必须为0
+        if (!(b1 & 0x80) || (b0 & 0x70))
+        {
+            return fail(WS_CLOSE_PROTOCOL_ERROR);
+        }
+        uint64_t len = b1 & 0x7f;
+        size_t header = 2 + (len == 126 ? 2 : len == 127 ? 8 : 0) + 4;
+        if (avail < header)
+        {
+            break;
+        }
+        if (len == 126)
+        {
+            len = (uint8_t)p[2] << 8 | (uint8_t)p[3];
+        }
+        else if (len == 127)
+        {
+            len = 0;
+            for (int i = 0; i < 8; ++i)
+            {
+                len = len << 8 | (uint8_t)p[2 + i];
+            }
+            if (len >> 63)
+            {
+                return fail(WS_CLOSE_PROTOCOL_ERROR);
+            }
+        }
+        memcpy(m_key, p + header - 4, 4);
+        int opcode = b0 & 0x0f;
+        bool fin = (b0 & 0x80) != 0;
+
+        // 控制帧不能分片, 负载不超过125字节, 收齐了再处理; 可以夹在一条消息的分片之间
+        if (opcode >= WS_CLOSE)
+        {
+            if (!fin || len > 125)
+            {
+                return fail(WS_CLOSE_PROTOCOL_ERROR);
+            }
+            if (avail < header + len)
+            {
+                break;
+            }
+            char *payload = p + header;
+            ws_mask(payload, len, m_key, 0);
+            m_in_start += header + len;
+            if (!handle_control(opcode, payload, len))
+            {
+                return false;
+            }
+            continue;
+        }
+        // 延续帧必须在消息中间, 新消息必须在上一条结束之后
+        if (opcode == WS_CONTINUATION ? m_msg_opcode == 0 : opcode > WS_BINARY || m_msg_opcode != 0)
+        {
+            return fail(WS_CLOSE_PROTOCOL_ERROR);
+        }
+        if (opcode != WS_CONTINUATION)
+        {
+            m_msg_opcode = opcode;
+            m_msg_started = false;
+        }
+        m_in_start += header;
+        m_in_payload = true;
+        m_left = len;
+        m_phase = 0;
+        m_frame_fin = fin;
+    }
+    // 负载都已经交出去了, 剩下的只可能是不完整的帧头或控制帧, 挪到开头
+    if (m_in_start == m_in_end)
+    {
+        m_in_start = m_in_end = 0;
+    }
+    else if (m_in_start > 0)
+    {
+        memmove(m_in, m_in + m_in_start, m_in_end - m_in_start);
+        m_in_end -= m_in_start;
+        m_in_start = 0;
+    }
+    return true;
+}